@@ -12,15 +12,18 @@
 #include "renderer.h"
 #include "scene.h"
 #include "sphericalharmonics.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <string>
 #include <cstdio>
 
 Application* Application::instance = nullptr;
 float cam_speed = 10;
 
-Application::Application(int window_width, int window_height, SDL_Window* window)
+Application::Application(int window_width, int window_height, SDL_Window* window, const char* scene_name)
 {
 	this->window_width = window_width;
 	this->window_height = window_height;
@@ -44,7 +47,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	current_pipeline = DEFERRED;
 	current_illumination = PBR;
 
-	Vector3 offset = Vector3(0, -1000, 0);
+	Vector3 offset = Vector3(0, -1000, 0); //the same as in createScene
 
 	//loads and compiles several shaders from one single file
     //change to "data/shader_atlas_osx.txt" if you are in XCODE
@@ -52,6 +55,9 @@ Application::Application(int window_width, int window_height, SDL_Window* window
         exit(1);
     checkGLErrors();
 
+	//timings of the frame, shown in the debug GUI
+	profiler = new GTR::Profiler();
+
 	// Create camera
 	camera = new Camera();
 	camera->lookAt(Vector3(-150.f, 150.0f, 250.f) + offset, Vector3(0.f, 0.1f, 0.f) + offset, Vector3(0.f, 1.f, 0.f));
@@ -61,53 +67,25 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	renderer = new GTR::Renderer(); //here so we have opengl ready in constructor
 	renderer->initFlags();
 
-	//initialize GBuffers for deferred (create FBO)
-	renderer->gbuffers_fbo = new FBO();
-
-	//create 3 textures of 4 components
-	renderer->gbuffers_fbo->create(window_width, window_height,
-		3, 			//three textures
-		GL_RGBA, 		//four channels
-		GL_UNSIGNED_BYTE, //1 byte
-		true);		//add depth_texture
-
-	//create and FBO
-	renderer->illumination_fbo = new FBO();
-	renderer->volumetrics_fbo = NULL;
-	renderer->volumetrics_fbo = new FBO();
-
-	//create 3 textures of 4 components
-	renderer->illumination_fbo->create(window_width, window_height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
-	renderer->volumetrics_fbo->create(window_width/4, window_height/4, 1, GL_RGBA, GL_UNSIGNED_BYTE, false);
-
+	//the gbuffers, illumination, ssao, volumetrics and reflections targets are created every frame by the render graph (see Renderer::renderDeferred)
 	renderer->irr_fbo = new FBO();
 	renderer->irr_fbo->create(64, 64, 1, GL_RGB, GL_FLOAT);
 
 	renderer->reflections_fbo = new FBO();
 	renderer->reflections_fbo->create(64, 64, 1, GL_RGB, GL_UNSIGNED_BYTE);
 
-	renderer->reflections_component = new FBO();
-	renderer->reflections_component->create(window_width, window_height, 1, GL_RGBA, GL_UNSIGNED_BYTE, false);
-
-	//let's create an FBO to render the AO inside
-	renderer->ssao_fbo = new FBO();
-	renderer->ssao_fbo->create(window_width, window_height);
-
-	//maybe we want to create also one for the blur, in this case just create a texture
-	renderer->ssao_blur = new Texture(renderer->ssao_fbo->width, renderer->ssao_fbo->height);
-
-	renderer->depth_texture_aux = new Texture(renderer->gbuffers_fbo->depth_texture->width, renderer->gbuffers_fbo->depth_texture->height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, false);
-	renderer->normal_texture_aux = new Texture(renderer->gbuffers_fbo->color_textures[1]->width, renderer->gbuffers_fbo->color_textures[1]->height, GL_RGBA, GL_UNSIGNED_BYTE, false);
+	renderer->random_points = GTR::generateSpherePoints(renderer->number_points, renderer->sphere_radius, renderer->use_ssao_plus);	//SSAO+ default
 
 	//Create Scene
-	GTR::Scene* scene = new GTR::Scene();
+	if (!createScene(scene_name))
+		exit(1);
 
-	GTR::Prefab* scene_prefab = GTR::Prefab::Get("data/prefabs/brutalism/scene.gltf");
-	scene_prefab->root.model.rotate(PI/2.0, Vector3(0,1,0));
-	scene_prefab->root.model.translateGlobal(0, 0, -200);
-	scene_prefab->root.model.scale(100, 100, 100);
-	scene->AddEntity(new GTR::PrefabEntity(scene_prefab, offset));
+	//hide the cursor
+	SDL_ShowCursor(!mouse_locked); //hide or show the mouse
+}
 
+static GTR::PrefabEntity* createFloor(Vector3 position)
+{
 	Mesh* plane_mesh = new Mesh();
 	plane_mesh->createPlane(2048.0f);
 	GTR::Node plane_node = GTR::Node();
@@ -119,18 +97,16 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	GTR::Prefab* floor = new GTR::Prefab();
 	floor->root = plane_node;
 	floor->name = "Floor_Node";
-	scene->AddEntity(new GTR::PrefabEntity(floor, Vector3(0,-27,0) + offset, Vector3(0,0,0), "Floor"));
-
-	GTR::Prefab* car_prefab = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
-	scene->AddEntity(new GTR::PrefabEntity(car_prefab, Vector3(450, -28, 0) + offset, Vector3(0,0,0),"Car")); //last prefab is the car, due to the blend materials
+	return new GTR::PrefabEntity(floor, position, Vector3(0,0,0), "Floor");
+}
 
+//the sun and the two spots of the project, the volumetrics use the shadowmaps of the first three lights
+static void addSceneLights(GTR::Scene* scene, Vector3 offset)
+{
 	GTR::Light* sun = new GTR::Light(Color::WHITE, Vector3(0, 0, 0) + offset, Vector3(0.8, -0.45, -0.4), "Sun", GTR::DIRECTIONAL, 5);
 	sun->ortho_cam_size = 1000;
 	sun->initializeLightCamera();
 
-	//pick the texture used for the skybox
-	scene->environment = GTR::CubemapFromHDRE("data/textures/panorama.hdre");
-
 	GTR::Light* spot1 = new GTR::Light(Color::RED, Vector3(-60, 100, 0) + offset, Vector3(0.45, -0.8, -0.35), "Spot1", GTR::SPOT, 20);
 	spot1->spot_cutoff_in_deg = 70;
 	spot1->initializeLightCamera();
@@ -142,52 +118,113 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	scene->AddEntity(sun);
 	scene->AddEntity(spot1);
 	scene->AddEntity(spot2);
+}
 
-	renderer->random_points = GTR::generateSpherePoints(renderer->number_points, renderer->sphere_radius, renderer->use_ssao_plus);	//SSAO+ default
+//"brutalism" is the scene of the project. The benchmarks also use one prefab of data/prefabs by its folder name
+//(gmc, house, lamp...) and "stress", a grid of cars with many point lights
+bool Application::createScene(const char* name)
+{
+	Vector3 offset = Vector3(0, -1000, 0);
+	GTR::Scene* scene = new GTR::Scene();
+
+	//pick the texture used for the skybox
+	scene->environment = GTR::CubemapFromHDRE("data/textures/panorama.hdre");
+
+	if (strcmp(name, "brutalism") == 0)
+	{
+		GTR::Prefab* scene_prefab = GTR::Prefab::Get("data/prefabs/brutalism/scene.gltf");
+		scene_prefab->root.model.rotate(PI/2.0, Vector3(0,1,0));
+		scene_prefab->root.model.translateGlobal(0, 0, -200);
+		scene_prefab->root.model.scale(100, 100, 100);
+		scene->AddEntity(new GTR::PrefabEntity(scene_prefab, offset));
 
-	if (current_pipeline == DEFERRED) //probes only working on deferred for the moment
+		scene->AddEntity(createFloor(Vector3(0,-27,0) + offset));
+
+		GTR::Prefab* car_prefab = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
+		scene->AddEntity(new GTR::PrefabEntity(car_prefab, Vector3(450, -28, 0) + offset, Vector3(0,0,0),"Car")); //last prefab is the car, due to the blend materials
+
+		addSceneLights(scene, offset);
+
+		if (current_pipeline == DEFERRED) //probes only working on deferred for the moment
+		{
+			renderer->show_light_meshes = false;
+			scene->defineIrradianceGrid(offset);
+			scene->defineReflectionGrid(offset);
+			renderer->show_light_meshes = true;
+		}
+		return true;
+	}
+
+	if (strcmp(name, "stress") == 0)
+	{
+		scene->AddEntity(createFloor(Vector3(0,-27,0) + offset));
+		GTR::Prefab* car_prefab = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
+		for (int z = -4; z < 4; ++z)
+			for (int x = -4; x < 4; ++x)
+				scene->AddEntity(new GTR::PrefabEntity(car_prefab, Vector3(x * 250.0f + 125.0f, -28, z * 250.0f + 125.0f) + offset, Vector3(0,0,0), "Car"));
+
+		addSceneLights(scene, offset);
+		//the point lights do not cast shadows, it stresses the lighting and not the shadowmaps
+		for (int i = 0; i < 64; ++i)
+		{
+			Color color((unsigned char)random(255), (unsigned char)random(255), (unsigned char)random(255), 255);
+			Vector3 position(random(2000.0f) - 1000.0f, 20.0f + random(80.0f), random(2000.0f) - 1000.0f);
+			GTR::Light* light = new GTR::Light(color, position + offset, Vector3(0, -1, 0), "Point", GTR::POINT, 10);
+			light->max_distance = 300;
+			light->cast_shadows = false;
+			delete light->shadow_fbo;
+			light->shadow_fbo = NULL;
+			scene->AddEntity(light);
+		}
+		camera->lookAt(Vector3(-1000.f, 500.0f, 1000.f) + offset, offset, Vector3(0.f, 1.f, 0.f));
+		return true;
+	}
+
+	GTR::Prefab* prefab = GTR::Prefab::Get((std::string("data/prefabs/") + name + "/scene.gltf").c_str());
+	if (!prefab)
 	{
-		renderer->show_light_meshes = false;
-		scene->defineIrradianceGrid(offset);
-		scene->defineReflectionGrid(offset);
-		renderer->show_light_meshes = true;
+		std::cout << "[ERROR]: unknown scene " << name << std::endl;
+		return false;
 	}
 
-	//hide the cursor
-	SDL_ShowCursor(!mouse_locked); //hide or show the mouse
+	//on the floor, and the camera looking at it from its size
+	BoundingBox& box = prefab->bounding;
+	scene->AddEntity(createFloor(Vector3(0, box.center.y - box.halfsize.y, 0) + offset));
+	scene->AddEntity(new GTR::PrefabEntity(prefab, offset, Vector3(0,0,0), name));
+	addSceneLights(scene, offset);
+	float radius = std::max((float)box.halfsize.length(), 1.0f);
+	camera->lookAt(box.center + offset + Vector3(-0.8f, 0.5f, 1.0f) * radius * 1.6f, box.center + offset, Vector3(0.f, 1.f, 0.f));
+	return true;
 }
 
-
 //what to do when the image has to be draw
 void Application::render(void)
 {
+	TRACE_SCOPE("Application::render");
 	GTR::Scene* scene = GTR::Scene::instance;
 
 	if (current_pipeline == DEFERRED) 
 	{
 		// STORE RENDER INTO BUFFERS
-		renderer->shadow_caster_lights = renderer->renderSceneShadowmaps(scene);
-		renderer->renderGBuffers(scene, camera);
-		if (renderer->use_ssao) renderer->renderSSAO(camera);
-		renderer->renderIlluminationToBuffer(camera);
-		renderer->forward_for_blends = true;
-		renderer->renderSceneForward(scene, camera);
-		renderer->forward_for_blends = false;
-
-		renderer->illumination_fbo->unbind();
-
-		// SHOW BUFFERS TO VIEWPORT
-		//set default flags
-		glDisable(GL_BLEND);
-		glDisable(GL_DEPTH_TEST);
-		glEnable(GL_CULL_FACE);
-		glFrontFace(GL_CCW);
-		
-		renderer->renderToViewport(camera, scene);
+		{
+			PROFILE_SCOPE("Shadowmaps");
+			renderer->shadow_caster_lights = renderer->renderSceneShadowmaps(scene);
+		}
+		{
+			PROFILE_SCOPE("Dynamic irradiance");
+			renderer->updateDynamicIrradiance(scene);
+		}
 
+		// STORE RENDER INTO BUFFERS AND SHOW THEM TO VIEWPORT (every pass of the graph is profiled)
+		renderer->renderDeferred(scene, camera);
 	}
 	else {
-		renderer->shadow_caster_lights = renderer->renderSceneShadowmaps(scene);
+		{
+			PROFILE_SCOPE("Shadowmaps");
+			renderer->shadow_caster_lights = renderer->renderSceneShadowmaps(scene);
+		}
+		PROFILE_SCOPE("Forward");
+		renderer->updateOcclusion(scene, camera);
 		renderer->renderSceneForward(scene, camera);
 		renderer->showSceneShadowmaps();
 	}
@@ -227,6 +264,7 @@ void Application::renderDebugGUI(void)
 		ImGui::TreePop();
 	}
 	ImGui::Checkbox("Wireframe", &render_wireframe);
+	ImGui::Checkbox("Shader hot reload", &Shader::s_hot_reload);
 	ImGui::Separator();
 
 	if (ImGui::CollapsingHeader("Renderer")) {
@@ -235,6 +273,14 @@ void Application::renderDebugGUI(void)
 
 	ImGui::Separator();
 
+	if (ImGui::CollapsingHeader("Profiler"))
+	{
+		profiler->renderInMenu();
+		GTR::Tracer::renderInMenu();
+	}
+
+	ImGui::Separator();
+
 	//add info to the debug panel about the scene
 	if (ImGui::CollapsingHeader("Scene"))
 		scene->renderInMenu();
@@ -244,6 +290,10 @@ void Application::renderDebugGUI(void)
 
 void Application::update(double seconds_elapsed)
 {
+	TRACE_SCOPE("Application::update");
+	//recompiles the shaders edited in the atlas
+	Shader::UpdateHotReload();
+
 	float speed = seconds_elapsed * cam_speed * 3; //the speed is defined by the seconds_elapsed so it goes constant
 	float orbit_speed = seconds_elapsed * 0.5;
 	
@@ -462,36 +512,7 @@ void Application::onResize(int width, int height)
 	window_width = width;
 	window_height = height;
 
-	//Update FBO's
-	renderer->gbuffers_fbo->~FBO();
-	renderer->gbuffers_fbo->create(window_width, window_height,
-		3, 	
-		GL_RGBA, 	
-		GL_UNSIGNED_BYTE, 
-		true);
-
-	renderer->illumination_fbo->~FBO();
-	renderer->illumination_fbo->create(window_width, window_height,
-		1, 	
-		GL_RGB, 	
-		GL_UNSIGNED_BYTE,
-		false);	
-
-	renderer->volumetrics_fbo->~FBO();
-	renderer->volumetrics_fbo->create(window_width, window_height,
-		1,
-		GL_RGBA,
-		GL_UNSIGNED_BYTE,
-		false);
-
-	renderer->depth_texture_aux->~Texture();
-	renderer->depth_texture_aux = new Texture(renderer->gbuffers_fbo->depth_texture->width, renderer->gbuffers_fbo->depth_texture->height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, false);
-
-	renderer->normal_texture_aux->~Texture();
-	renderer->normal_texture_aux = new Texture(renderer->gbuffers_fbo->color_textures[1]->width, renderer->gbuffers_fbo->color_textures[1]->height, GL_RGBA, GL_UNSIGNED_BYTE, false);
-
-	renderer->reflections_component->~FBO();
-	renderer->reflections_component->create(window_width, window_height, 1, GL_RGBA, GL_UNSIGNED_BYTE, false);
-
+	//Update FBO's (the render graph creates its targets again with the new size)
+	renderer->render_graph->resize(window_width, window_height);
 }
 
@@ -10,6 +10,7 @@
 #include "utils.h"
 #include "BaseEntity.h"
 #include "renderer.h"
+#include "profiler.h"
 
 class Application
 {
@@ -17,6 +18,7 @@ public:
 	static Application* instance;
 
 	GTR::Renderer* renderer = nullptr;
+	GTR::Profiler* profiler = nullptr;
 
 	//window
 	SDL_Window* window;
@@ -52,7 +54,10 @@ public:
 	bool mouse_locked; //tells if the mouse is locked (blocked in the center and not visible)
 	bool render_wireframe; //in case we want to render everything in wireframe mode
 
-	Application( int window_width, int window_height, SDL_Window* window );
+	Application( int window_width, int window_height, SDL_Window* window, const char* scene_name = "brutalism" );
+
+	//creates the scene with that name, returns false if it does not exist
+	bool createScene(const char* name);
 
 	//main functions
 	void render( void );
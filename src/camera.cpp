@@ -8,6 +8,7 @@ Camera* Camera::current = NULL;
 
 Camera::Camera()
 {
+	jitter = Vector2(0, 0);
 	lookAt( Vector3(0, 0, 0), Vector3(0, 0, -1), Vector3(0, 1, 0) );
 	setOrthographic(-100,100,-100, 100,-100,100);
 }
@@ -48,6 +49,21 @@ void Camera::updateProjectionMatrix()
 	else
 		projection_matrix.perspective(fov, aspect, near_plane, far_plane);
 
+	//moves the whole image (x_ndc = x_clip / w_clip, and w_clip is -z in perspective)
+	if (jitter.x != 0.0f || jitter.y != 0.0f)
+	{
+		if (type == ORTHOGRAPHIC)
+		{
+			projection_matrix.M[3][0] += jitter.x;
+			projection_matrix.M[3][1] += jitter.y;
+		}
+		else
+		{
+			projection_matrix.M[2][0] -= jitter.x;
+			projection_matrix.M[2][1] -= jitter.y;
+		}
+	}
+
 	viewprojection_matrix = view_matrix * projection_matrix;
 
 	extractFrustum();
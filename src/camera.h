@@ -28,6 +28,7 @@ public:
 	float aspect;		//aspect ratio (width/height)
 	float near_plane;	//near plane
 	float far_plane;	//far plane
+	Vector2 jitter;		//subpixel offset in NDC added to the projection (TAA)
 
 	//for orthogonal projection
 	float left,right,top,bottom;
@@ -0,0 +1,26 @@
+#include "exposure.h"
+
+#include <algorithm>
+#include <math.h>
+
+float averageLuminance(FloatImage& image, float min_luminance, float max_luminance)
+{
+	double sum = 0.0;
+	for (int y = 0; y < LUMINANCE_SIZE; ++y)
+		for (int x = 0; x < LUMINANCE_SIZE; ++x)
+		{
+			//same texel the quad reads at the center of every pixel of the target
+			int px = std::min((int)((x + 0.5f) / LUMINANCE_SIZE * image.width), (int)image.width - 1);
+			int py = std::min((int)((y + 0.5f) / LUMINANCE_SIZE * image.height), (int)image.height - 1);
+			Vector4 color = image.getPixel(px, py);
+			float lum = color.x * 0.2126f + color.y * 0.7152f + color.z * 0.0722f;
+			sum += log(clamp(lum, min_luminance, max_luminance));
+		}
+	return (float)exp(sum / (LUMINANCE_SIZE * LUMINANCE_SIZE));
+}
+
+float adaptLuminance(float current, float target, float elapsed_time, float speed_up, float speed_down)
+{
+	float speed = target > current ? speed_up : speed_down;
+	return current + (target - current) * (1.0f - expf(-elapsed_time * speed));
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "framework.h"
+#include "texture.h"
+
+//CPU reference of the auto exposure (see luminanceLog.fs and exposureAdapt.fs in the atlas),
+//it follows the same steps so the results can be compared with the values computed on the GPU
+
+//size of the log luminance target, its mip chain is the reduction
+const int LUMINANCE_SIZE = 256;
+
+//average of the log luminance of a LUMINANCE_SIZE^2 grid of samples of the image (nearest), returned as luminance (geometric mean).
+//the luminance of every sample is clamped to the range so a few very dark or bright pixels do not dominate
+float averageLuminance(FloatImage& image, float min_luminance, float max_luminance);
+
+//moves the adapted luminance towards the target, with different speeds when the frame gets brighter or darker
+float adaptLuminance(float current, float target, float elapsed_time, float speed_up, float speed_down);
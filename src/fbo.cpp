@@ -2,6 +2,9 @@
 #include <cassert>
 #include "utils.h"
 
+int64_t FBO::num_binds = 0;
+GLuint FBO::screen_fbo_id = 0;
+
 FBO::FBO()
 {
 	fbo_id = 0;
@@ -14,6 +17,8 @@ FBO::FBO()
 	owns_textures = false;
 	width = 0;
 	height = 0;
+	mip_level = 0;
+	viewport_scale = 1.0f;
 }
 
 FBO::~FBO()
@@ -85,37 +90,40 @@ bool FBO::create( int width, int height, int num_textures, int format, int type,
 	return setTextures(textures, depth_texture);
 }
 
-bool FBO::setTexture(Texture* texture, int cubemap_face )
+bool FBO::setTexture(Texture* texture, int cubemap_face, int mip_level)
 {
 	std::vector<Texture*> textures;
 	if(texture->format == GL_DEPTH_COMPONENT)
-		setTextures(textures, texture, cubemap_face);
+		setTextures(textures, texture, cubemap_face, mip_level);
 	else
 	{
 		textures.push_back(texture);
-		setTextures(textures, NULL, cubemap_face);
+		setTextures(textures, NULL, cubemap_face, mip_level);
 	}
 	return true;
 }
 
-bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, int cubemap_face)
+bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, int cubemap_face, int mip_level)
 {
 	assert(textures.size() >= 0 && textures.size() <= 4);
 	assert(glGetError() == GL_NO_ERROR);
 	assert(textures.size() || depth_texture ); //at least one texture
 	int format = 0; //RGB,RGBA
 	int type = 0;//UNSIGNED_BYTE
+	int prev_width = width;
+	int prev_height = height;
+	this->mip_level = mip_level;
 	if (textures.size())
 	{
-		width = (int)textures[0]->width;
-		height = (int)textures[0]->height;
+		width = (int)textures[0]->width >> mip_level;
+		height = (int)textures[0]->height >> mip_level;
 		format = (int)textures[0]->format;
 		type = (int)textures[0]->type;
 	}
 	else
 	{
-		width = depth_texture->width;
-		height = depth_texture->height;
+		width = (int)depth_texture->width >> mip_level;
+		height = (int)depth_texture->height >> mip_level;
 	}
 
 	//create and bind FBO
@@ -126,15 +134,18 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 
 	if (depth_texture)
 	{
-		glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture->texture_id, 0);
+		glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture->texture_id, mip_level);
 		this->depth_texture = depth_texture;
 	}
 	else
 	{
+		//when switching between textures of the same size (like the faces of a cubemap) we can keep the old storage
+		bool realloc_depth = !renderbuffer_depth || prev_width != width || prev_height != height;
 		if (!renderbuffer_depth)
 			glGenRenderbuffers(1, &renderbuffer_depth);
 		glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer_depth);
-		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
+		if (realloc_depth)
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
 		glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffer_depth);
 	}
 	checkGLErrors();
@@ -146,7 +157,7 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 	for (int i = 0; i < 4; ++i)
 	{
 		Texture* texture = i < textures.size() ? textures[i] : NULL;
-		assert(!texture || (texture->width == width && texture->height == height)); //incorrect size, textures must have same size
+		assert(!texture || (((int)texture->width >> mip_level) == width && ((int)texture->height >> mip_level) == height)); //incorrect size, textures must have same size
 		assert(!texture || (texture->type == type && texture->format == format)); //incorrect texture format
 
 		if (texture)
@@ -154,11 +165,11 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 			if (texture->texture_type == GL_TEXTURE_CUBE_MAP)
 			{
 				assert(cubemap_face != -1); //MUST SPECIFY CUBEMAP FACE
-				glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT + i, GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubemap_face, texture ? texture->texture_id : NULL, 0);
+				glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT + i, GL_TEXTURE_CUBE_MAP_POSITIVE_X + cubemap_face, texture ? texture->texture_id : NULL, mip_level);
 			}
 			else
 			{
-				glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT + i, GL_TEXTURE_2D, texture ? texture->texture_id : NULL, 0);
+				glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT + i, GL_TEXTURE_2D, texture ? texture->texture_id : NULL, mip_level);
 			}
 			bufs[i] = GL_COLOR_ATTACHMENT0_EXT + i;
 		}
@@ -191,7 +202,7 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 		assert(0);
 		return false;
 	}
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, screen_fbo_id);
 
 	checkGLErrors();
 	return true;
@@ -222,12 +233,53 @@ bool FBO::setDepthOnly(int width, int height)
 		std::cout << "Error: Framebuffer object is not completed" << std::endl;
 		return false;
 	}
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, screen_fbo_id);
+	return true;
+}
+
+bool FBO::createLayered(int width, int height, int layers, int format, int type)
+{
+	assert(glGetError() == GL_NO_ERROR);
+	freeTextures();
+
+	Texture* color = new Texture();
+	color->create2DArray(width, height, layers, format, type);
+	Texture* depth = new Texture();
+	depth->create2DArray(width, height, layers, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_DEPTH_COMPONENT24);
+	owns_textures = true;
+
+	this->width = width;
+	this->height = height;
+	mip_level = 0;
+	memset(bufs, 0, sizeof(bufs));
+	color_textures[0] = color;
+	depth_texture = depth;
+	num_color_textures = 1;
+	bufs[0] = GL_COLOR_ATTACHMENT0;
+
+	if (fbo_id == 0)
+		glGenFramebuffers(1, &fbo_id);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo_id);
+
+	//attached without a layer, every draw call writes to the layers chosen by its primitives
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, color->texture_id, 0);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth->texture_id, 0);
+	glDrawBuffers(4, bufs);
+
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, screen_fbo_id);
+	checkGLErrors();
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		std::cout << "Error: Layered framebuffer object is not completed: " << status << std::endl;
+		return false;
+	}
 	return true;
 }
 
 void FBO::bind()
 {
+	num_binds++;
 	assert(glGetError() == GL_NO_ERROR);
 	Texture* tex = color_textures[0] ? color_textures[0] : depth_texture;
 	assert(tex && "framebuffer without texture");
@@ -235,7 +287,14 @@ void FBO::bind()
 	checkGLErrors();
 	glPushAttrib(GL_VIEWPORT_BIT);
 	glDrawBuffers(4, bufs);
-	glViewport(0, 0, (int)tex->width, (int)tex->height);
+	int w = (int)tex->width >> mip_level;
+	int h = (int)tex->height >> mip_level;
+	if (viewport_scale != 1.0f)
+	{
+		w = w * viewport_scale > 1.0f ? (int)(w * viewport_scale) : 1;
+		h = h * viewport_scale > 1.0f ? (int)(h * viewport_scale) : 1;
+	}
+	glViewport(0, 0, w, h);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
@@ -245,7 +304,7 @@ void FBO::unbind()
 {
 	// output goes to the FBO and its attached buffers
 	glPopAttrib();
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, screen_fbo_id);
 	//glDrawBuffers(1, &one_buffer);
 	assert(glGetError() == GL_NO_ERROR);
 }
@@ -17,17 +17,23 @@ public:
 	int width;
 	int height;
 	bool owns_textures;
+	int mip_level; //mip level of the attached textures
+	float viewport_scale; //part of the textures used when binding (dynamic resolution renders in the bottom-left corner)
 
 	GLuint renderbuffer_color;
 	GLuint renderbuffer_depth;//not used
 
+	static int64_t num_binds; //render stats, it only grows (see Profiler::sRenderStats)
+	static GLuint screen_fbo_id; //framebuffer bound when unbinding, 0 is the window (the headless mode renders the frame to an FBO)
+
 	FBO();
 	~FBO();
 
 	bool create(int width, int height, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool use_depth_texture = true );
-	bool setTexture(Texture* texture, int cubemap_face = -1);
-	bool setTextures(std::vector<Texture*> textures, Texture* depth = NULL, int cubemap_face = -1);
+	bool setTexture(Texture* texture, int cubemap_face = -1, int mip_level = 0);
+	bool setTextures(std::vector<Texture*> textures, Texture* depth = NULL, int cubemap_face = -1, int mip_level = 0);
 	bool setDepthOnly(int width, int height); //use this for shadowmaps
+	bool createLayered(int width, int height, int layers, int format = GL_RGB, int type = GL_UNSIGNED_BYTE); //2D array textures, the geometry shader chooses the layer (gl_Layer)
 	
 	void bind();
 	void unbind();
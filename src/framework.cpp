@@ -26,9 +26,8 @@ float Vector2::perpdot( const Vector2& v )
 
 void Vector2::random(float range)
 {
-	//rand returns a value between 0 and RAND_MAX
-	x = (float)(rand() / (double)RAND_MAX) * 2 * range - range; //value between -range and range
-	y = (float)(rand() / (double)RAND_MAX) * 2 * range - range; //value between -range and range
+	x = ::random(2 * range) - range; //value between -range and range
+	y = ::random(2 * range) - range; //value between -range and range
 }
 
 void Vector2::parseFromText(const char* text)
@@ -105,18 +104,16 @@ float Vector3::dot( const Vector3& v ) const
 
 void Vector3::random(float range)
 {
-	//rand returns a value between 0 and RAND_MAX
-	x = (float)((rand() / (double)RAND_MAX) * 2 * range - range); //value between -range and range
-	y = (float)((rand() / (double)RAND_MAX) * 2 * range - range); //value between -range and range
-	z = (float)((rand() / (double)RAND_MAX) * 2 * range - range); //value between -range and range
+	x = ::random(2 * range) - range; //value between -range and range
+	y = ::random(2 * range) - range; //value between -range and range
+	z = ::random(2 * range) - range; //value between -range and range
 }
 
 void Vector3::random(Vector3 range)
 {
-	//rand returns a value between 0 and RAND_MAX
-	x = (float)((rand() / (double)RAND_MAX) * 2 * range.x - range.x); //value between -range and range
-	y = (float)((rand() / (double)RAND_MAX) * 2 * range.y - range.y); //value between -range and range
-	z = (float)((rand() / (double)RAND_MAX) * 2 * range.z - range.z); //value between -range and range
+	x = ::random(2 * range.x) - range.x; //value between -range and range
+	y = ::random(2 * range.y) - range.y; //value between -range and range
+	z = ::random(2 * range.z) - range.z; //value between -range and range
 }
 
 void Vector3::setMin(const Vector3 & v)
@@ -175,6 +172,11 @@ Vector3 cross(const Vector3& a, const Vector3& b)
 	return Vector3(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
 }
 
+Vector3 lerp(const Vector3& a, const Vector3& b, float v)
+{
+	return a * (1.0f - v) + b * v;
+}
+
 //*********************************
 const Matrix44 Matrix44::IDENTITY;
 
@@ -1227,6 +1229,26 @@ void Quaternion::setAxisAngle(float ax, float ay, float az, float angle)
 
 }
 
+static unsigned int random_state = 0x2545F491u;
+
+void setRandomSeed(unsigned int seed)
+{
+	//the state of a xorshift cannot be 0
+	random_state = seed * 0x9E3779B9u + 0x2545F491u;
+	if (!random_state)
+		random_state = 0x2545F491u;
+}
+
+unsigned int randomUInt()
+{
+	unsigned int x = random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	random_state = x;
+	return x;
+}
+
 float ComputeSignedAngle(Vector2 a, Vector2 b)
 {
 	a.normalize();
@@ -387,8 +387,12 @@ bool RayBoundingBoxCollision(const BoundingBox& box, const Vector3& ray_origin,
 bool BoundingBoxSphereOverlap(const BoundingBox& box, const Vector3& center, float radius );
 Vector3 reflect(const Vector3& I, const Vector3& N);
 
+//random numbers from a seed (xorshift), unlike rand() the sequence is the same in every platform and run
+void setRandomSeed(unsigned int seed);
+unsigned int randomUInt();
+
 //value between 0 and 1
-inline float random(float range = 1.0f, int offset = 0) { return ((rand() % 1000) / (1000.0f)) * range + offset; }
+inline float random(float range = 1.0f, int offset = 0) { return (randomUInt() >> 8) * (1.0f / 16777216.0f) * range + offset; }
 
 
 typedef Vector3 vec2;
@@ -7,6 +7,7 @@
 #include "texture.h"
 #include "material.h"
 #include "prefab.h"
+#include "trace.h"
 
 #include <iostream>
 
@@ -149,6 +150,15 @@ void parseGLTFBufferIndices(std::vector<Vector3u>& container, cgltf_accessor* ac
 	}
 }
 
+//name of the bin of a submesh, without the characters that are not valid in a filename
+static std::string getBinName(std::string name)
+{
+	for (char& c : name)
+		if (!isalnum((unsigned char)c) && c != '_' && c != '-' && c != '.')
+			c = '_';
+	return name + ".lods";
+}
+
 std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
 {
 	std::vector<Mesh*> result;
@@ -175,40 +185,57 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
 		}
 
 		mesh = new Mesh();
-		
-		//streams
-		for (int j = 0; j < primitive->attributes_count; ++j)
+
+		//the simplification takes time, the streams and the levels of detail are cached in a bin next to the gltf
+		std::string bin_filename;
+		if (meshdata->name && Mesh::use_binary && Mesh::generate_lods)
+			bin_filename = base_folder + "/" + getBinName(submesh_name);
+
+		if (bin_filename.empty() || Mesh::rebuild_bins || !mesh->readBin((bin_filename + ".mbin").c_str()))
 		{
-			cgltf_attribute* attr = &primitive->attributes[j];
-			//std::string attrname = attr->name;
-			if (attr->type == cgltf_attribute_type_position)
+			//streams
+			for (int j = 0; j < primitive->attributes_count; ++j)
 			{
-				parseGLTFBufferVector3(mesh->vertices, attr->data);
-				if (attr->data->has_min && attr->data->has_max)
+				cgltf_attribute* attr = &primitive->attributes[j];
+				//std::string attrname = attr->name;
+				if (attr->type == cgltf_attribute_type_position)
 				{
-					mesh->aabb_min = attr->data->min;
-					mesh->aabb_max = attr->data->max;
-					mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
-					mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
+					parseGLTFBufferVector3(mesh->vertices, attr->data);
+					if (attr->data->has_min && attr->data->has_max)
+					{
+						mesh->aabb_min = attr->data->min;
+						mesh->aabb_max = attr->data->max;
+						mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
+						mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
+					}
+					else
+						mesh->updateBoundingBox();
 				}
-				else
-					mesh->updateBoundingBox();
+				else if (attr->type == cgltf_attribute_type_normal)
+					parseGLTFBufferVector3(mesh->normals, attr->data);
+				else if (attr->type == cgltf_attribute_type_texcoord)
+				{
+					if ( strcmp( attr->name,"TEXCOORD_1") == 0 ) //secondary UV set
+						parseGLTFBufferVector2(mesh->uvs1, attr->data);
+					else
+						parseGLTFBufferVector2(mesh->uvs, attr->data);
+				}
+
+				if (primitive->indices && primitive->indices->count)
+					parseGLTFBufferIndices(mesh->indices, primitive->indices);
 			}
-			else if (attr->type == cgltf_attribute_type_normal)
-				parseGLTFBufferVector3(mesh->normals, attr->data);
-			else if (attr->type == cgltf_attribute_type_texcoord)
+
+			if (Mesh::generate_lods)
 			{
-				if ( strcmp( attr->name,"TEXCOORD_1") == 0 ) //secondary UV set
-					parseGLTFBufferVector2(mesh->uvs1, attr->data);
-				else
-					parseGLTFBufferVector2(mesh->uvs, attr->data);
+				mesh->name = submesh_name;
+				mesh->generateLODs();
 			}
-
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->indices, primitive->indices);
+			if (bin_filename.size())
+				mesh->writeBin(bin_filename.c_str());
 		}
 
-		mesh->uploadToVRAM();
+		if (Mesh::auto_upload_to_vram)
+			mesh->uploadToVRAM();
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
 		result.push_back(mesh);
@@ -370,6 +397,7 @@ GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
 
 GTR::Prefab* loadGLTF(const char* filename)
 {
+	TRACE_SCOPE_DETAIL("loadGLTF", filename);
 	std::cout << "loading gltf... " << filename << std::endl;
 	cgltf_options options;
 	memset(&options, 0, sizeof(cgltf_options));
@@ -2,4 +2,6 @@
 
 #include "prefab.h"
 
+extern bool load_textures; //disabled by the tools that only need the meshes
+
 GTR::Prefab* loadGLTF(const char* filename);
@@ -0,0 +1,521 @@
+#include "headless.h"
+#include "application.h"
+#include "camera.h"
+#include "fbo.h"
+#include "profiler.h"
+#include "texture.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#ifndef WIN32
+	#include <spawn.h>
+	#include <sys/wait.h>
+	extern char** environ;
+#endif
+
+using namespace GTR;
+
+const char* GTR::benchmark_scenes[BENCHMARK_SCENES] = { "brutalism", "gmc", "house", "lamp", "stress" };
+
+sHeadlessOptions::sHeadlessOptions()
+{
+	scene = "brutalism";
+	frames = 300;
+	warmup_frames = 30;
+	time_step = 1.0f / 60.0f;
+	seed = 1;
+	camera_path = NULL;
+	capture_folder = NULL;
+	capture_every = 60;
+	golden_folder = NULL;
+	strict_golden = false;
+	update_golden = false;
+	golden_threshold = 0.05f;
+	golden_max_pixels = 0.005f;
+	report_filename = NULL;
+}
+
+bool CameraPath::load(const char* filename)
+{
+	std::string content;
+	if (!readFile(filename, content))
+	{
+		std::cout << "[ERROR]: camera path not found: " << filename << std::endl;
+		return false;
+	}
+
+	keys.clear();
+	std::stringstream lines(content);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		sKey key;
+		if (line.empty() || line[0] == '#')
+			continue;
+		if (sscanf(line.c_str(), "%f %f %f %f %f %f %f", &key.time, &key.eye.x, &key.eye.y, &key.eye.z, &key.center.x, &key.center.y, &key.center.z) == 7)
+			keys.push_back(key);
+	}
+	std::sort(keys.begin(), keys.end(), [](const sKey& a, const sKey& b) { return a.time < b.time; });
+	return keys.size() > 0;
+}
+
+void CameraPath::createOrbit(const Vector3& eye, const Vector3& center, float duration, int num_keys)
+{
+	keys.clear();
+	Vector3 offset = eye - center;
+	float radius = sqrt(offset.x * offset.x + offset.z * offset.z);
+	float start_angle = atan2(offset.z, offset.x);
+	for (int i = 0; i <= num_keys; ++i)
+	{
+		float angle = start_angle + 2.0f * PI * i / num_keys;
+		sKey key;
+		key.time = duration * i / num_keys;
+		key.eye = center + Vector3(cos(angle) * radius, offset.y, sin(angle) * radius);
+		key.center = center;
+		keys.push_back(key);
+	}
+}
+
+static Vector3 catmullRom(const Vector3& p0, const Vector3& p1, const Vector3& p2, const Vector3& p3, float t)
+{
+	float t2 = t * t;
+	float t3 = t2 * t;
+	return (p1 * 2.0f + (p2 - p0) * t + (p0 * 2.0f - p1 * 5.0f + p2 * 4.0f - p3) * t2 + (p1 * 3.0f - p0 - p2 * 3.0f + p3) * t3) * 0.5f;
+}
+
+void CameraPath::apply(Camera* camera, float time)
+{
+	if (keys.empty())
+		return;
+
+	int next = 0;
+	while (next < keys.size() && keys[next].time <= time)
+		next++;
+	if (next == 0 || next == keys.size())
+	{
+		const sKey& key = next ? keys.back() : keys[0];
+		camera->lookAt(key.eye, key.center, Vector3(0, 1, 0));
+		return;
+	}
+
+	int last = (int)keys.size() - 1;
+	const sKey& k0 = keys[std::max(next - 2, 0)];
+	const sKey& k1 = keys[next - 1];
+	const sKey& k2 = keys[next];
+	const sKey& k3 = keys[std::min(next + 1, last)];
+	float t = (time - k1.time) / std::max(k2.time - k1.time, 0.0001f);
+	camera->lookAt(catmullRom(k0.eye, k1.eye, k2.eye, k3.eye, t), catmullRom(k0.center, k1.center, k2.center, k3.center, t), Vector3(0, 1, 0));
+}
+
+//fraction of the pixels with a channel that differs more than threshold, and the RMSE of the channels (0 to 1).
+//Both are RGBA images with the rows in the same order (as read from the screen and saved by saveTGA)
+static float compareImages(const Image& image, const Image& golden, float threshold, float& rmse)
+{
+	int num_pixels = image.width * image.height;
+	int different = 0;
+	double squared = 0.0;
+	for (int i = 0; i < num_pixels; ++i)
+	{
+		const uint8* a = image.data + i * 4;
+		const uint8* b = golden.data + i * golden.num_channels;
+		int max_difference = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			int difference = abs((int)a[k] - (int)b[k]);
+			max_difference = std::max(max_difference, difference);
+			squared += difference * difference;
+		}
+		if (max_difference > threshold * 255.0f)
+			different++;
+	}
+	rmse = num_pixels ? (float)sqrt(squared / (num_pixels * 3.0)) / 255.0f : 0.0f;
+	return num_pixels ? different / (float)num_pixels : 0.0f;
+}
+
+struct sPassTime {
+	int order;
+	double cpu_ms;
+	double gpu_ms;
+	int cpu_count;
+	int gpu_count;
+	sRenderStats stats;		//added for all the frames
+};
+
+int GTR::runHeadless(Application* app, SDL_Window* window, const sHeadlessOptions& options)
+{
+	Camera* camera = app->camera;
+	float duration = options.frames * options.time_step;
+
+	CameraPath path;
+	if (!options.camera_path || !path.load(options.camera_path))
+		path.createOrbit(camera->eye, camera->center, duration);
+	//the path is stretched to the frames rendered
+	float time_scale = path.getDuration() > 0.0f && duration > 0.0f ? path.getDuration() / duration : 0.0f;
+
+	app->render_gui = false;
+	app->render_debug = false;
+	if (options.capture_folder && !createFolder(options.capture_folder))
+		std::cout << "[ERROR]: capture folder could not be created: " << options.capture_folder << std::endl;
+	if (options.golden_folder && options.update_golden && !createFolder(options.golden_folder))
+		std::cout << "[ERROR]: golden folder could not be created: " << options.golden_folder << std::endl;
+	while (glGetError() != GL_NO_ERROR); //errors of the loading are not from the frames
+
+	std::cout << " + Headless " << options.scene << ": " << options.warmup_frames << " warmup frames, " << options.frames << " frames at " << app->window_width << "x" << app->window_height << std::endl;
+
+	std::vector<float> frame_times;
+	std::map<std::string, sPassTime> pass_times;
+	int num_gl_errors = 0;
+	int num_captures = 0;
+	int num_compared = 0;
+	int num_different = 0;
+	int num_missing = 0;
+	bool capture_failed = false;
+	Image capture;
+	char filename[1024];
+
+	//what a hidden window shows is undefined, the passes that end in the screen render to this FBO instead
+	FBO screen;
+	screen.create(app->window_width, app->window_height, 1, GL_RGBA, GL_UNSIGNED_BYTE, true);
+	FBO::screen_fbo_id = screen.fbo_id;
+
+	int total_frames = options.warmup_frames + options.frames;
+	for (int i = 0; i < total_frames; ++i)
+	{
+		int frame = i - options.warmup_frames; //negative while warming up, it stays at the start of the path
+		float time = std::max(frame, 0) * options.time_step;
+		path.apply(camera, time * time_scale);
+		app->time = time;
+		app->elapsed_time = options.time_step;
+		//the same random numbers in the frame no matter what was rendered before (noise, jitter...)
+		setRandomSeed(options.seed + std::max(frame, 0));
+
+		//the glFinish makes the time of the frame include the GPU work, like the swap of a visible window
+		auto start = std::chrono::high_resolution_clock::now();
+		glBindFramebuffer(GL_FRAMEBUFFER, screen.fbo_id);
+		Profiler::instance->beginFrame();
+		app->render();
+		Profiler::instance->endFrame();
+		glFinish();
+		float ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		GLenum error;
+		while ((error = glGetError()) != GL_NO_ERROR)
+		{
+			if (num_gl_errors++ < 10)
+				std::cout << "[ERROR]: GL error " << error << " in frame " << frame << std::endl;
+		}
+
+		if (frame < 0)
+		{
+			SDL_GL_SwapWindow(window);
+			SDL_PumpEvents();
+			app->frame++;
+			continue;
+		}
+
+		//the profiler resolves the frames some frames later, the last one resolved is added
+		frame_times.push_back(ms);
+		for (Profiler::sSection& section : Profiler::instance->results)
+		{
+			auto it = pass_times.find(section.name);
+			if (it == pass_times.end())
+			{
+				sPassTime pass = { (int)pass_times.size(), 0.0, 0.0, 0, 0 };
+				pass.stats.clear();
+				it = pass_times.insert(std::make_pair(section.name, pass)).first;
+			}
+			it->second.cpu_ms += section.cpu_ms;
+			it->second.cpu_count++;
+			it->second.stats.add(section.stats);
+			if (section.gpu_ms >= 0.0f)
+			{
+				it->second.gpu_ms += section.gpu_ms;
+				it->second.gpu_count++;
+			}
+		}
+
+		bool compare = options.golden_folder && !options.update_golden;
+		if ((options.capture_folder || options.golden_folder) && frame % std::max(options.capture_every, 1) == 0)
+		{
+			//the final frame, with the tone mapping and everything that reaches the screen
+			glBindFramebuffer(GL_FRAMEBUFFER, screen.fbo_id);
+			glReadBuffer(GL_COLOR_ATTACHMENT0);
+			capture.fromScreen(app->window_width, app->window_height);
+			if (options.capture_folder)
+			{
+				sprintf(filename, "%s/frame_%04d.tga", options.capture_folder, frame);
+				if (capture.saveTGA(filename))
+					num_captures++;
+				else if (!capture_failed)
+				{
+					std::cout << "[ERROR]: capture could not be saved: " << filename << std::endl;
+					capture_failed = true;
+				}
+			}
+
+			if (options.golden_folder)
+				sprintf(filename, "%s/frame_%04d.tga", options.golden_folder, frame);
+			if (options.golden_folder && options.update_golden && !capture.saveTGA(filename))
+			{
+				std::cout << "[ERROR]: golden image could not be saved: " << filename << std::endl;
+				capture_failed = true;
+			}
+
+			//the golden images are created with --update-golden, without them the frame is not checked
+			Image golden;
+			if (compare && !golden.loadTGA(filename))
+			{
+				if (options.strict_golden)
+				{
+					std::cout << "[ERROR]: golden image not found: " << filename << std::endl;
+					capture_failed = true;
+				}
+				else if (!num_missing)
+					std::cout << " * Golden image not found, the frame is skipped: " << filename << std::endl;
+				num_missing++;
+			}
+			else if (compare && (golden.width != capture.width || golden.height != capture.height))
+			{
+				std::cout << "[ERROR]: golden image of another size: " << filename << std::endl;
+				num_different++;
+			}
+			else if (compare)
+			{
+				float rmse = 0.0f;
+				float different = compareImages(capture, golden, options.golden_threshold, rmse);
+				bool fails = different > options.golden_max_pixels;
+				printf(" + Frame %d: %.3f%% pixels different, RMSE %.4f%s\n", frame, different * 100.0f, rmse, fails ? " FAILED" : "");
+				num_compared++;
+				if (fails)
+					num_different++;
+			}
+		}
+
+		SDL_GL_SwapWindow(window);
+		SDL_PumpEvents();
+		app->frame++;
+	}
+
+	FBO::screen_fbo_id = 0;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	float average = 0.0f, median = 0.0f, p95 = 0.0f;
+	if (frame_times.size())
+	{
+		std::vector<float> sorted = frame_times;
+		std::sort(sorted.begin(), sorted.end());
+		float total = 0.0f;
+		for (float ms : sorted)
+			total += ms;
+		average = total / sorted.size();
+		median = sorted[sorted.size() / 2];
+		p95 = sorted[std::min((size_t)(sorted.size() * 0.95f), sorted.size() - 1)];
+		printf(" + Frame ms: avg %.3f, min %.3f, median %.3f, p95 %.3f, max %.3f (%.1f fps)\n", average, sorted[0], median, p95, sorted.back(), 1000.0f / average);
+	}
+
+	//passes in the order they appeared, the render stats are per frame
+	std::vector< std::pair<std::string, sPassTime> > passes(pass_times.begin(), pass_times.end());
+	int64_t num_frames = std::max((int64_t)frame_times.size(), (int64_t)1);
+	for (auto& pass : passes)
+		for (int i = 0; i < STAT_COUNT; ++i)
+			pass.second.stats.counters[i] /= num_frames;
+	std::sort(passes.begin(), passes.end(), [](const std::pair<std::string, sPassTime>& a, const std::pair<std::string, sPassTime>& b) { return a.second.order < b.second.order; });
+	for (auto& pass : passes)
+	{
+		sPassTime& time = pass.second;
+		printf("\t%-24s cpu %.3f ms, gpu %.3f ms, %lld draws, %lld tris, %lld shaders, %lld textures\n", pass.first.c_str(), time.cpu_ms / std::max(time.cpu_count, 1), time.gpu_count ? time.gpu_ms / time.gpu_count : -1.0,
+			(long long)time.stats.counters[STAT_DRAW_CALLS], (long long)time.stats.counters[STAT_TRIANGLES], (long long)time.stats.counters[STAT_SHADER_BINDS], (long long)time.stats.counters[STAT_TEXTURE_BINDS]);
+	}
+
+	if (options.report_filename)
+	{
+		FILE* report = fopen(options.report_filename, "a+");
+		if (report)
+		{
+			fseek(report, 0, SEEK_END);
+			if (ftell(report) == 0)
+			{
+				fprintf(report, "scene,pass,cpu_ms,gpu_ms");
+				for (int i = 0; i < STAT_COUNT; ++i)
+					fprintf(report, ",%s", render_stat_names[i]);
+				fprintf(report, "\n");
+			}
+			std::string empty_stats(STAT_COUNT, ',');
+			fprintf(report, "%s,frame avg,%f,%s\n%s,frame median,%f,%s\n%s,frame p95,%f,%s\n", options.scene, average, empty_stats.c_str(), options.scene, median, empty_stats.c_str(), options.scene, p95, empty_stats.c_str());
+			for (auto& pass : passes)
+			{
+				sPassTime& time = pass.second;
+				fprintf(report, "%s,%s,%f,%f", options.scene, pass.first.c_str(), time.cpu_ms / std::max(time.cpu_count, 1), time.gpu_count ? time.gpu_ms / time.gpu_count : -1.0);
+				for (int i = 0; i < STAT_COUNT; ++i)
+					fprintf(report, ",%lld", (long long)time.stats.counters[i]);
+				fprintf(report, "\n");
+			}
+			fclose(report);
+		}
+		else
+			std::cout << "[ERROR]: report could not be saved: " << options.report_filename << std::endl;
+	}
+
+	if (options.capture_folder)
+		std::cout << " + Captures: " << num_captures << " in " << options.capture_folder << std::endl;
+	if (num_compared || num_missing)
+		std::cout << " + Golden images: " << num_compared - num_different << " of " << num_compared << " match, " << num_missing << " missing" << std::endl;
+
+	//every condition is reported, and the exit code has a bit for each
+	int result = 0;
+	if (num_gl_errors)
+	{
+		std::cout << "[ERROR]: " << num_gl_errors << " GL errors" << std::endl;
+		result |= HEADLESS_GL_ERRORS;
+	}
+	if (capture_failed)
+	{
+		std::cout << "[ERROR]: captures that could not be saved or golden images missing" << std::endl;
+		result |= HEADLESS_CAPTURE_FAILED;
+	}
+	if (num_different)
+	{
+		std::cout << "[ERROR]: " << num_different << " frames differ from their golden images" << std::endl;
+		result |= HEADLESS_GOLDEN_DIFFERENT;
+	}
+	return result;
+}
+
+int GTR::runExposureCheck(Application* app, float tolerance)
+{
+	Renderer* renderer = app->renderer;
+	app->render_gui = false;
+	app->render_debug = false;
+	app->current_pipeline = Application::DEFERRED;
+	renderer->use_tone_mapping = true;
+	renderer->use_auto_exposure = true;
+	renderer->exposure_valid = false;
+
+	FBO screen;
+	screen.create(app->window_width, app->window_height, 1, GL_RGBA, GL_UNSIGNED_BYTE, true);
+	FBO::screen_fbo_id = screen.fbo_id;
+
+	//the first frame starts the adaptation, the next ones adapt from a luminance brighter and darker than the scene
+	const float previous_scales[] = { 0.0f, 4.0f, 0.25f };
+	int exit_code = 0;
+	for (int i = 0; i < 3; ++i)
+	{
+		if (i > 0)
+		{
+			Texture* previous = renderer->exposure_fbo[renderer->exposure_index]->color_textures[0];
+			float lum[4];
+			previous->bind();
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, lum);
+			previous->unbind();
+			renderer->exposure_fbo[renderer->exposure_index]->bind();
+			glClearColor(lum[1] * previous_scales[i], lum[1], 0.0f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT);
+			renderer->exposure_fbo[renderer->exposure_index]->unbind();
+		}
+
+		app->elapsed_time = 0.25f; //long enough for the adaptation to move
+		glBindFramebuffer(GL_FRAMEBUFFER, screen.fbo_id);
+		app->render();
+		if (i > 0)
+			exit_code |= renderer->checkExposure(tolerance);
+		app->frame++;
+	}
+
+	FBO::screen_fbo_id = 0;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (exit_code)
+		std::cout << "[ERROR]: the GPU exposure differs from the CPU reference more than " << tolerance * 100.0f << "%" << std::endl;
+	return exit_code;
+}
+
+#ifdef WIN32
+//quoted so CommandLineToArgvW (and the CRT) gets it back: the quotes and the backslashes before them are escaped
+static std::string quoteArgument(const std::string& argument)
+{
+	if (!argument.empty() && argument.find_first_of(" \t\"") == std::string::npos)
+		return argument;
+	std::string quoted = "\"";
+	int backslashes = 0;
+	for (char c : argument)
+	{
+		if (c == '\\')
+		{
+			backslashes++;
+			continue;
+		}
+		quoted.append(c == '"' ? backslashes * 2 + 1 : backslashes, '\\');
+		quoted += c;
+		backslashes = 0;
+	}
+	quoted.append(backslashes * 2, '\\');
+	return quoted + "\"";
+}
+#endif
+
+//runs the executable with the arguments and waits for it, without a shell so the arguments are passed as they are.
+//Returns its exit code, 1 if it could not run or crashed
+static int runProcess(const std::vector<std::string>& arguments)
+{
+#ifdef WIN32
+	std::string command_line;
+	for (const std::string& argument : arguments)
+		command_line += (command_line.empty() ? "" : " ") + quoteArgument(argument);
+
+	STARTUPINFOA startup = { sizeof(STARTUPINFOA) };
+	PROCESS_INFORMATION process = {};
+	std::vector<char> buffer(command_line.begin(), command_line.end());
+	buffer.push_back(0); //CreateProcess may write to it
+	if (!CreateProcessA(NULL, &buffer[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process))
+		return 1;
+	WaitForSingleObject(process.hProcess, INFINITE);
+	DWORD status = 1;
+	GetExitCodeProcess(process.hProcess, &status);
+	CloseHandle(process.hProcess);
+	CloseHandle(process.hThread);
+	return (int)status;
+#else
+	std::vector<char*> argv;
+	for (const std::string& argument : arguments)
+		argv.push_back((char*)argument.c_str());
+	argv.push_back(NULL);
+
+	pid_t pid;
+	if (posix_spawnp(&pid, arguments[0].c_str(), NULL, NULL, &argv[0], environ) != 0)
+		return 1;
+	int status = 0;
+	if (waitpid(pid, &status, 0) != pid)
+		return 1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+#endif
+}
+
+int GTR::runBenchmarkSuite(const char* executable, const std::vector<std::string>& arguments)
+{
+	int result = 0;
+	std::vector<int> results;
+	for (int i = 0; i < BENCHMARK_SCENES; ++i)
+	{
+		std::vector<std::string> command = { executable, "--benchmark", benchmark_scenes[i] };
+		command.insert(command.end(), arguments.begin(), arguments.end());
+		std::cout << " +";
+		for (const std::string& argument : command)
+			std::cout << " " << argument;
+		std::cout << std::endl;
+		int status = runProcess(command);
+		results.push_back(status);
+		result |= status;
+	}
+
+	std::cout << " + Benchmark suite:" << std::endl;
+	for (int i = 0; i < BENCHMARK_SCENES; ++i)
+		std::cout << "\t" << benchmark_scenes[i] << ": " << (results[i] ? "FAILED (" + std::to_string(results[i]) + ")" : std::string("OK")) << std::endl;
+	return result;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "includes.h"
+#include "framework.h"
+
+#include <string>
+#include <vector>
+
+class Camera;
+class Application;
+
+namespace GTR {
+
+	// Keyframes of the camera, interpolated with a Catmull-Rom spline so the speed does not jump at the keys.
+	// The file has one key per line: "time eye.x eye.y eye.z center.x center.y center.z", # starts a comment
+	class CameraPath
+	{
+	public:
+		struct sKey {
+			float time;
+			Vector3 eye;
+			Vector3 center;
+		};
+
+		std::vector<sKey> keys;
+
+		bool load(const char* filename);
+		//one turn around the center, at the height and distance of eye
+		void createOrbit(const Vector3& eye, const Vector3& center, float duration, int num_keys = 16);
+		float getDuration() { return keys.size() ? keys.back().time : 0.0f; }
+		void apply(Camera* camera, float time);
+	};
+
+	struct sHeadlessOptions {
+		const char* scene;			//name of the scene, for the report
+		int frames;					//frames measured
+		int warmup_frames;			//rendered before measuring (shader variants, first uploads, dynamic resolution)
+		float time_step;			//seconds per frame, fixed so every run renders the same frames
+		unsigned int seed;			//the random numbers of every frame start from seed + frame
+		const char* camera_path;	//NULL orbits around the center of the camera
+		const char* capture_folder;	//NULL does not save images
+		int capture_every;			//frames between captures (and golden images)
+		const char* golden_folder;	//frame_XXXX.tga compared with the captures, NULL does not compare
+		bool strict_golden;			//a missing golden image fails the run, otherwise its frame is skipped
+		bool update_golden;			//saves the captures as the new golden images
+		float golden_threshold;		//difference of a channel (0 to 1) that makes a pixel different
+		float golden_max_pixels;	//fraction of different pixels that fails a frame
+		const char* report_filename;	//csv with the frame times and the average time of every pass, appended
+
+		sHeadlessOptions();
+	};
+
+	//bits of the exit code of the headless mode, 0 if everything went fine
+	enum eHeadlessResult {
+		HEADLESS_GL_ERRORS = 1,
+		HEADLESS_CAPTURE_FAILED = 2,	//a capture could not be saved, or a golden image is missing with strict_golden
+		HEADLESS_GOLDEN_DIFFERENT = 4	//a frame differs from its golden image
+	};
+
+	// Renders the frames of the camera path without input or GUI, prints the timings of the frames and the passes,
+	// saves the captures and compares them with the golden images.
+	// The frames are rendered to an FBO of the size of the window (the contents of a hidden window are undefined),
+	// but it needs a GL context: on machines without a GPU use Mesa (llvmpipe), and without a display
+	// SDL_VIDEODRIVER=offscreen (EGL) or a virtual X server.
+	// Returns the exit code, the eHeadlessResult of everything that failed
+	int runHeadless(Application* app, SDL_Window* window, const sHeadlessOptions& options);
+
+	// Renders some frames with the auto exposure and compares the average and adapted luminance computed on the GPU
+	// with the CPU reference (exposure.h). Before every frame but the first the adapted luminance is moved away from
+	// the scene, so both adaptation speeds are checked. Returns the exit code: 1 if one of them differs more than tolerance
+	int runExposureCheck(Application* app, float tolerance = 0.05f);
+
+	//canned scenes of the benchmark suite
+	const int BENCHMARK_SCENES = 5;
+	extern const char* benchmark_scenes[BENCHMARK_SCENES];
+
+	//runs every scene of the suite in its own process (executable with the arguments), returns the eHeadlessResult
+	//bits of all of them
+	int runBenchmarkSuite(const char* executable, const std::vector<std::string>& arguments);
+
+};
@@ -0,0 +1,95 @@
+#include "hiz.h"
+#include "texture.h"
+#include "shader.h"
+#include "mesh.h"
+
+using namespace GTR;
+
+HiZBuffer::HiZBuffer()
+{
+	texture = NULL;
+	num_levels = 0;
+	valid = false;
+}
+
+HiZBuffer::~HiZBuffer()
+{
+	release();
+}
+
+void HiZBuffer::release()
+{
+	for (FBO* fbo : fbos)
+		delete fbo;
+	fbos.clear();
+	delete texture;
+	texture = NULL;
+	num_levels = 0;
+	valid = false;
+}
+
+void HiZBuffer::build(Texture* depth, const Matrix44& viewprojection)
+{
+	int width = (int)depth->width;
+	int height = (int)depth->height;
+
+	if (!texture || texture->width != width || texture->height != height)
+	{
+		release();
+
+		//the Texture class only creates mips for power of two sizes, the levels are allocated here
+		texture = new Texture(width, height, GL_RG, GL_FLOAT, false, NULL, GL_RG32F);
+		num_levels = 1;
+		while ((width >> num_levels) > 0 || (height >> num_levels) > 0)
+			num_levels++;
+
+		texture->bind();
+		for (int i = 1; i < num_levels; ++i)
+			glTexImage2D(GL_TEXTURE_2D, i, GL_RG32F, std::max(1, width >> i), std::max(1, height >> i), 0, GL_RG, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+		texture->unbind();
+
+		for (int i = 0; i < num_levels; ++i)
+		{
+			FBO* fbo = new FBO();
+			fbo->setTexture(texture, -1, i);
+			fbos.push_back(fbo);
+		}
+	}
+
+	Mesh* quad = Mesh::getQuad();
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	Shader* shader = Shader::Get("hizCopy");
+	shader->enable();
+	shader->setTexture("u_depth_texture", depth, 0);
+	fbos[0]->bind();
+	quad->render(GL_TRIANGLES);
+	fbos[0]->unbind();
+
+	//every level reads only the previous one (base and max level), so it never samples the mip it is writing
+	shader = Shader::Get("hizDownsample");
+	shader->enable();
+	for (int i = 1; i < num_levels; ++i)
+	{
+		texture->bind();
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, i - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, i - 1);
+		shader->setTexture("u_texture", texture, 0);
+		fbos[i]->bind();
+		quad->render(GL_TRIANGLES);
+		fbos[i]->unbind();
+	}
+	shader->disable();
+
+	texture->bind();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+	texture->unbind();
+
+	this->viewprojection = viewprojection;
+	valid = true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "includes.h"
+#include "framework.h"
+#include "fbo.h"
+
+#include <vector>
+
+namespace GTR {
+
+	// Hierarchical depth: mip chain of the depth of the gbuffers where every texel keeps the closest (R) and the
+	// farthest (G) depth of the texels it covers. The closest one lets the rays skip the empty space in big steps
+	// (screen space reflections), the farthest one tells if a box is completely hidden (occlusion culling).
+	// It is kept by the renderer between frames, so it is not part of the render graph
+	class HiZBuffer
+	{
+	public:
+		Texture* texture;				//RG32F, same size as the depth, every mip with half the size (rounded down)
+		std::vector<FBO*> fbos;			//one per mip
+		int num_levels;
+		bool valid;						//false until it is built
+		Matrix44 viewprojection;		//to the uvs of the depth it was built from
+
+		HiZBuffer();
+		~HiZBuffer();
+
+		//copies the depth to the first mip and reduces it to the smaller ones
+		void build(Texture* depth, const Matrix44& viewprojection);
+		void release();
+	};
+
+};
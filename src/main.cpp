@@ -15,6 +15,12 @@
 #include "utils.h"
 #include "input.h"
 #include "application.h"
+#include "profiler.h"
+#include "simplify.h"
+#include "headless.h"
+#include "trace.h"
+#include "prefilter.h"
+#include "occlusion.h"
 
 #include <iostream> //to output
 
@@ -25,7 +31,7 @@ SDL_GLContext glcontext;
 
 // *********************************
 //create a window using SDL
-SDL_Window* createWindow(const char* caption, int width, int height, bool fullscreen = false)
+SDL_Window* createWindow(const char* caption, int width, int height, bool fullscreen = false, bool hidden = false)
 {
     int multisample = 8;
     bool retina = false; //change this to use a retina display
@@ -40,7 +46,7 @@ SDL_Window* createWindow(const char* caption, int width, int height, bool fullsc
 
 #ifndef __APPLE__
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3); //the atlas is GLSL 330, and the probes use geometry shaders (3.2)
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
 #endif
     
@@ -54,7 +60,8 @@ SDL_Window* createWindow(const char* caption, int width, int height, bool fullsc
 	//create the window
 	SDL_Window * sdl_window = SDL_CreateWindow(caption, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_OPENGL|SDL_WINDOW_RESIZABLE|
                                           (retina ? SDL_WINDOW_ALLOW_HIGHDPI:0) |
-                                          (fullscreen?SDL_WINDOW_FULLSCREEN_DESKTOP:0) );
+                                          (fullscreen?SDL_WINDOW_FULLSCREEN_DESKTOP:0) |
+                                          (hidden?SDL_WINDOW_HIDDEN:0) );
 	if(!sdl_window)
 	{
 		fprintf(stderr, "Window creation error: %s\n", SDL_GetError());
@@ -127,9 +134,14 @@ void mainLoop(SDL_Window* window)
 	while (!app->must_exit)
 	{
 		//render frame
+		GTR::Profiler::instance->beginFrame();
 		app->render();
 		if (app->render_gui)
+		{
+			PROFILE_SCOPE("GUI");
 			renderDebug(window, app);
+		}
+		GTR::Profiler::instance->endFrame();
 		// swap between front buffer and back buffer
 		SDL_GL_SwapWindow(window);
 
@@ -212,14 +224,128 @@ int main(int argc, char **argv)
 	//prepare SDL
 	SDL_Init(SDL_INIT_EVERYTHING);
 
-	bool fullscreen = false; //change this to go fullscreen
+	//batch mode: --bake-irradiance [bounces] bakes the probes to disk and exits
+	int bake_bounces = 0;
+	//--profile file.csv|file.json saves the timings of every frame
+	const char* profile_filename = NULL;
+	//--trace file.json records the CPU timeline from the start (loading included) and saves it at exit
+	const char* trace_filename = NULL;
+	//--headless [frames] renders the frames of a camera path in a hidden window and exits (see headless.h)
+	bool headless = false;
+	GTR::sHeadlessOptions headless_options;
+	//--benchmark scene|all renders a canned scene with its path and golden images (all runs every one of them)
+	const char* benchmark = NULL;
+	std::vector<std::string> benchmark_arguments; //the arguments given to the processes of the suite
+	//--check-prefilter [tolerance] compares the GPU prefilter of the reflection probes with the CPU reference and exits
+	float prefilter_tolerance = 0.0f;
+	//--check-exposure [tolerance] compares the GPU auto exposure of some frames with the CPU reference and exits
+	float exposure_tolerance = 0.0f;
 	Vector2 size(1024,768);
+	for (int i = 1; i < argc; ++i)
+	{
+		int first = i; //the options below move i past their values
+
+		//mesh tools and CPU checks, they exit without creating the window
+		bool has_value = i + 1 < argc && argv[i + 1][0] != '-';
+		if (strcmp(argv[i], "--simplify") == 0)
+			return has_value ? GTR::simplifyPrefabs(argv[i + 1]) : GTR::simplifyPrefabs();
+		else if (strcmp(argv[i], "--simplify-benchmark") == 0)
+			return has_value ? GTR::benchmarkSimplifier(argv[i + 1]) : GTR::benchmarkSimplifier();
+		else if (strcmp(argv[i], "--check-occlusion") == 0)
+			return GTR::checkSoftwareOcclusion();
+		else if (strcmp(argv[i], "--bake-irradiance") == 0)
+			bake_bounces = has_value ? std::max(atoi(argv[++i]), 1) : 1;
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+			profile_filename = argv[++i];
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			trace_filename = argv[++i];
+		else if (strcmp(argv[i], "--headless") == 0)
+		{
+			headless = true;
+			if (has_value)
+				headless_options.frames = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+			headless_options.warmup_frames = std::max(atoi(argv[++i]), 0);
+		else if (strcmp(argv[i], "--time-step") == 0 && i + 1 < argc)
+			headless_options.time_step = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--camera-path") == 0 && i + 1 < argc)
+			headless_options.camera_path = argv[++i];
+		else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+			headless_options.capture_folder = argv[++i];
+		else if (strcmp(argv[i], "--capture-every") == 0 && i + 1 < argc)
+			headless_options.capture_every = std::max(atoi(argv[++i]), 1);
+		else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+			sscanf(argv[++i], "%fx%f", &size.x, &size.y);
+		else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+			headless_options.scene = argv[++i];
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			headless_options.seed = (unsigned int)atoi(argv[++i]);
+		else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc)
+			headless_options.golden_folder = argv[++i];
+		else if (strcmp(argv[i], "--update-golden") == 0)
+			headless_options.update_golden = true;
+		else if (strcmp(argv[i], "--strict-golden") == 0)
+			headless_options.strict_golden = true;
+		else if (strcmp(argv[i], "--golden-threshold") == 0 && i + 1 < argc)
+			headless_options.golden_threshold = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--golden-pixels") == 0 && i + 1 < argc)
+			headless_options.golden_max_pixels = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc)
+			headless_options.report_filename = argv[++i];
+		else if (strcmp(argv[i], "--benchmark") == 0)
+			benchmark = has_value ? argv[++i] : "all";
+		else if (strcmp(argv[i], "--check-prefilter") == 0)
+		{
+			headless = true;
+			prefilter_tolerance = has_value ? (float)atof(argv[++i]) : 0.05f;
+		}
+		else if (strcmp(argv[i], "--check-exposure") == 0)
+		{
+			headless = true;
+			exposure_tolerance = has_value ? (float)atof(argv[++i]) : 0.05f;
+		}
 
-	if(fullscreen)
+		//every option with its values, but --benchmark and its scene
+		if (strcmp(argv[first], "--benchmark") != 0)
+			benchmark_arguments.insert(benchmark_arguments.end(), argv + first, argv + i + 1);
+	}
+
+	if (benchmark && strcmp(benchmark, "all") == 0)
+		return GTR::runBenchmarkSuite(argv[0], benchmark_arguments);
+
+	//the benchmark scenes have their camera path and golden images in data/benchmarks
+	std::string benchmark_path, benchmark_golden;
+	if (benchmark)
+	{
+		headless = true;
+		headless_options.scene = benchmark;
+		benchmark_path = std::string("data/benchmarks/") + benchmark + ".path";
+		benchmark_golden = std::string("data/benchmarks/golden/") + benchmark;
+		FILE* path_file = fopen(benchmark_path.c_str(), "rb");
+		if (path_file && !headless_options.camera_path)
+			headless_options.camera_path = benchmark_path.c_str();
+		if (path_file)
+			fclose(path_file);
+		if (!headless_options.golden_folder)
+			headless_options.golden_folder = benchmark_golden.c_str();
+		if (!headless_options.report_filename)
+			headless_options.report_filename = "benchmark_report.csv";
+	}
+
+	//the same random numbers in every run
+	setRandomSeed(headless_options.seed);
+
+	if (trace_filename)
+		GTR::Tracer::enabled = true;
+
+	bool fullscreen = false; //change this to go fullscreen
+
+	if(fullscreen && !headless)
 		size = getDesktopSize(0);
 
 	//create the application window (WINDOW_WIDTH and WINDOW_HEIGHT are two macros defined in includes.h)
-	SDL_Window*window = createWindow("TJE", (int)size.x, (int)size.y, fullscreen );
+	SDL_Window*window = createWindow("TJE", (int)size.x, (int)size.y, fullscreen && !headless, headless );
 	if (!window)
 		return 0;
 	int window_width, window_height;
@@ -243,11 +369,42 @@ int main(int argc, char **argv)
 
 	Input::init(window);
 
+	//the batch bake computes the probes below, the scene does not bake them when they are not on disk
+	if (bake_bounces)
+		GTR::Scene::bake_missing_irradiance = false;
+
 	//launch the application (app is a global variable)
-	app = new Application(window_width, window_height, window);
+	app = new Application(window_width, window_height, window, headless_options.scene);
+
+	int exit_code = 0;
+	if (prefilter_tolerance > 0.0f)
+		exit_code = checkPrefilter(app->renderer, prefilter_tolerance);
+	else if (exposure_tolerance > 0.0f)
+		exit_code = GTR::runExposureCheck(app, exposure_tolerance);
+	else if (headless)
+	{
+		if (profile_filename)
+			GTR::Profiler::instance->startCapture(profile_filename);
+		exit_code = GTR::runHeadless(app, window, headless_options);
+		GTR::Profiler::instance->stopCapture();
+	}
+	else if (bake_bounces)
+	{
+		app->renderer->irradiance_bounces = bake_bounces;
+		app->renderer->show_light_meshes = false;
+		app->renderer->computeIrradiance(GTR::Scene::instance);
+	}
+	else
+	{
+		if (profile_filename)
+			GTR::Profiler::instance->startCapture(profile_filename);
+		//main loop, application gets inside here till user closes it
+		mainLoop(window);
+		GTR::Profiler::instance->stopCapture();
+	}
 
-	//main loop, application gets inside here till user closes it
-	mainLoop(window);
+	if (trace_filename)
+		GTR::Tracer::exportJSON(trace_filename);
 
 	//save state and free memory
 	// Cleanup
@@ -261,5 +418,5 @@ int main(int argc, char **argv)
 	SDL_DestroyWindow(window);
 	SDL_Quit();
 
-	return 0;
+	return exit_code;
 }
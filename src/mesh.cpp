@@ -9,19 +9,30 @@
 #include <iostream>
 #include <limits>
 #include <sys/stat.h>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
 
 #include "camera.h"
 #include "texture.h"
 #include "animation.h"
 #include "extra/coldet/coldet.h"
+#include "simplify.h"
+#include "trace.h"
 
 bool Mesh::use_binary = true;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
-long Mesh::num_meshes_rendered = 0;
-long Mesh::num_triangles_rendered = 0;
+int64_t Mesh::num_meshes_rendered = 0;
+int64_t Mesh::num_triangles_rendered = 0;
+int64_t Mesh::num_meshes_culled = 0;
+bool Mesh::generate_lods = true;
+bool Mesh::rebuild_bins = false;
+int Mesh::simplify_threads = 0;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -78,6 +89,11 @@ void Mesh::clear()
 	weights.clear();
 	uvs1.clear();
 
+	for (Mesh* lod : lods)
+		delete lod;
+	lods.clear();
+	lod_errors.clear();
+
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
 }
@@ -244,8 +260,8 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 
 void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 {
-	int start = 0; //in primitives
-	int size = (int)vertices.size();
+	int start = 0; //in triangles when indexed, in vertices otherwise
+	int size = (int)vertices.size(); //same units as start
 	if (indices.size())
 		size = (int)indices.size();
 	else if (interleaved.size())
@@ -256,7 +272,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
 		sSubmeshInfo& submesh = submeshes[submesh_id];
 		start = submesh.start;
-		size = submesh.start + submesh.length;
+		size = submesh.length;
 	}
 
 	//DRAW
@@ -266,7 +282,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3)), num_instances);
+			glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)), num_instances);
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
@@ -289,7 +305,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 			glDrawArrays(primitive, start, size);
 	}
 
-	num_triangles_rendered += (size / 3) * (num_instances ? num_instances : 1);
+	num_triangles_rendered += (indices.size() ? size : size / 3) * (num_instances ? num_instances : 1);
 	num_meshes_rendered++;
 }
 
@@ -524,7 +540,8 @@ void Mesh::uploadToVRAM()
 	}
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-
+	for (Mesh* lod : lods)
+		lod->uploadToVRAM();
 
 	checkGLErrors();
 
@@ -670,9 +687,245 @@ bool Mesh::interleaveBuffers()
 	normals.resize(0);
 	uvs.resize(0);
 
+	for (Mesh* lod : lods)
+		lod->interleaveBuffers();
+
 	return true;
 }
 
+//a level with the vertices of the mesh used by the triangles, in the same streams
+static Mesh* createLODMesh(Mesh* mesh, const std::vector<Vector3u>& triangles, const std::vector<sSubmeshInfo>& submeshes)
+{
+	Mesh* lod = new Mesh();
+	std::vector<int> remap(mesh->getNumVertices(), -1);
+	int num_vertices = 0;
+	for (const Vector3u& t : triangles)
+	{
+		Vector3u triangle;
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = t.v[k];
+			if (remap[v] == -1)
+			{
+				remap[v] = num_vertices++;
+				if (mesh->interleaved.size())
+					lod->interleaved.push_back(mesh->interleaved[v]);
+				else
+				{
+					lod->vertices.push_back(mesh->vertices[v]);
+					if (mesh->normals.size())
+						lod->normals.push_back(mesh->normals[v]);
+					if (mesh->uvs.size())
+						lod->uvs.push_back(mesh->uvs[v]);
+				}
+				if (mesh->uvs1.size())
+					lod->uvs1.push_back(mesh->uvs1[v]);
+				if (mesh->colors.size())
+					lod->colors.push_back(mesh->colors[v]);
+				if (mesh->bones.size())
+					lod->bones.push_back(mesh->bones[v]);
+				if (mesh->weights.size())
+					lod->weights.push_back(mesh->weights[v]);
+			}
+			triangle.v[k] = remap[v];
+		}
+		lod->indices.push_back(triangle);
+	}
+
+	lod->submeshes = submeshes;
+	lod->bones_info = mesh->bones_info;
+	lod->bind_matrix = mesh->bind_matrix;
+	lod->aabb_min = mesh->aabb_min;
+	lod->aabb_max = mesh->aabb_max;
+	lod->box = mesh->box;
+	lod->radius = mesh->radius;
+	return lod;
+}
+
+//the triangles of every submesh (or the whole mesh) with the vertices of the same attributes welded, and the
+//position of every vertex. This is what the simplifier needs
+static void getSimplifyParts(Mesh* mesh, std::vector<Vector3>& positions, std::vector< std::vector<Vector3u> >& parts)
+{
+	int num_vertices = mesh->getNumVertices();
+	std::vector<Vector3u> triangles;
+	if (mesh->indices.size())
+		triangles = mesh->indices;
+	else
+		for (int i = 0; i + 2 < num_vertices; i += 3)
+			triangles.push_back(Vector3u(i, i + 1, i + 2));
+
+	//the vertices with the same attributes are the same vertex
+	positions.resize(num_vertices);
+	std::vector<unsigned int> welded(num_vertices);
+	std::unordered_map<std::string, unsigned int> unique;
+	std::string key;
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		key.clear();
+		if (mesh->interleaved.size())
+			key.append((const char*)&mesh->interleaved[i], sizeof(Mesh::tInterleaved));
+		else
+		{
+			key.append((const char*)&mesh->vertices[i], sizeof(Vector3));
+			if (mesh->normals.size())
+				key.append((const char*)&mesh->normals[i], sizeof(Vector3));
+			if (mesh->uvs.size())
+				key.append((const char*)&mesh->uvs[i], sizeof(Vector2));
+		}
+		if (mesh->uvs1.size())
+			key.append((const char*)&mesh->uvs1[i], sizeof(Vector2));
+		if (mesh->colors.size())
+			key.append((const char*)&mesh->colors[i], sizeof(Vector4));
+		if (mesh->bones.size())
+			key.append((const char*)&mesh->bones[i], sizeof(Vector4ub));
+		if (mesh->weights.size())
+			key.append((const char*)&mesh->weights[i], sizeof(Vector4));
+		welded[i] = unique.insert(std::make_pair(key, (unsigned int)i)).first->second;
+		positions[i] = mesh->interleaved.size() ? mesh->interleaved[i].vertex : mesh->vertices[i];
+	}
+	for (Vector3u& t : triangles)
+		t.set(welded[t.x], welded[t.y], welded[t.z]);
+
+	//the submeshes are in vertices for the meshes without indices
+	int num_parts = mesh->submeshes.size() ? (int)mesh->submeshes.size() : 1;
+	parts.assign(num_parts, std::vector<Vector3u>());
+	for (int i = 0; i < num_parts; ++i)
+	{
+		int start = 0, end = (int)triangles.size();
+		if (mesh->submeshes.size())
+		{
+			sSubmeshInfo& submesh = mesh->submeshes[i];
+			start = mesh->indices.size() ? submesh.start : submesh.start / 3;
+			end = std::min(end, start + (mesh->indices.size() ? submesh.length : submesh.length / 3));
+		}
+		if (start < end)
+			parts[i].assign(triangles.begin() + start, triangles.begin() + end);
+	}
+}
+
+//calls function(i) for i from 0 to count in all the cores (or Mesh::simplify_threads)
+static void parallelFor(int count, const std::function<void(int)>& function)
+{
+	int num_threads = Mesh::simplify_threads > 0 ? Mesh::simplify_threads : (int)std::thread::hardware_concurrency();
+	num_threads = std::max(1, std::min(num_threads, count));
+
+	std::atomic<int> next(0);
+	auto worker = [&]() {
+		for (int i = next++; i < count; i = next++)
+			function(i);
+	};
+	std::vector<std::thread> threads;
+	for (int i = 1; i < num_threads; ++i)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+//the simplified parts as the triangles and submeshes of a level
+static void joinSimplifyParts(Mesh* mesh, const std::vector< std::vector<Vector3u> >& parts, std::vector<Vector3u>& triangles, std::vector<sSubmeshInfo>& submeshes)
+{
+	triangles.clear();
+	submeshes.clear();
+	for (int i = 0; i < parts.size(); ++i)
+	{
+		if (mesh->submeshes.size())
+		{
+			sSubmeshInfo submesh = mesh->submeshes[i];
+			submesh.start = (int)triangles.size();
+			submesh.length = (int)parts[i].size();
+			submeshes.push_back(submesh);
+		}
+		triangles.insert(triangles.end(), parts[i].begin(), parts[i].end());
+	}
+}
+
+//every submesh is simplified on its own (in parallel, the borders between them do not move), the budget of
+//triangles is shared by the submeshes by their size
+Mesh* Mesh::simplify(int target_triangles, float target_error, float* result_error)
+{
+	std::vector<Vector3> positions;
+	std::vector< std::vector<Vector3u> > parts;
+	getSimplifyParts(this, positions, parts);
+
+	size_t total_triangles = 0;
+	for (std::vector<Vector3u>& part : parts)
+		total_triangles += part.size();
+
+	std::vector<float> errors(parts.size(), 0.0f);
+	parallelFor((int)parts.size(), [&](int i) {
+		TRACE_SCOPE_DETAIL("Simplify submesh", name.c_str());
+		GTR::MeshSimplifier simplifier;
+		simplifier.init(positions, parts[i]);
+		int target = total_triangles ? (int)((double)parts[i].size() * target_triangles / total_triangles) : 0;
+		simplifier.simplify(target, target_error);
+		simplifier.getTriangles(parts[i]);
+		errors[i] = simplifier.error;
+	});
+
+	std::vector<Vector3u> triangles;
+	std::vector<sSubmeshInfo> simplified_submeshes;
+	joinSimplifyParts(this, parts, triangles, simplified_submeshes);
+	if (result_error)
+		*result_error = errors.size() ? *std::max_element(errors.begin(), errors.end()) : 0.0f;
+
+	Mesh* mesh = createLODMesh(this, triangles, simplified_submeshes);
+	mesh->name = name + "@simplified";
+	return mesh;
+}
+
+//a level stops when it does not remove at least a 10% of the triangles of the previous one
+void Mesh::generateLODs(int max_levels, float ratio)
+{
+	TRACE_SCOPE_DETAIL("Mesh::generateLODs", name.c_str());
+	for (Mesh* lod : lods)
+		delete lod;
+	lods.clear();
+	lod_errors.clear();
+
+	if ((indices.size() ? indices.size() : getNumVertices() / 3) < MESH_LOD_MIN_TRIANGLES)
+		return;
+
+	std::vector<Vector3> positions;
+	std::vector< std::vector<Vector3u> > parts;
+	getSimplifyParts(this, positions, parts);
+
+	//the simplifiers continue from the previous level
+	std::vector<GTR::MeshSimplifier> simplifiers(parts.size());
+	parallelFor((int)parts.size(), [&](int i) { simplifiers[i].init(positions, parts[i]); });
+
+	size_t previous_triangles = 0;
+	for (std::vector<Vector3u>& part : parts)
+		previous_triangles += part.size();
+
+	for (int level = 1; level <= max_levels; ++level)
+	{
+		parallelFor((int)parts.size(), [&](int i) {
+			simplifiers[i].simplify((int)(parts[i].size() * ratio));
+			simplifiers[i].getTriangles(parts[i]);
+		});
+
+		std::vector<Vector3u> level_triangles;
+		std::vector<sSubmeshInfo> level_submeshes;
+		joinSimplifyParts(this, parts, level_triangles, level_submeshes);
+		if (level_triangles.size() > previous_triangles * 0.9f || level_triangles.empty())
+			break;
+		previous_triangles = level_triangles.size();
+
+		float error = 0.0f;
+		for (GTR::MeshSimplifier& simplifier : simplifiers)
+			error = std::max(error, simplifier.error);
+
+		Mesh* lod = createLODMesh(this, level_triangles, level_submeshes);
+		lod->name = name + "@lod" + std::to_string(level);
+		lods.push_back(lod);
+		lod_errors.push_back(error);
+
+		if (level_triangles.size() < MESH_LOD_MIN_TRIANGLES)
+			break;
+	}
+}
+
 typedef struct 
 {
 	int version;
@@ -688,7 +941,8 @@ typedef struct
 	int num_submeshes;
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
+	int num_lods; //every level is stored after the submeshes: its error and the mesh with its own header
+	char extra[28]; //unused
 } sMeshInfo;
 
 bool Mesh::readBin(const char* filename)
@@ -712,10 +966,22 @@ bool Mesh::readBin(const char* filename)
 	if ( memcmp(data,"MBIN",4) != 0 )
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		delete[] data;
 		return false;
 	}
 
 	char* pos = data + 4;
+	bool loaded = readBinData(pos, filename);
+	delete[] data;
+	if (!loaded)
+		return false;
+
+	createCollisionModel();
+	return true;
+}
+
+bool Mesh::readBinData(char*& pos, const char* filename)
+{
 	sMeshInfo info;
 	memcpy(&info,pos,sizeof(sMeshInfo));
 	pos += sizeof(sMeshInfo);
@@ -803,10 +1069,26 @@ bool Mesh::readBin(const char* filename)
 	bind_matrix = info.bind_matrix;
 
 	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
+	if (info.num_submeshes)
+		memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
-	createCollisionModel();
+	for (int i = 0; i < info.num_lods; ++i)
+	{
+		float error;
+		memcpy(&error, pos, sizeof(float));
+		pos += sizeof(float);
+
+		Mesh* lod = new Mesh();
+		if (!lod->readBinData(pos, filename))
+		{
+			delete lod;
+			return false;
+		}
+		lods.push_back(lod);
+		lod_errors.push_back(error);
+	}
+
 	return true;
 }
 
@@ -825,7 +1107,14 @@ bool Mesh::writeBin(const char* filename)
 
 	//watermark
 	fwrite("MBIN",sizeof(char),4,f);
+	writeBinData(f);
 
+	fclose(f);
+	return true;
+}
+
+void Mesh::writeBinData(FILE* f)
+{
 	sMeshInfo info;
 	memset(&info, 0, sizeof(info));
 	info.version = MESH_BIN_VERSION;
@@ -840,6 +1129,7 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	info.num_lods = lods.size();
 
 	info.streams[0] = interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
@@ -875,15 +1165,19 @@ bool Mesh::writeBin(const char* filename)
 		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
 	if (weights.size())
 		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4), 1, f);
+	if (uvs1.size()) //before the bones info, in the order readBin expects them
+		fwrite((void*)&uvs1[0], uvs1.size() * sizeof(Vector2), 1, f);
 	if (bones_info.size())
 		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
-	if (uvs1.size())
-		fwrite((void*)&uvs1[0], uvs1.size() * sizeof(Vector2), 1, f);
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	if (submeshes.size())
+		fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
 
-	fclose(f);
-	return true;
+	for (int i = 0; i < lods.size(); ++i)
+	{
+		fwrite((void*)&lod_errors[i], sizeof(float), 1, f);
+		lods[i]->writeBinData(f);
+	}
 }
 
 bool Mesh::loadASE(const char* filename)
@@ -1512,6 +1806,7 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
 	if (it != sMeshesLoaded.end())
 		return it->second;
+	TRACE_SCOPE_DETAIL("Mesh::Get", filename);
 
 	if (skip_load)
 		return NULL;
@@ -1545,7 +1840,7 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		binfilename = binfilename + ".mbin";
 
 	//try loading the binary version
-	if ( use_binary && m->readBin(binfilename.c_str()) )
+	if ( use_binary && !rebuild_bins && m->readBin(binfilename.c_str()) )
 	{
 		if(interleave_meshes && m->interleaved.size() == 0)
 		{
@@ -1587,6 +1882,14 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		m->interleaveBuffers();
 	}
 
+	//simplified versions, stored in the bin with the mesh
+	if (generate_lods)
+	{
+		m->name = name;
+		m->generateLODs();
+		std::cout << "[LODS " << m->lods.size() << "] ";
+	}
+
 	//and upload them to VRAM
 	if (auto_upload_to_vram)
 	{
@@ -4,6 +4,8 @@
 #include <vector>
 #include "framework.h"
 
+#include <cstdint>
+#include <cstdio>
 #include <map>
 #include <string>
 
@@ -11,8 +13,11 @@ class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
 
-//version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+//version 12 adds the levels of detail
+#define MESH_BIN_VERSION 13 //this is used to regenerate bins if the format changes
+
+#define MESH_MAX_LODS 4 //simplified levels generated, every one with half the triangles of the previous
+#define MESH_LOD_MIN_TRIANGLES 256 //smaller meshes (or levels) are not simplified
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
@@ -34,8 +39,12 @@ public:
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
-	static long num_meshes_rendered;
-	static long num_triangles_rendered;
+	static int64_t num_meshes_rendered;
+	static int64_t num_triangles_rendered;
+	static int64_t num_meshes_culled; //not rendered because they were occluded
+	static bool generate_lods; //loaded meshes generate their levels of detail (stored in the bin)
+	static bool rebuild_bins; //ignores the bins when loading and writes them again
+	static int simplify_threads; //threads of the simplification (one submesh per thread), 0 uses all the cores
 
 	std::string name;
 
@@ -57,6 +66,10 @@ public:
 
 	std::vector< Vector3u > indices; //for indexed meshes
 
+	//levels of detail, simplified versions of this mesh from the closest to the farthest (the level 0 is the mesh)
+	std::vector< Mesh* > lods;
+	std::vector< float > lod_errors; //max distance (in mesh units) from every level to the original surface
+
 	//for animated meshes
 	std::vector< Vector4ub > bones; //tells which bones afect the vertex (4 max)
 	std::vector< Vector4 > weights; //tells how much affect every bone
@@ -98,6 +111,14 @@ public:
 	bool readBin(const char* filename);
 	bool writeBin(const char* filename);
 
+	//quadric error simplification, keeps the vertices and their attributes (the UV and normal seams only move along
+	//the seam), the borders and the submeshes. Stops at target_triangles or when the surface would move more than
+	//target_error (mesh units, 0 no limit). Returns a new mesh, the error reached is stored in result_error
+	Mesh* simplify(int target_triangles, float target_error = 0.0f, float* result_error = NULL);
+	void generateLODs(int max_levels = MESH_MAX_LODS, float ratio = 0.5f);
+	Mesh* getLOD(int level) { return level > 0 && level <= (int)lods.size() ? lods[level - 1] : this; }
+	float getLODError(int level) { return level > 0 && level <= (int)lods.size() ? lod_errors[level - 1] : 0.0f; }
+
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
 	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
 
@@ -132,6 +153,10 @@ private:
 	bool loadASE(const char* filename);
 	bool loadOBJ(const char* filename);
 	bool loadMESH(const char* filename); //personal format used for animations
+
+	//the mesh inside a bin (the levels of detail are meshes inside the bin of their mesh)
+	bool readBinData(char*& pos, const char* filename);
+	void writeBinData(FILE* f);
 };
 
 #endif
@@ -0,0 +1,348 @@
+#include "occlusion.h"
+#include "camera.h"
+#include "hiz.h"
+#include "mesh.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+
+using namespace GTR;
+
+DepthPyramid::DepthPyramid()
+{
+	valid = false;
+}
+
+void DepthPyramid::resize(int width, int height)
+{
+	if (widths.empty() || widths[0] != width || heights[0] != height)
+	{
+		levels.clear();
+		widths.clear();
+		heights.clear();
+		while (true)
+		{
+			levels.push_back(std::vector<float>(width * height));
+			widths.push_back(width);
+			heights.push_back(height);
+			if (width == 1 && height == 1)
+				break;
+			width = std::max(1, width / 2);
+			height = std::max(1, height / 2);
+		}
+	}
+	std::fill(levels[0].begin(), levels[0].end(), 1.0f);
+}
+
+void DepthPyramid::buildLevels()
+{
+	//with odd sizes the last texel of a level also covers the extra row or column of the previous one
+	for (int level = 1; level < levels.size(); ++level)
+	{
+		const std::vector<float>& source = levels[level - 1];
+		std::vector<float>& target = levels[level];
+		int source_width = widths[level - 1];
+		int source_height = heights[level - 1];
+		int width = widths[level];
+		int height = heights[level];
+
+		for (int y = 0; y < height; ++y)
+		{
+			int y1 = y == height - 1 ? source_height - 1 : y * 2 + 1;
+			for (int x = 0; x < width; ++x)
+			{
+				int x1 = x == width - 1 ? source_width - 1 : x * 2 + 1;
+				float depth = 0.0f;
+				for (int sy = y * 2; sy <= y1; ++sy)
+					for (int sx = x * 2; sx <= x1; ++sx)
+						depth = std::max(depth, source[sy * source_width + sx]);
+				target[y * width + x] = depth;
+			}
+		}
+	}
+}
+
+bool DepthPyramid::isOccluded(const BoundingBox& world_box) const
+{
+	if (!valid || levels.empty())
+		return false;
+
+	//rect in uvs and closest depth of the corners
+	float min_x = 1e10f, min_y = 1e10f, max_x = -1e10f, max_y = -1e10f;
+	float min_depth = 1.0f;
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3 corner = world_box.center + Vector3(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f) * world_box.halfsize;
+		Vector4 clip = viewprojection * Vector4(corner, 1.0f);
+		if (clip.w < 0.0001f)
+			return false; //crosses the plane of the camera
+
+		float x = clip.x / clip.w * 0.5f + 0.5f;
+		float y = clip.y / clip.w * 0.5f + 0.5f;
+		min_x = std::min(min_x, x);
+		max_x = std::max(max_x, x);
+		min_y = std::min(min_y, y);
+		max_y = std::max(max_y, y);
+		min_depth = std::min(min_depth, clip.z / clip.w * 0.5f + 0.5f);
+	}
+
+	//crosses the near plane or it is outside the view (left to the frustum culling)
+	if (min_depth <= 0.0f || max_x < 0.0f || max_y < 0.0f || min_x > 1.0f || min_y > 1.0f)
+		return false;
+
+	//texels of the first level, then the smallest level where they are 2x2 at most
+	int x0 = std::max(0, std::min(widths[0] - 1, (int)(min_x * widths[0])));
+	int x1 = std::max(0, std::min(widths[0] - 1, (int)(max_x * widths[0])));
+	int y0 = std::max(0, std::min(heights[0] - 1, (int)(min_y * heights[0])));
+	int y1 = std::max(0, std::min(heights[0] - 1, (int)(max_y * heights[0])));
+	int level = 0;
+	while ((x1 - x0 > 1 || y1 - y0 > 1) && level < levels.size() - 1)
+	{
+		level++;
+		x0 = std::min(x0 / 2, widths[level] - 1);
+		x1 = std::min(x1 / 2, widths[level] - 1);
+		y0 = std::min(y0 / 2, heights[level] - 1);
+		y1 = std::min(y1 / 2, heights[level] - 1);
+	}
+
+	const std::vector<float>& depth = levels[level];
+	int width = widths[level];
+	float max_depth = 0.0f;
+	for (int y = y0; y <= y1; ++y)
+		for (int x = x0; x <= x1; ++x)
+			max_depth = std::max(max_depth, depth[y * width + x]);
+
+	return min_depth > max_depth;
+}
+
+SoftwareOcclusion::SoftwareOcclusion()
+{
+	num_occluders = 0;
+	num_triangles = 0;
+}
+
+void SoftwareOcclusion::begin(const Matrix44& viewprojection, int width, int height)
+{
+	resize(width, height);
+	this->viewprojection = viewprojection;
+	num_occluders = 0;
+	num_triangles = 0;
+	valid = false;
+}
+
+void SoftwareOcclusion::end()
+{
+	buildLevels();
+	valid = true;
+}
+
+void SoftwareOcclusion::rasterize(const Matrix44& model, Mesh* mesh)
+{
+	int num_vertices = mesh->interleaved.size() ? (int)mesh->interleaved.size() : (int)mesh->vertices.size();
+	if (!num_vertices)
+		return;
+
+	std::vector<Vector4> clip(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		const Vector3& vertex = mesh->interleaved.size() ? mesh->interleaved[i].vertex : mesh->vertices[i];
+		clip[i] = viewprojection * (model * Vector4(vertex, 1.0f));
+	}
+
+	if (mesh->indices.size())
+		for (const Vector3u& triangle : mesh->indices)
+			rasterizeTriangle(clip[triangle.x], clip[triangle.y], clip[triangle.z]);
+	else
+		for (int i = 0; i + 2 < num_vertices; i += 3)
+			rasterizeTriangle(clip[i], clip[i + 1], clip[i + 2]);
+	num_occluders++;
+}
+
+//twice the signed area of the triangle a, b, p
+static inline float edgeFunction(const Vector3& a, const Vector3& b, float px, float py)
+{
+	return (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+}
+
+void SoftwareOcclusion::rasterizeTriangle(const Vector4& a, const Vector4& b, const Vector4& c)
+{
+	//not clipped, a triangle crossing the near plane is not used as occluder
+	if (a.w < 0.0001f || b.w < 0.0001f || c.w < 0.0001f)
+		return;
+
+	int width = widths[0];
+	int height = heights[0];
+	const Vector4* clip[3] = { &a, &b, &c };
+	Vector3 p[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		const Vector4& v = *clip[i];
+		p[i].set((v.x / v.w * 0.5f + 0.5f) * width, (v.y / v.w * 0.5f + 0.5f) * height, v.z / v.w * 0.5f + 0.5f);
+		if (p[i].z < 0.0f)
+			return;
+		p[i].z = std::min(p[i].z, 1.0f);
+	}
+
+	int x0 = std::max(0, (int)std::floor(std::min(p[0].x, std::min(p[1].x, p[2].x))));
+	int x1 = std::min(width - 1, (int)std::ceil(std::max(p[0].x, std::max(p[1].x, p[2].x))));
+	int y0 = std::max(0, (int)std::floor(std::min(p[0].y, std::min(p[1].y, p[2].y))));
+	int y1 = std::min(height - 1, (int)std::ceil(std::max(p[0].y, std::max(p[1].y, p[2].y))));
+	if (x0 > x1 || y0 > y1)
+		return;
+
+	float area = edgeFunction(p[0], p[1], p[2].x, p[2].y);
+	if (std::fabs(area) < 1e-8f)
+		return;
+	float inv_area = 1.0f / area;
+	num_triangles++;
+
+	//pixel centers inside the triangle (any winding), the depth is linear in screen space
+	std::vector<float>& depth = levels[0];
+	for (int y = y0; y <= y1; ++y)
+	{
+		float py = y + 0.5f;
+		for (int x = x0; x <= x1; ++x)
+		{
+			float px = x + 0.5f;
+			float w0 = edgeFunction(p[1], p[2], px, py) * inv_area;
+			float w1 = edgeFunction(p[2], p[0], px, py) * inv_area;
+			float w2 = 1.0f - w0 - w1;
+			if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+				continue;
+			float z = w0 * p[0].z + w1 * p[1].z + w2 * p[2].z;
+			float& pixel = depth[y * width + x];
+			pixel = std::min(pixel, z);
+		}
+	}
+}
+
+HiZOcclusion::HiZOcclusion()
+{
+	pbo = 0;
+	fence = NULL;
+	read_level = 0;
+	read_width = read_height = 0;
+	frame = -1;
+	read_frame = -1;
+}
+
+HiZOcclusion::~HiZOcclusion()
+{
+	release();
+}
+
+void HiZOcclusion::release()
+{
+	if (fence)
+		glDeleteSync(fence);
+	fence = NULL;
+	if (pbo)
+		glDeleteBuffers(1, &pbo);
+	pbo = 0;
+	valid = false;
+}
+
+void HiZOcclusion::readback(HiZBuffer& hiz, int max_size, long frame)
+{
+	//the previous copy is still on its way
+	if (!hiz.valid || fence)
+		return;
+
+	int level = 0;
+	while (level < hiz.num_levels - 1 && std::max((int)hiz.texture->width >> level, (int)hiz.texture->height >> level) > max_size)
+		level++;
+	read_level = level;
+	read_width = std::max(1, (int)hiz.texture->width >> level);
+	read_height = std::max(1, (int)hiz.texture->height >> level);
+	read_viewprojection = hiz.viewprojection;
+	read_frame = frame;
+
+	if (!pbo)
+		glGenBuffers(1, &pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER, read_width * read_height * 2 * sizeof(float), NULL, GL_STREAM_READ);
+	hiz.texture->bind();
+	glGetTexImage(GL_TEXTURE_2D, level, GL_RG, GL_FLOAT, 0); //to the buffer, it does not wait
+	hiz.texture->unbind();
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void HiZOcclusion::update()
+{
+	if (!fence)
+		return;
+	GLenum status = glClientWaitSync(fence, 0, 0);
+	if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+		return;
+	glDeleteSync(fence);
+	fence = NULL;
+
+	//the farthest depth (G) is the one that tells if something is hidden
+	resize(read_width, read_height);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+	float* data = (float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, read_width * read_height * 2 * sizeof(float), GL_MAP_READ_BIT);
+	if (data)
+	{
+		std::vector<float>& depth = levels[0];
+		for (int i = 0; i < depth.size(); ++i)
+			depth[i] = data[i * 2 + 1];
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	buildLevels();
+	viewprojection = read_viewprojection;
+	frame = read_frame;
+	valid = data != NULL;
+}
+
+int GTR::checkSoftwareOcclusion()
+{
+	//the camera looks down -Z, the quad covers from -5 to 5 at 10 units (half of the 90 degrees view)
+	Camera camera;
+	camera.lookAt(Vector3(0, 0, 0), Vector3(0, 0, -1), Vector3(0, 1, 0));
+	camera.setPerspective(90.0f, 1.0f, 1.0f, 1000.0f);
+
+	SoftwareOcclusion occlusion;
+	occlusion.begin(camera.viewprojection_matrix, 64, 64);
+	Vector4 corners[4];
+	for (int i = 0; i < 4; ++i)
+		corners[i] = camera.viewprojection_matrix * Vector4(i & 1 ? 5.0f : -5.0f, i & 2 ? 5.0f : -5.0f, -10.0f, 1.0f);
+	occlusion.rasterizeTriangle(corners[0], corners[1], corners[3]);
+	occlusion.rasterizeTriangle(corners[0], corners[3], corners[2]);
+	occlusion.end();
+
+	struct sCase {
+		const char* name;
+		BoundingBox box;
+		bool occluded;
+	};
+	sCase cases[] = {
+		{ "behind the quad", BoundingBox(Vector3(0, 0, -20), Vector3(1, 1, 1)), true },
+		{ "behind the corner of the quad", BoundingBox(Vector3(8, 8, -20), Vector3(1, 1, 1)), true },
+		{ "behind across the edge of the quad", BoundingBox(Vector3(10, 0, -20), Vector3(1, 1, 1)), false },
+		{ "beside the quad", BoundingBox(Vector3(15, 0, -20), Vector3(1, 1, 1)), false },
+		{ "in front of the quad", BoundingBox(Vector3(0, 0, -5), Vector3(1, 1, 1)), false },
+		{ "crossing the quad", BoundingBox(Vector3(0, 0, -10), Vector3(1, 1, 1)), false },
+		{ "crossing the near plane", BoundingBox(Vector3(0, 0, -1), Vector3(1.5f, 1.5f, 1.5f)), false },
+		{ "crossing the near plane, reaching behind the quad", BoundingBox(Vector3(0, 0, -10), Vector3(1, 1, 10.5f)), false },
+	};
+
+	int exit_code = 0;
+	for (const sCase& test : cases)
+	{
+		bool occluded = occlusion.isOccluded(test.box);
+		if (occluded != test.occluded)
+			exit_code = 1;
+		printf(" %s Box %s: %s (expected %s)\n", occluded != test.occluded ? "*" : "+", test.name, occluded ? "occluded" : "visible", test.occluded ? "occluded" : "visible");
+	}
+
+	if (exit_code)
+		std::cout << "[ERROR]: the software occlusion culls a box it should not, or misses one it should" << std::endl;
+	return exit_code;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "includes.h"
+#include "framework.h"
+
+#include <vector>
+
+class Mesh;
+
+namespace GTR {
+
+	class HiZBuffer;
+
+	// Low resolution depth of what hides the scene, with a mip chain where every texel keeps the farthest depth
+	// of the ones it covers. A box is hidden if its closest point is behind the farthest depth of the texels it covers
+	class DepthPyramid
+	{
+	public:
+		std::vector< std::vector<float> > levels;	//depth from 0 to 1 like the depth buffer, rows from the bottom
+		std::vector<int> widths;
+		std::vector<int> heights;
+		Matrix44 viewprojection;					//from world to the clip space of the depth
+		bool valid;
+
+		DepthPyramid();
+
+		//allocates the first level (cleared to the far plane) and the smaller ones
+		void resize(int width, int height);
+		//computes the smaller levels from the first one
+		void buildLevels();
+
+		bool isOccluded(const BoundingBox& world_box) const;
+	};
+
+	// Occluders rasterized on the CPU: only the depth of the biggest meshes, at a very low resolution, so it is
+	// ready at the start of the frame and does not depend on the GPU
+	class SoftwareOcclusion : public DepthPyramid
+	{
+	public:
+		int num_occluders;
+		int num_triangles;
+
+		SoftwareOcclusion();
+
+		void begin(const Matrix44& viewprojection, int width, int height);
+		void rasterize(const Matrix44& model, Mesh* mesh);
+		void end();
+
+		//triangle in clip space, the ones crossing the near plane are skipped
+		void rasterizeTriangle(const Vector4& a, const Vector4& b, const Vector4& c);
+	};
+
+	// Hi-Z of the gbuffers read back to the CPU (a small mip, farthest depth). The copy is asynchronous, so the
+	// test uses the depth of the previous frame: something that appears from behind an occluder may take a frame
+	class HiZOcclusion : public DepthPyramid
+	{
+	public:
+		GLuint pbo;
+		GLsync fence;				//signaled when the copy finishes
+		int read_level;				//mip of the Hi-Z copied
+		int read_width;
+		int read_height;
+		Matrix44 read_viewprojection;
+		long read_frame;
+		long frame;					//frame of the depth in the pyramid
+
+		HiZOcclusion();
+		~HiZOcclusion();
+
+		//starts the copy of the Hi-Z just built
+		void readback(HiZBuffer& hiz, int max_size, long frame);
+		//takes the copy if the GPU finished it
+		void update();
+		void release();
+	};
+
+	//rasterizes a quad with SoftwareOcclusion and tests boxes behind it, beside it, in front of it and crossing the
+	//near plane. Returns the exit code: 0 if isOccluded gives the expected result for all of them, 1 otherwise
+	int checkSoftwareOcclusion();
+
+};
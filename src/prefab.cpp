@@ -10,6 +10,7 @@
 #include "gltf_loader.h"
 #include "utils.h"
 #include "framework.h"
+#include "trace.h"
 
 #include <iostream>
 
@@ -97,6 +98,7 @@ Prefab* Prefab::Get(const char* filename)
 	std::map<std::string, Prefab*>::iterator it = sPrefabsLoaded.find(filename);
 	if (it != sPrefabsLoaded.end())
 		return it->second;
+	TRACE_SCOPE_DETAIL("Prefab::Get", filename);
 
 	Prefab* prefab = loadGLTF(filename);
 	if (!prefab)
@@ -0,0 +1,243 @@
+#include "prefilter.h"
+#include "renderer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+//low discrepancy sequence used to distribute the samples
+static Vector2 hammersley(unsigned int i, unsigned int num_samples)
+{
+	unsigned int bits = i;
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return Vector2(i / (float)num_samples, bits * 2.3283064365386963e-10f);
+}
+
+//half vector around N following the GGX distribution
+static Vector3 importanceSampleGGX(Vector2 xi, float roughness, Vector3 N)
+{
+	float a = roughness * roughness;
+
+	float phi = 2.0f * PI * xi.x;
+	float cos_theta = sqrtf((1.0f - xi.y) / (1.0f + (a * a - 1.0f) * xi.y));
+	float sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
+
+	Vector3 H(sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta);
+
+	//from tangent space to world space
+	Vector3 up = fabs(N.z) < 0.999f ? Vector3(0, 0, 1) : Vector3(1, 0, 0);
+	Vector3 tangent = normalize(cross(up, N));
+	Vector3 bitangent = cross(N, tangent);
+
+	return normalize(tangent * H.x + bitangent * H.y + N * H.z);
+}
+
+Vector3 cubemapTexelDirection(int face, float u, float v)
+{
+	//same table OpenGL uses to address the cubemaps
+	float sc = u * 2.0f - 1.0f;
+	float tc = v * 2.0f - 1.0f;
+	Vector3 dir;
+	switch (face)
+	{
+	case 0: dir.set(1.0f, -tc, -sc); break;		//+X
+	case 1: dir.set(-1.0f, -tc, sc); break;		//-X
+	case 2: dir.set(sc, 1.0f, tc); break;		//+Y
+	case 3: dir.set(sc, -1.0f, -tc); break;		//-Y
+	case 4: dir.set(sc, -tc, 1.0f); break;		//+Z
+	default: dir.set(-sc, -tc, -1.0f); break;	//-Z
+	}
+	return normalize(dir);
+}
+
+Vector3 sampleCubemap(FloatImage faces[6], Vector3 dir)
+{
+	float ax = fabs(dir.x);
+	float ay = fabs(dir.y);
+	float az = fabs(dir.z);
+
+	//find the face and the coordinates inside it (inverse of cubemapTexelDirection)
+	int face;
+	float sc, tc, ma;
+	if (ax >= ay && ax >= az)
+	{
+		ma = ax;
+		face = dir.x > 0 ? 0 : 1;
+		sc = dir.x > 0 ? -dir.z : dir.z;
+		tc = -dir.y;
+	}
+	else if (ay >= az)
+	{
+		ma = ay;
+		face = dir.y > 0 ? 2 : 3;
+		sc = dir.x;
+		tc = dir.y > 0 ? dir.z : -dir.z;
+	}
+	else
+	{
+		ma = az;
+		face = dir.z > 0 ? 4 : 5;
+		sc = dir.z > 0 ? dir.x : -dir.x;
+		tc = -dir.y;
+	}
+
+	FloatImage& image = faces[face];
+	float x = clamp((sc / ma * 0.5f + 0.5f) * image.width - 0.5f, 0.0f, image.width - 1.0f);
+	float y = clamp((tc / ma * 0.5f + 0.5f) * image.height - 0.5f, 0.0f, image.height - 1.0f);
+
+	//bilinear inside the face (edges are clamped)
+	int x0 = (int)x;
+	int y0 = (int)y;
+	int x1 = x0 + 1 < (int)image.width ? x0 + 1 : x0;
+	int y1 = y0 + 1 < (int)image.height ? y0 + 1 : y0;
+	float fx = x - x0;
+	float fy = y - y0;
+
+	Vector3 top = lerp(image.getPixel(x0, y0).xyz(), image.getPixel(x1, y0).xyz(), fx);
+	Vector3 bottom = lerp(image.getPixel(x0, y1).xyz(), image.getPixel(x1, y1).xyz(), fx);
+	return lerp(top, bottom, fy);
+}
+
+void prefilterCubemapGGX(FloatImage faces[6], FloatImage out[6], int out_size, float roughness, int num_samples)
+{
+	for (int face = 0; face < 6; ++face)
+	{
+		out[face].resize(out_size, out_size, 3);
+		for (int y = 0; y < out_size; ++y)
+			for (int x = 0; x < out_size; ++x)
+			{
+				Vector3 N = cubemapTexelDirection(face, (x + 0.5f) / out_size, (y + 0.5f) / out_size);
+
+				//a perfect mirror is just a copy
+				if (roughness <= 0.0f)
+				{
+					out[face].setPixel(x, y, Vector4(sampleCubemap(faces, N), 1.0f));
+					continue;
+				}
+
+				Vector3 color;
+				float total_weight = 0.0f;
+				for (int i = 0; i < num_samples; ++i)
+				{
+					Vector3 H = importanceSampleGGX(hammersley(i, num_samples), roughness, N);
+					Vector3 L = H * (2.0f * dot(N, H)) - N;
+					float NdotL = dot(N, L);
+					if (NdotL <= 0.0f)
+						continue;
+					color += sampleCubemap(faces, L) * NdotL;
+					total_weight += NdotL;
+				}
+				if (total_weight > 0.0f)
+					color = color * (1.0f / total_weight);
+				out[face].setPixel(x, y, Vector4(color, 1.0f));
+			}
+	}
+}
+
+Vector2 integrateBRDF(float NdotV, float roughness, int num_samples)
+{
+	Vector3 V(sqrtf(1.0f - NdotV * NdotV), 0.0f, NdotV);
+	Vector3 N(0.0f, 0.0f, 1.0f);
+
+	//geometry term for IBL uses k = a^2 / 2
+	float k = (roughness * roughness) * 0.5f;
+
+	float A = 0.0f;
+	float B = 0.0f;
+	for (int i = 0; i < num_samples; ++i)
+	{
+		Vector3 H = importanceSampleGGX(hammersley(i, num_samples), roughness, N);
+		Vector3 L = H * (2.0f * dot(V, H)) - V;
+
+		float NdotL = clamp(L.z, 0.0f, 1.0f);
+		float NdotH = clamp(H.z, 0.0f, 1.0f);
+		float VdotH = clamp(dot(V, H), 0.0f, 1.0f);
+		if (NdotL <= 0.0f)
+			continue;
+
+		float G = (NdotV / (NdotV * (1.0f - k) + k)) * (NdotL / (NdotL * (1.0f - k) + k));
+		float G_vis = G * VdotH / (NdotH * NdotV);
+		float Fc = powf(1.0f - VdotH, 5.0f);
+
+		A += (1.0f - Fc) * G_vis;
+		B += Fc * G_vis;
+	}
+	return Vector2(A / num_samples, B / num_samples);
+}
+
+//sky gradient, ground and a wide sun: smooth enough for the mips read by the GPU and the bilinear of the CPU to agree
+static Vector3 testEnvironment(Vector3 dir)
+{
+	Vector3 sky = lerp(Vector3(0.6f, 0.7f, 0.8f), Vector3(0.2f, 0.35f, 0.7f), clamp(dir.y, 0.0f, 1.0f));
+	Vector3 color = lerp(Vector3(0.25f, 0.2f, 0.15f), sky, clamp(dir.y * 2.0f + 0.5f, 0.0f, 1.0f));
+	float sun = std::max(dot(dir, normalize(Vector3(0.5f, 0.6f, -0.4f))), 0.0f);
+	return color + Vector3(4.0f, 3.6f, 3.0f) * powf(sun, 8.0f);
+}
+
+int checkPrefilter(GTR::Renderer* renderer, float tolerance)
+{
+	const int source_size = 64;
+	FloatImage faces[6];
+	Uint8* data[6];
+	for (int face = 0; face < 6; ++face)
+	{
+		faces[face].resize(source_size, source_size, 3);
+		for (int y = 0; y < source_size; ++y)
+			for (int x = 0; x < source_size; ++x)
+				faces[face].setPixel(x, y, Vector4(testEnvironment(cubemapTexelDirection(face, (x + 0.5f) / source_size, (y + 0.5f) / source_size)), 1.0f));
+		data[face] = (Uint8*)faces[face].data;
+	}
+
+	//the source has mips, like the capture of the probes
+	Texture* source = new Texture();
+	source->createCubemap(source_size, source_size, data, GL_RGB, GL_FLOAT, true, GL_RGBA16F);
+	source->generateMipmaps();
+	Texture* cubemap = GTR::createReflectionCubemap();
+	renderer->prefilterReflection(source, cubemap);
+
+	int exit_code = 0;
+	std::vector<float> pixels;
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	for (int level = 0; level < GTR::NUM_REFLECTION_MIPS; ++level)
+	{
+		int size = GTR::REFLECTION_PROBE_SIZE >> level;
+		float roughness = level / (float)(GTR::NUM_REFLECTION_MIPS - 1);
+		FloatImage reference[6];
+		prefilterCubemapGGX(faces, reference, size, roughness);
+
+		//error relative to the energy of the mip, the max is per channel (dark texels count as 0.01)
+		double error = 0.0;
+		double total = 0.0;
+		float max_error = 0.0f;
+		pixels.resize(size * size * 3);
+		cubemap->bind();
+		for (int face = 0; face < 6; ++face)
+		{
+			glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB, GL_FLOAT, &pixels[0]);
+			for (int i = 0; i < size * size * 3; ++i)
+			{
+				float expected = reference[face].data[i];
+				float difference = fabs(pixels[i] - expected);
+				error += difference;
+				total += expected;
+				max_error = std::max(max_error, difference / std::max(expected, 0.01f));
+			}
+		}
+
+		float mean_error = (float)(error / std::max(total, 1e-6));
+		if (mean_error > tolerance)
+			exit_code = 1;
+		printf(" %s Prefilter mip %d (%dx%d, roughness %.2f): mean error %.2f%%, max %.2f%%\n", mean_error > tolerance ? "*" : "+", level, size, size, roughness, mean_error * 100.0f, max_error * 100.0f);
+	}
+
+	delete source;
+	delete cubemap;
+	if (exit_code)
+		std::cout << "[ERROR]: the GPU prefilter differs from the CPU reference more than " << tolerance * 100.0f << "%" << std::endl;
+	return exit_code;
+}
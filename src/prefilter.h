@@ -0,0 +1,26 @@
+#pragma once
+
+#include "framework.h"
+#include "texture.h"
+
+namespace GTR { class Renderer; }
+
+//CPU reference of the GGX prefilter used for the reflection probes (see prefilterCubemap.fs in the atlas).
+//faces are stored in the same order and orientation OpenGL uses (+X,-X,+Y,-Y,+Z,-Z), row 0 first,
+//so the result can be compared directly with the faces read back from the GPU
+
+//direction of the texel (u,v in 0..1) of a cubemap face
+Vector3 cubemapTexelDirection(int face, float u, float v);
+
+//bilinear sample of a cubemap given a direction
+Vector3 sampleCubemap(FloatImage faces[6], Vector3 dir);
+
+//convolves the six faces with the GGX lobe of the given roughness (N = V = R assumption of the split sum)
+void prefilterCubemapGGX(FloatImage faces[6], FloatImage out[6], int out_size, float roughness, int num_samples = 256);
+
+//scale and bias applied to F0 in the split sum (what the brdfLUT texture stores)
+Vector2 integrateBRDF(float NdotV, float roughness, int num_samples = 256);
+
+//prefilters a smooth procedural environment on the GPU (Renderer::prefilterReflection) and on the CPU and compares
+//every mip read back. Returns the exit code: 0 if all of them match, 1 if the mean error of a mip is above tolerance
+int checkPrefilter(GTR::Renderer* renderer, float tolerance = 0.05f);
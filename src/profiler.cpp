@@ -0,0 +1,452 @@
+#include "profiler.h"
+#include "mesh.h"
+#include "shader.h"
+#include "texture.h"
+#include "fbo.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace GTR;
+
+Profiler* Profiler::instance = NULL;
+
+const char* GTR::render_stat_names[STAT_COUNT] = { "Draws", "Tris", "Culled", "Shaders", "Textures", "Uniforms", "FBOs", "Blits" };
+
+void sRenderStats::clear()
+{
+	for (int i = 0; i < STAT_COUNT; ++i)
+		counters[i] = 0;
+}
+
+void sRenderStats::read()
+{
+	counters[STAT_DRAW_CALLS] = Mesh::num_meshes_rendered;
+	counters[STAT_TRIANGLES] = Mesh::num_triangles_rendered;
+	counters[STAT_CULLED] = Mesh::num_meshes_culled;
+	counters[STAT_SHADER_BINDS] = Shader::num_binds;
+	counters[STAT_TEXTURE_BINDS] = Texture::num_binds;
+	counters[STAT_UNIFORMS] = Shader::num_uniform_uploads;
+	counters[STAT_FBO_BINDS] = FBO::num_binds;
+	counters[STAT_BLITS] = Texture::num_blits;
+}
+
+void sRenderStats::add(const sRenderStats& stats)
+{
+	for (int i = 0; i < STAT_COUNT; ++i)
+		counters[i] += stats.counters[i];
+}
+
+void sRenderStats::subtract(const sRenderStats& stats)
+{
+	for (int i = 0; i < STAT_COUNT; ++i)
+		counters[i] -= stats.counters[i];
+}
+
+//CPU time in ms with the resolution of the performance counter
+static double getProfilerTime()
+{
+	return SDL_GetPerformanceCounter() * 1000.0 / (double)SDL_GetPerformanceFrequency();
+}
+
+Profiler::Profiler()
+{
+	instance = this;
+	enabled = true;
+	recording = false;
+	frame = 0;
+	current = 0;
+	smoothing = 0.9f;
+	capture_file = NULL;
+	capture_json = false;
+	captured_frames = 0;
+	show_stats_history = false;
+
+	for (int i = 0; i < PROFILER_FRAMES; ++i)
+	{
+		frames[i].frame = 0;
+		frames[i].pending = false;
+		frames[i].num_queries = 0;
+	}
+
+	//GL_TIMESTAMP is core since 3.3, but some drivers report no bits
+	GLint bits = 0;
+	glGetQueryiv(GL_TIMESTAMP, GL_QUERY_COUNTER_BITS, &bits);
+	timer_queries = bits > 0;
+	if (!timer_queries)
+		std::cout << " - Profiler: timer queries not supported, only CPU times will be measured" << std::endl;
+}
+
+Profiler::~Profiler()
+{
+	stopCapture();
+	for (int i = 0; i < PROFILER_FRAMES; ++i)
+		if (frames[i].queries.size())
+			glDeleteQueries(frames[i].queries.size(), &frames[i].queries[0]);
+	if (instance == this)
+		instance = NULL;
+}
+
+void Profiler::beginFrame()
+{
+	recording = enabled;
+	if (!recording)
+		return;
+
+	current = frame % PROFILER_FRAMES;
+	sFrame& f = frames[current];
+
+	//the queries of this slot were issued PROFILER_FRAMES ago, they should be ready
+	if (f.pending)
+		resolve(f);
+
+	f.frame = frame;
+	f.num_queries = 0;
+	f.sections.clear();
+	stack.clear();
+
+	beginSection("Frame");
+}
+
+void Profiler::endFrame()
+{
+	if (!recording)
+		return;
+
+	while (stack.size())
+		endSection();
+
+	last_sections = frames[current].sections;
+	updateStatsHistory(frames[current]);
+
+	frames[current].pending = true;
+	recording = false;
+	frame++;
+}
+
+void Profiler::beginSection(const char* name)
+{
+	if (!recording)
+		return;
+
+	sFrame& f = frames[current];
+
+	sSection section;
+	section.name = name;
+	section.depth = stack.size();
+	section.parent = stack.size() ? stack.back() : -1;
+	section.cpu_start = getProfilerTime();
+	section.cpu_ms = 0.0f;
+	section.gpu_ms = -1.0f;
+	section.queries[0] = section.queries[1] = 0;
+	section.stats.read();
+
+	if (timer_queries)
+	{
+		section.queries[0] = getQuery(f);
+		glQueryCounter(section.queries[0], GL_TIMESTAMP);
+	}
+
+	f.sections.push_back(section);
+	stack.push_back(f.sections.size() - 1);
+}
+
+void Profiler::endSection()
+{
+	if (!recording || stack.empty())
+		return;
+
+	sFrame& f = frames[current];
+	sSection& section = f.sections[stack.back()];
+	stack.pop_back();
+
+	section.cpu_ms = (float)(getProfilerTime() - section.cpu_start);
+	sRenderStats start = section.stats;
+	section.stats.read();
+	section.stats.subtract(start);
+
+	if (timer_queries)
+	{
+		section.queries[1] = getQuery(f);
+		glQueryCounter(section.queries[1], GL_TIMESTAMP);
+	}
+}
+
+GLuint Profiler::getQuery(sFrame& f)
+{
+	if (f.num_queries == f.queries.size())
+	{
+		GLuint query;
+		glGenQueries(1, &query);
+		f.queries.push_back(query);
+	}
+	return f.queries[f.num_queries++];
+}
+
+void Profiler::resolve(sFrame& f)
+{
+	f.pending = false;
+
+	//if the last timestamp is ready all the previous ones are too, otherwise skip the GPU times of this frame instead of waiting
+	GLint available = 0;
+	if (timer_queries && f.num_queries)
+		glGetQueryObjectiv(f.queries[f.num_queries - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+
+	if (available)
+		for (sSection& section : f.sections)
+		{
+			GLuint64 start = 0, end = 0;
+			glGetQueryObjectui64v(section.queries[0], GL_QUERY_RESULT, &start);
+			glGetQueryObjectui64v(section.queries[1], GL_QUERY_RESULT, &end);
+			section.gpu_ms = (end - start) * 1e-6f;
+		}
+
+	results = f.sections;
+
+	for (sSection& section : results)
+	{
+		auto it = averages.find(section.name);
+		if (it == averages.end())
+		{
+			averages[section.name] = Vector2(section.cpu_ms, std::max(section.gpu_ms, 0.0f));
+			continue;
+		}
+		Vector2& average = it->second;
+		average.x = average.x * smoothing + section.cpu_ms * (1.0f - smoothing);
+		if (section.gpu_ms >= 0.0f)
+			average.y = average.y * smoothing + section.gpu_ms * (1.0f - smoothing);
+	}
+
+	if (capture_file)
+		writeCapture(f);
+}
+
+void Profiler::updateStatsHistory(sFrame& f)
+{
+	std::map<std::string, sRenderStats> frame_stats;
+	for (sSection& section : f.sections)
+	{
+		auto it = frame_stats.find(section.name);
+		if (it == frame_stats.end())
+			frame_stats[section.name] = section.stats;
+		else
+			it->second.add(section.stats);
+	}
+
+	for (auto& it : frame_stats)
+	{
+		sStatsHistory& history = stats_history[it.first];
+		if (history.frames.size() < PROFILER_STATS_HISTORY)
+		{
+			history.frames.push_back(it.second);
+			history.next = (int)history.frames.size() % PROFILER_STATS_HISTORY;
+		}
+		else
+		{
+			history.frames[history.next] = it.second;
+			history.next = (history.next + 1) % PROFILER_STATS_HISTORY;
+		}
+	}
+}
+
+bool Profiler::getStats(const char* name, sRenderStats& stats)
+{
+	bool found = false;
+	stats.clear();
+	for (sSection& section : last_sections)
+		if (section.name == name)
+		{
+			stats.add(section.stats);
+			found = true;
+		}
+	return found;
+}
+
+bool Profiler::getStatsHistory(const char* name, sRenderStats& min, sRenderStats& average, sRenderStats& max)
+{
+	auto it = stats_history.find(name);
+	if (it == stats_history.end() || it->second.frames.empty())
+		return false;
+
+	std::vector<sRenderStats>& frames = it->second.frames;
+	min = max = frames[0];
+	average.clear();
+	for (sRenderStats& stats : frames)
+	{
+		for (int i = 0; i < STAT_COUNT; ++i)
+		{
+			min.counters[i] = std::min(min.counters[i], stats.counters[i]);
+			max.counters[i] = std::max(max.counters[i], stats.counters[i]);
+		}
+		average.add(stats);
+	}
+	for (int i = 0; i < STAT_COUNT; ++i)
+		average.counters[i] = (average.counters[i] + (int64_t)frames.size() / 2) / (int64_t)frames.size();
+	return true;
+}
+
+float Profiler::getFrameTime()
+{
+	auto it = averages.find("Frame");
+	if (it == averages.end())
+		return 0.0f;
+	return timer_queries ? it->second.y : it->second.x;
+}
+
+bool Profiler::startCapture(const char* filename)
+{
+	stopCapture();
+
+	capture_file = fopen(filename, "wb");
+	if (!capture_file)
+	{
+		std::cout << " - Profiler: could not open " << filename << std::endl;
+		return false;
+	}
+
+	capture_filename = filename;
+	capture_json = capture_filename.size() > 5 && capture_filename.substr(capture_filename.size() - 5) == ".json";
+	captured_frames = 0;
+
+	if (capture_json)
+		fprintf(capture_file, "[\n");
+	else
+	{
+		fprintf(capture_file, "frame,section,depth,parent,cpu_ms,gpu_ms");
+		for (int i = 0; i < STAT_COUNT; ++i)
+			fprintf(capture_file, ",%s", render_stat_names[i]);
+		fprintf(capture_file, "\n");
+	}
+
+	std::cout << " + Profiler: capturing to " << filename << std::endl;
+	return true;
+}
+
+void Profiler::stopCapture()
+{
+	if (!capture_file)
+		return;
+
+	if (capture_json)
+		fprintf(capture_file, "\n]\n");
+	fclose(capture_file);
+	capture_file = NULL;
+
+	std::cout << " + Profiler: " << captured_frames << " frames saved to " << capture_filename << std::endl;
+}
+
+void Profiler::writeCapture(sFrame& f)
+{
+	if (capture_json)
+	{
+		fprintf(capture_file, "%s\t{ \"frame\": %ld, \"sections\": [", captured_frames ? ",\n" : "", f.frame);
+		for (int i = 0; i < f.sections.size(); ++i)
+		{
+			sSection& section = f.sections[i];
+			fprintf(capture_file, "%s\n\t\t{ \"name\": \"%s\", \"depth\": %d, \"parent\": %d, \"cpu_ms\": %.4f, \"gpu_ms\": %.4f", i ? "," : "", section.name.c_str(), section.depth, section.parent, section.cpu_ms, section.gpu_ms);
+			for (int j = 0; j < STAT_COUNT; ++j)
+				fprintf(capture_file, ", \"%s\": %lld", render_stat_names[j], (long long)section.stats.counters[j]);
+			fprintf(capture_file, " }");
+		}
+		fprintf(capture_file, " ] }");
+	}
+	else
+	{
+		for (sSection& section : f.sections)
+		{
+			fprintf(capture_file, "%ld,%s,%d,%d,%.4f,%.4f", f.frame, section.name.c_str(), section.depth, section.parent, section.cpu_ms, section.gpu_ms);
+			for (int i = 0; i < STAT_COUNT; ++i)
+				fprintf(capture_file, ",%lld", (long long)section.stats.counters[i]);
+			fprintf(capture_file, "\n");
+		}
+	}
+	captured_frames++;
+}
+
+void Profiler::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Enabled", &enabled);
+	if (!timer_queries)
+		ImGui::Text("GPU timer queries not supported");
+	ImGui::SliderFloat("Smoothing", &smoothing, 0.0f, 0.99f);
+
+	ImGui::Columns(3, "profiler");
+	ImGui::Text("Section"); ImGui::NextColumn();
+	ImGui::Text("CPU ms"); ImGui::NextColumn();
+	ImGui::Text("GPU ms"); ImGui::NextColumn();
+	ImGui::Separator();
+	for (sSection& section : results)
+	{
+		Vector2& average = averages[section.name];
+		ImGui::Text("%*s%s", section.depth * 2, "", section.name.c_str()); ImGui::NextColumn();
+		ImGui::Text("%.3f", average.x); ImGui::NextColumn();
+		if (timer_queries)
+			ImGui::Text("%.3f", average.y);
+		else
+			ImGui::Text("-");
+		ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+
+	renderStatsInMenu();
+
+	if (!capture_file)
+	{
+		if (ImGui::Button("Start capture (profiler.csv)"))
+			startCapture("profiler.csv");
+		ImGui::SameLine();
+		if (ImGui::Button("Start capture (profiler.json)"))
+			startCapture("profiler.json");
+	}
+	else
+	{
+		ImGui::Text("Capturing %s: %ld frames", capture_filename.c_str(), captured_frames);
+		if (ImGui::Button("Stop capture"))
+			stopCapture();
+	}
+#endif
+}
+
+void Profiler::renderStatsInMenu()
+{
+#ifndef SKIP_IMGUI
+	if (!ImGui::TreeNode("Render stats"))
+		return;
+
+	ImGui::Checkbox("Min / avg / max", &show_stats_history);
+	ImGui::SameLine();
+	ImGui::Text("(last %d frames)", PROFILER_STATS_HISTORY);
+
+	ImGui::Columns(STAT_COUNT + 1, "render_stats");
+	ImGui::Text("Section"); ImGui::NextColumn();
+	for (int i = 0; i < STAT_COUNT; ++i)
+	{
+		ImGui::Text("%s", render_stat_names[i]); ImGui::NextColumn();
+	}
+	ImGui::Separator();
+
+	std::map<std::string, bool> shown;
+	for (sSection& section : last_sections)
+	{
+		//in the history the sections with the same name are added
+		if (show_stats_history && shown[section.name])
+			continue;
+		shown[section.name] = true;
+
+		ImGui::Text("%*s%s", section.depth * 2, "", section.name.c_str()); ImGui::NextColumn();
+		sRenderStats min, average, max;
+		bool history = show_stats_history && getStatsHistory(section.name.c_str(), min, average, max);
+		for (int i = 0; i < STAT_COUNT; ++i)
+		{
+			if (history)
+				ImGui::Text("%lld/%lld/%lld", (long long)min.counters[i], (long long)average.counters[i], (long long)max.counters[i]);
+			else
+				ImGui::Text("%lld", (long long)section.stats.counters[i]);
+			ImGui::NextColumn();
+		}
+	}
+	ImGui::Columns(1);
+	ImGui::TreePop();
+#endif
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "includes.h"
+#include "framework.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace GTR {
+
+	//frames in flight, the GPU times of a frame are read when its queries are reused (no stalls waiting for the GPU)
+	const int PROFILER_FRAMES = 2;
+	//frames in the min/avg/max of the render stats
+	const int PROFILER_STATS_HISTORY = 120;
+
+	enum eRenderStat { STAT_DRAW_CALLS, STAT_TRIANGLES, STAT_CULLED, STAT_SHADER_BINDS, STAT_TEXTURE_BINDS, STAT_UNIFORMS, STAT_FBO_BINDS, STAT_BLITS, STAT_COUNT };
+	extern const char* render_stat_names[STAT_COUNT];
+
+	// Draw calls and state changes, from the counters of Mesh, Shader, Texture and FBO. The counters only grow,
+	// a section keeps the difference between its end and its start (the nested sections are included)
+	struct sRenderStats {
+		int64_t counters[STAT_COUNT];	//64 bits, they only grow (long is 32 bits in MSVC)
+
+		void clear();
+		void read();		//current value of the counters
+		void add(const sRenderStats& stats);
+		void subtract(const sRenderStats& stats);
+	};
+
+	// Measures the CPU and GPU time of the sections of every frame.
+	// The GPU time uses timestamp queries (instead of GL_TIME_ELAPSED) so sections can be nested.
+	// Use PROFILE_SCOPE("name") at the start of a block to measure it
+	class Profiler
+	{
+	public:
+		static Profiler* instance;
+
+		struct sSection {
+			std::string name;
+			int depth;				//nesting level
+			int parent;				//index of the parent section, -1 for the root ones
+			double cpu_start;
+			float cpu_ms;
+			float gpu_ms;			//-1 if the GPU result was not available
+			GLuint queries[2];		//begin and end timestamps
+			sRenderStats stats;
+		};
+
+		struct sStatsHistory {
+			std::vector<sRenderStats> frames;	//ring buffer
+			int next;
+		};
+
+		struct sFrame {
+			long frame;
+			bool pending;			//waiting for the GPU results
+			int num_queries;
+			std::vector<GLuint> queries;
+			std::vector<sSection> sections;
+		};
+
+		bool enabled;
+		bool recording;				//enabled when the frame started
+		bool timer_queries;			//false if the driver does not support GL_TIMESTAMP
+		long frame;
+		int current;				//index in frames of the frame being recorded
+		sFrame frames[PROFILER_FRAMES];
+		std::vector<int> stack;		//sections open
+
+		std::vector<sSection> results;				//last frame resolved
+		std::map<std::string, Vector2> averages;	//smoothed cpu (x) and gpu (y) ms per section
+		float smoothing;
+
+		//the render stats do not wait for the GPU, they are from the last frame recorded
+		std::vector<sSection> last_sections;
+		std::map<std::string, sStatsHistory> stats_history;	//per section name, the sections with the same name in a frame are added
+		bool show_stats_history;
+
+		//capture of every frame to a file, .json or .csv depending on the extension
+		FILE* capture_file;
+		std::string capture_filename;
+		bool capture_json;
+		long captured_frames;
+
+		Profiler();
+		~Profiler();
+
+		void beginFrame();
+		void endFrame();
+
+		void beginSection(const char* name);
+		void endSection();
+
+		//smoothed GPU time of the whole frame (CPU time without timer queries), 0 if nothing was measured yet
+		float getFrameTime();
+
+		//render stats of a section in the last frame ("Frame" for all of it), false if it was not there
+		bool getStats(const char* section, sRenderStats& stats);
+		//minimum, average and maximum of the last frames where the section was recorded
+		bool getStatsHistory(const char* section, sRenderStats& min, sRenderStats& average, sRenderStats& max);
+
+		bool startCapture(const char* filename);
+		void stopCapture();
+
+		void renderInMenu();
+
+	private:
+		GLuint getQuery(sFrame& frame);
+		void resolve(sFrame& frame);
+		void writeCapture(sFrame& frame);
+		void updateStatsHistory(sFrame& frame);
+		void renderStatsInMenu();
+	};
+
+	//measures the block where it is declared, it is also recorded in the trace
+	struct ProfileScope {
+		TraceScope trace;
+		ProfileScope(const char* name) : trace(name) { if (Profiler::instance) Profiler::instance->beginSection(name); }
+		~ProfileScope() { if (Profiler::instance) Profiler::instance->endSection(); }
+	};
+
+};
+
+#define PROFILE_SCOPE_CONCAT2(a, b) a##b
+#define PROFILE_SCOPE_CONCAT(a, b) PROFILE_SCOPE_CONCAT2(a, b)
+#define PROFILE_SCOPE(name) GTR::ProfileScope PROFILE_SCOPE_CONCAT(_profile_scope_, __LINE__)(name)
@@ -10,7 +10,12 @@
 #include "BaseEntity.h"
 #include "scene.h"
 #include "application.h"
+#include "profiler.h"
+#include "exposure.h"
 #include "extra/hdre.h"
+#include "trace.h"
+
+#include <algorithm>
 
 using namespace GTR;
 
@@ -20,6 +25,38 @@ void GTR::Renderer::initFlags()
 	//flags
 	show_light_meshes = true;
 
+	//the frame targets are created by the render graph
+	render_graph = new RenderGraph();
+	gbuffers_fbo = NULL;
+	illumination_fbo = NULL;
+	ssao_fbo = NULL;
+	ssao_blur = NULL;
+	decals_fbo = NULL;
+	luminance_texture = NULL;
+	luminance_fbo = NULL;
+	exposure_fbo[0] = exposure_fbo[1] = NULL;
+	for (int i = 0; i < NUM_BLOOM_LEVELS; ++i)
+		bloom_fbo[i] = NULL;
+	exposure_index = 0;
+	exposure_valid = false;
+	exposure_reset = false;
+	ssao_depth_normals = NULL;
+	reflections_component = NULL;
+	ssr_fbo = NULL;
+	volumetrics_fbo = NULL;
+	occlusion_test = NULL;
+	occlusion_camera = NULL;
+	light_shaders = ShaderPermutations::Get("light");
+	deferred_light_shaders = ShaderPermutations::Get("deferredLight");
+	no_lights_shaders = ShaderPermutations::Get("noLights");
+	skybox_shaders = ShaderPermutations::Get("skybox");
+	volumetrics_texture = NULL;
+	reflections_texture = NULL;
+	illumination_upscaled = NULL;
+	volumetrics_upscaled = NULL;
+	reflections_upscaled = NULL;
+	reflections_composite = NULL;
+
 	show_gbuffers = false;
 	use_geometry_on_deferred = true;
 	show_deferred_light_geometry = false;
@@ -30,9 +67,33 @@ void GTR::Renderer::initFlags()
 	use_ssao_plus = true;
 	kernel_size = 5;
 	sphere_radius = 3.0f;
-	number_blur = 5;
+	ssao_depth_sharpness = 10.0f;
+	use_optimized_ssao = true;
+	ssao_samples = 16;
+	ssao_history_weight = 0.9f;
+	ssao_kernel = GTR::generateSpherePoints(ssao_samples, 1.0f, use_ssao_plus);
 	number_points = 100;
 
+	occlusion_culling = OCCLUSION_NONE;
+	max_occluder_triangles = 50000;
+	min_occluder_size = 0.1f;
+
+	use_lods = true;
+	lod_max_error = 1.0f;
+	lod_hysteresis = 0.25f;
+	use_lod_cross_fade = true;
+	lod_fade_time = 0.3f;
+	lod_screen_scale = 1.0f;
+	lod_fade = 0.0f;
+
+	use_taa = true;
+	taa_history_weight = 0.9f;
+
+	use_dynamic_resolution = false;
+	frame_budget_ms = 16.6f;
+	min_render_scale = 0.5f;
+	render_scale = 1.0f;
+
 	use_gamma_correction = false;
 	use_tone_mapping = false;
 
@@ -44,17 +105,38 @@ void GTR::Renderer::initFlags()
 	use_irradiance = true;
 	show_coefficients = false;
 	interpolate_probes = true;
+	dynamic_irradiance = false;
+	irradiance_bounces = 1;
+	bounce_threshold = 0.01;
+	use_layered_probes = true;
+	irr_layered_fbo = NULL;
+	rendering_layers = false;
+	first_layer = 0;
+	surfels_fbo = NULL;
 	irr_normal_distance = 1.0f;
 	probes_filename = "irradiance.bin";
+	bake_progress_filename = "irradiance_bake.bin";
+	probes_texture = NULL;
+	for (int i = 0; i < NUM_PROBE_VOLUMES; i++)
+		probes_volumes[i] = NULL;
 
 	use_reflections = true;
+	reflections_capture = NULL;
+	refl_layered_fbo = NULL;
 	show_rProbes = false;
 	refl_normal_distance = 50;
+	use_ssr = true;
+	ssr_max_rays = 4;
+	ssr_max_roughness = 0.6f;
+	ssr_max_distance = 500.0f;
+	ssr_thickness = 20.0f;
+	ssr_max_steps = 64;
 
 	use_volumetric = true;
-	u_quality = 64;
+	u_quality = 32;						//the temporal accumulation makes up for the steps
 	u_air_density = 0.004f;
 	u_clamp = 3.0f;
+	use_temporal_volumetrics = true;
 
 	show_decal = true;
 	decal_cube = new Mesh();
@@ -64,9 +146,296 @@ void GTR::Renderer::initFlags()
 	lum_white = 1.0f;
 	tonemap_scale = 1.0f;
 	average_lum = 0.9;
+	use_auto_exposure = true;
+	exposure_speed_up = 3.0f;
+	exposure_speed_down = 1.0f;
+	min_luminance = 0.01f;
+	max_luminance = 100.0f;
+	use_bloom = true;
+	bloom_threshold = 1.0f;
+	bloom_knee = 0.5f;
+	bloom_intensity = 0.1f;
+}
+
+//part of a target used by the dynamic resolution, FBO::bind rounds the viewport the same way
+static Vector2 viewportScale(int width, int height, float scale)
+{
+	if (scale == 1.0f)
+		return Vector2(1.0f, 1.0f);
+	return Vector2(std::max(1, (int)(width * scale)) / (float)width, std::max(1, (int)(height * scale)) / (float)height);
+}
+
+//the clip space of the frame mapped to the part of the targets where it is rendered,
+//so the screen space shaders reconstruct and project positions directly in the uvs of the textures
+static Matrix44 scaleViewProjection(const Matrix44& viewprojection, Vector2 scale)
+{
+	Matrix44 m;
+	m.M[0][0] = scale.x;
+	m.M[3][0] = scale.x - 1.0f;
+	m.M[1][1] = scale.y;
+	m.M[3][1] = scale.y - 1.0f;
+	return viewprojection * m;
 }
 
 //DEFERRED
+//declares the passes of the frame and lets the render graph allocate the targets and skip what is not used
+void Renderer::renderDeferred(Scene* scene, Camera* camera)
+{
+	TRACE_SCOPE("Renderer::renderDeferred");
+	Application* application = Application::instance;
+	RenderGraph* graph = render_graph;
+	graph->beginFrame(application->window_width, application->window_height);
+
+	updateRenderScale();
+	graph->render_scale = render_scale;
+	Vector2 scaled_size = Vector2(application->window_width, application->window_height) * render_scale;
+
+	//subpixel jitter of the projection (halton 2,3), the TAA accumulates the samples of several frames.
+	//the history is reprojected with the viewprojection without jitter
+	Matrix44 viewprojection = camera->viewprojection_matrix;
+	if (use_taa)
+	{
+		int index = application->frame % 8 + 1;
+		camera->jitter = Vector2((halton(index, 2) - 0.5f) * 2.0f / scaled_size.x, (halton(index, 3) - 0.5f) * 2.0f / scaled_size.y);
+		camera->updateProjectionMatrix();
+	}
+	screen_viewprojection = scaleViewProjection(camera->viewprojection_matrix, viewportScale(application->window_width, application->window_height, render_scale));
+	updateOcclusion(scene, camera);
+
+	//the scene targets are dynamic: allocated at full size and rendered in a part of them
+	int gbuffers = graph->addResource("gbuffers", sRenderTargetDesc(1.0f, 3, GL_RGBA, GL_UNSIGNED_BYTE, true, GL_NEAREST, true), &gbuffers_fbo);
+	int ssao = graph->addResource("ssao", sRenderTargetDesc(0.5f, 1, GL_RGBA, GL_HALF_FLOAT, false, GL_NEAREST, true), &ssao_fbo);
+	int ssao_blurred = graph->addResource("ssao blur", sRenderTargetDesc(0.5f, 1, GL_RGBA, GL_HALF_FLOAT, false, GL_NEAREST, true), &ssao_blur);
+	int ssao_depth_normals_target = graph->addResource("ssao depth normals", sRenderTargetDesc(0.5f, 1, GL_RGBA, GL_FLOAT, false, GL_NEAREST, true), &ssao_depth_normals);
+	//the lighting is accumulated in HDR (RGB16F is not required to be renderable, so RGBA)
+	int illumination = graph->addResource("illumination", sRenderTargetDesc(1.0f, 1, GL_RGBA, GL_HALF_FLOAT, false, GL_LINEAR, true), &illumination_fbo);
+	int volumetrics = graph->addResource("volumetrics", sRenderTargetDesc(0.25f, 1, GL_RGBA, GL_UNSIGNED_BYTE, false, GL_NEAREST, true), &volumetrics_fbo);
+	int reflections = graph->addResource("reflections", sRenderTargetDesc(1.0f, 1, GL_RGBA, GL_HALF_FLOAT, false, GL_NEAREST, true), &reflections_component);
+	int ssr = graph->addResource("ssr", sRenderTargetDesc(0.5f, 1, GL_RGBA, GL_HALF_FLOAT, false, GL_LINEAR, true), &ssr_fbo);
+	//the temporal passes output full size, so they upscale what they accumulate. The rest is stretched to these
+	bool upscale = render_scale < 1.0f;
+	int illumination_full = graph->addResource("illumination upscaled", sRenderTargetDesc(1.0f, 1, GL_RGBA, GL_HALF_FLOAT, false, GL_LINEAR), &illumination_upscaled);
+	int volumetrics_full = graph->addResource("volumetrics upscaled", sRenderTargetDesc(0.25f, 1, GL_RGBA, GL_UNSIGNED_BYTE), &volumetrics_upscaled);
+	int reflections_full = graph->addResource("reflections upscaled", sRenderTargetDesc(1.0f, 1, GL_RGBA, GL_HALF_FLOAT), &reflections_upscaled);
+	int composite = graph->addResource("reflections composite", sRenderTargetDesc(1.0f, 1, GL_RGBA, GL_HALF_FLOAT, false, GL_LINEAR), &reflections_composite);
+	static const char* bloom_names[NUM_BLOOM_LEVELS] = { "bloom 1/2", "bloom 1/4", "bloom 1/8", "bloom 1/16", "bloom 1/32" };
+	std::vector<int> bloom;
+	for (int i = 0; i < NUM_BLOOM_LEVELS; ++i)
+		bloom.push_back(graph->addResource(bloom_names[i], sRenderTargetDesc(1.0f / (2 << i), 1, GL_RGBA, GL_HALF_FLOAT, false, GL_LINEAR), &bloom_fbo[i]));
+
+	graph->addPass("GBuffers", {}, { gbuffers }, [=]() { renderGBuffers(scene, camera); });
+	graph->addPass("SSAO downsample", { gbuffers }, { ssao_depth_normals_target }, [=]() { downsampleSSAO(); }, use_optimized_ssao);
+	if (use_optimized_ssao)
+		graph->addPass("SSAO", { ssao_depth_normals_target }, { ssao }, [=]() { renderOptimizedSSAO(camera); });
+	else
+		graph->addPass("SSAO", { gbuffers }, { ssao }, [=]() { renderSSAO(camera); });
+	graph->addPass("SSAO blur", { gbuffers, ssao }, { ssao, ssao_blurred }, [=]() { blurSSAO(); });
+
+	std::vector<int> lighting_inputs = { gbuffers };
+	if (use_ssao)
+		lighting_inputs.push_back(ssao);
+	graph->addPass("Lighting", lighting_inputs, { illumination }, [=]() {
+		renderIlluminationToBuffer(camera);
+		{
+			PROFILE_SCOPE("Forward blends");
+			forward_for_blends = true;
+			renderSceneForward(scene, camera);
+			forward_for_blends = false;
+		}
+		illumination_fbo->unbind();
+	});
+
+	graph->addPass("TAA", { illumination, gbuffers }, {}, [=]() {
+		accumulateTemporal(taa_history, illumination_fbo->color_textures[0], camera, viewprojection, taa_history_weight);
+	}, use_taa, true);
+	graph->addPass("Upscale", { illumination }, { illumination_full }, [=]() { upscaleTarget(illumination_fbo, illumination_upscaled); }, upscale && !use_taa);
+	int scene_color = upscale && !use_taa ? illumination_full : illumination;
+
+	//the volumetrics are noisy and the reflections jitter with the camera, both can be accumulated like the TAA
+	std::vector<int> volumetrics_outputs = { volumetrics };
+	if (upscale && !use_temporal_volumetrics)
+		volumetrics_outputs.push_back(volumetrics_full);
+	graph->addPass("Volumetrics", { gbuffers }, volumetrics_outputs, [=]() {
+		renderVolumetricsToBuffer(camera);
+		volumetrics_texture = volumetrics_fbo->color_textures[0];
+		if (use_temporal_volumetrics)
+			volumetrics_texture = accumulateTemporal(volumetrics_history, volumetrics_texture, camera, viewprojection, taa_history_weight);
+		else if (upscale)
+			volumetrics_texture = upscaleTarget(volumetrics_fbo, volumetrics_upscaled);
+	}, use_volumetric);
+	//the hierarchical depth is kept after the frame (not a graph target), so the pass is never culled while something uses it
+	bool use_screen_reflections = use_reflections && use_ssr;
+	bool use_hiz_occlusion = occlusion_culling == OCCLUSION_HIZ;
+	graph->addPass("Hi-Z", { gbuffers }, {}, [=]() {
+		hiz.build(gbuffers_fbo->depth_texture, screen_viewprojection);
+		if (use_hiz_occlusion)
+			hiz_occlusion.readback(hiz, OCCLUSION_HIZ_SIZE, application->frame);
+	}, use_screen_reflections || use_hiz_occlusion, true);
+	graph->addPass("SSR", { gbuffers, illumination }, { ssr }, [=]() { renderSSR(camera); }, use_screen_reflections);
+
+	std::vector<int> reflections_inputs = { gbuffers };
+	if (use_screen_reflections)
+		reflections_inputs.push_back(ssr);
+	std::vector<int> reflections_outputs = { reflections };
+	if (upscale && !use_taa)
+		reflections_outputs.push_back(reflections_full);
+	graph->addPass("Reflections", reflections_inputs, reflections_outputs, [=]() {
+		renderReflectionsToBuffer(camera);
+		reflections_texture = reflections_component->color_textures[0];
+		if (use_taa)
+			reflections_texture = accumulateTemporal(reflections_history, reflections_texture, camera, viewprojection, taa_history_weight);
+		else if (upscale)
+			reflections_texture = upscaleTarget(reflections_component, reflections_upscaled);
+	}, use_reflections);
+	//added in HDR, the history of the TAA is the scene color so they go to another target
+	graph->addPass("Composite reflections", { scene_color, upscale && !use_taa ? reflections_full : reflections }, { composite }, [=]() { compositeReflections(); }, use_reflections);
+	if (use_reflections)
+		scene_color = composite;
+
+	graph->addPass("Auto exposure", { scene_color }, {}, [=]() { computeExposure(); }, use_tone_mapping && use_auto_exposure, true);
+
+	graph->addPass("Bloom", { scene_color }, bloom, [=]() { renderBloom(); }, use_tone_mapping && use_bloom);
+
+	std::vector<int> tonemap_inputs = { scene_color };
+	if (use_tone_mapping && use_bloom)
+		tonemap_inputs.push_back(bloom[0]);
+	if (use_volumetric)
+		tonemap_inputs.push_back(volumetrics);
+	if (show_probes || show_rProbes || show_gbuffers)
+		tonemap_inputs.push_back(gbuffers);
+	if (show_ssao && use_ssao)
+		tonemap_inputs.push_back(ssao);
+	graph->addPass("Tone map", tonemap_inputs, {}, [=]() {
+		//set default flags
+		glDisable(GL_BLEND);
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_CULL_FACE);
+		glFrontFace(GL_CCW);
+		renderToViewport(camera, scene);
+	}, true, true);
+
+	{
+		PROFILE_SCOPE("Render graph compile");
+		graph->compile();
+	}
+	graph->execute();
+
+	if (use_taa)
+	{
+		camera->jitter = Vector2(0, 0);
+		camera->updateProjectionMatrix();
+	}
+}
+
+//adds the reflections (weighted by their alpha) to the illumination in HDR, so the exposure, bloom and tone mapping include them
+void Renderer::compositeReflections()
+{
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+
+	reflections_composite->bind();
+	getIlluminationColor()->toViewport();
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+	reflections_texture->toViewport();
+	glDisable(GL_BLEND);
+	reflections_composite->unbind();
+
+	glEnable(GL_CULL_FACE);
+}
+
+//reprojects the history of the last frames over the current one (neighborhood clamped) and blends them, returns the result
+Texture* Renderer::accumulateTemporal(TemporalHistory& history, Texture* current, Camera* camera, const Matrix44& viewprojection, float weight)
+{
+	Mesh* quad = Mesh::getQuad();
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	//the output is full size, with dynamic resolution the current frame is only a part of its texture
+	history.prepare(current->width, current->height);
+	history.swap();
+
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+
+	Shader* shader = Shader::Get("temporalAccumulate");
+	shader->enable();
+	shader->setTexture("u_texture", current, 0);
+	shader->setTexture("u_history_texture", history.previous()->color_textures[0], 1);
+	shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 2);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_prev_viewprojection", history.prev_viewprojection);
+	shader->setUniform("u_iRes", Vector2(1.0f / current->width, 1.0f / current->height));
+	shader->setUniform("u_source_scale", viewportScale(current->width, current->height, render_scale));
+	shader->setUniform("u_history_weight", history.valid ? weight : 0.0f);
+	shader->setUniform("u_neighborhood_clamp", true);
+
+	history.current()->bind();
+	quad->render(GL_TRIANGLES);
+	history.current()->unbind();
+	shader->disable();
+
+	history.update(viewprojection);
+	return history.result();
+}
+
+Texture* Renderer::getSceneColor()
+{
+	if (use_reflections && reflections_composite)
+		return reflections_composite->color_textures[0];
+	return getIlluminationColor();
+}
+
+Texture* Renderer::getIlluminationColor()
+{
+	if (use_taa && taa_history.valid)
+		return taa_history.result();
+	if (illumination_upscaled)
+		return illumination_upscaled->color_textures[0];
+	return illumination_fbo->color_textures[0];
+}
+
+//dynamic resolution: the work of the scene targets goes with their pixels (the square of the scale), so the scale is
+//corrected with the square root of the budget over the GPU time of the frame. The time is smoothed by the profiler,
+//the steps are small and nothing changes while it is inside a band under the budget, so it does not oscillate
+void Renderer::updateRenderScale()
+{
+	float scale = render_scale;
+	Profiler* profiler = Profiler::instance;
+	float frame_ms = profiler ? profiler->getFrameTime() : 0.0f;
+
+	if (!use_dynamic_resolution)
+		scale = 1.0f;
+	else if (frame_ms > 0.0f && (frame_ms > frame_budget_ms || frame_ms < frame_budget_ms * 0.85f))
+	{
+		float correction = sqrtf(frame_budget_ms * 0.925f / frame_ms);
+		scale = render_scale * clamp(correction, 0.95f, 1.05f);
+		scale = clamp(scale, min_render_scale, 1.0f);
+	}
+
+	//the ssao history is kept in a part of a half resolution target, the full size histories are not affected
+	if (scale != render_scale)
+		ssao_history.invalidate();
+	render_scale = scale;
+}
+
+//stretches the part of a dynamic target used this frame to the whole target, returns its texture
+Texture* Renderer::upscaleTarget(FBO* source, FBO* target)
+{
+	Vector2 scale = viewportScale(source->width, source->height, render_scale);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, source->fbo_id);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target->fbo_id);
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glBlitFramebuffer(0, 0, (int)(source->width * scale.x + 0.5f), (int)(source->height * scale.y + 0.5f), 0, 0, target->width, target->height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	Texture::num_blits++;
+	glBindFramebuffer(GL_FRAMEBUFFER, FBO::screen_fbo_id);
+
+	return target->color_textures[0];
+}
+
 void Renderer::renderGBuffers(Scene* scene, Camera* camera)
 {
 	gbuffers_fbo->bind();
@@ -100,23 +469,29 @@ void Renderer::renderGBuffers(Scene* scene, Camera* camera)
 	//stop rendering to the gbuffers
 	gbuffers_fbo->unbind();
 
-	gbuffers_fbo->depth_texture->copyTo(depth_texture_aux);
-	gbuffers_fbo->color_textures[1]->copyTo(normal_texture_aux);
-
 	if (show_decal)
 	{
 		Application* application = Application::instance;
-		gbuffers_fbo->bind();
 
+		//the decal only writes GB0 and GB2, so it can read the depth of the gbuffers directly without copying it
+		if (!decals_fbo)
+			decals_fbo = new FBO();
+		//attached every frame: the render graph can free the gbuffers (resize or unused) and a new texture may reuse the
+		//same address with another GL name or size, and attaching two textures is cheap compared to the decal itself
+		decals_fbo->setTextures({ gbuffers_fbo->color_textures[0], gbuffers_fbo->color_textures[2] });
+		decals_fbo->viewport_scale = gbuffers_fbo->viewport_scale;
+		decals_fbo->bind();
+
+		//no depth test, render the back faces so the decal is visible also when the camera is inside the box
 		glDisable(GL_BLEND);
-		//glBlendFunc(GL_ONE, GL_ONE);
-		glEnable(GL_DEPTH_TEST);
+		glDisable(GL_DEPTH_TEST);
 		glEnable(GL_CULL_FACE);
+		glFrontFace(GL_CW);
 
 		Shader* shader = Shader::Get("decal");
 		shader->enable();
 
-		Matrix44 inv_vp = camera->viewprojection_matrix;
+		Matrix44 inv_vp = screen_viewprojection;
 		inv_vp.inverse();
 
 		Matrix44 m;
@@ -135,18 +510,17 @@ void Renderer::renderGBuffers(Scene* scene, Camera* camera)
 		shader->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->depth_texture->width, 1.0 / (float)gbuffers_fbo->depth_texture->height));
 		shader->setUniform("u_camera_pos", camera->eye);
 		shader->setUniform("u_model", m);
-		shader->setTexture("u_depth_texture", depth_texture_aux, 0);
-		shader->setTexture("u_normal_texture", normal_texture_aux, 1);
-		shader->setTexture("u_texture", Texture::Get("data/textures/decal.png"), 2);
-		shader->setTexture("u_texture_material", Texture::Get("data/textures/decal_material.png"), 3);
+		shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 0);
+		shader->setTexture("u_texture", Texture::Get("data/textures/decal.png"), 1);
+		shader->setTexture("u_texture_material", Texture::Get("data/textures/decal_material.png"), 2);
 		shader->setUniform("u_metallic_factor", 1.0f);
 		shader->setUniform("u_roughness_factor", 1.0f);
 
 		decal_cube->render(GL_TRIANGLES);
-		
-		gbuffers_fbo->unbind();	
 
-		depth_texture_aux->copyTo(gbuffers_fbo->depth_texture);
+		glFrontFace(GL_CCW);
+		glEnable(GL_DEPTH_TEST);
+		decals_fbo->unbind();
 	}
 }
 
@@ -166,6 +540,7 @@ void Renderer::renderToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material*
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 
 	shader->setUniform("u_use_gamma_correction", use_gamma_correction);
+	shader->setUniform("u_lod_fade", lod_fade);
 
 	material->setUniforms(shader, true);
 
@@ -181,27 +556,7 @@ void Renderer::renderSSAO(Camera* camera)
 	Shader* shader = Shader::Get("ssao");
 	shader->enable();
 
-	////bind the texture we want to change
-	gbuffers_fbo->bind();
-
-	//disable using mipmaps
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-	//enable bilinear filtering
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-	gbuffers_fbo->unbind();
-
-	////bind the texture we want to change
-	gbuffers_fbo->color_textures[1]->bind();
-
-	//disable using mipmaps
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-	//enable bilinear filtering
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-	gbuffers_fbo->color_textures[1]->unbind();
+	//the gbuffers keep the nearest filtering, the packed normals can not be interpolated
 
 	//start rendering inside the ssao texture
 	ssao_fbo->bind();
@@ -212,7 +567,7 @@ void Renderer::renderSSAO(Camera* camera)
 	ssao_fbo->enableAllBuffers();
 
 
-	Matrix44 inv_vp = camera->viewprojection_matrix;
+	Matrix44 inv_vp = screen_viewprojection;
 	inv_vp.inverse();
 
 	//send info to reconstruct the world position
@@ -220,7 +575,9 @@ void Renderer::renderSSAO(Camera* camera)
 	//we need the pixel size so we can center the samples 
 	shader->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->depth_texture->width, 1.0 / (float)gbuffers_fbo->depth_texture->height));
 	//we will need the viewprojection to obtain the uv in the depthtexture of any random position of our world
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	shader->setUniform("u_viewprojection", screen_viewprojection);
+	//the quad covers only the part of the target used by the dynamic resolution
+	shader->setUniform("u_uv_scale", viewportScale(ssao_fbo->width, ssao_fbo->height, render_scale));
 
 	shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 0);
 	shader->setTexture("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
@@ -229,6 +586,7 @@ void Renderer::renderSSAO(Camera* camera)
 	shader->setUniform3Array("u_points", (float*)&random_points[0], random_points.size());
 	shader->setUniform("u_radius", sphere_radius);
 	shader->setUniform("u_use_ssao_plus", use_ssao_plus);
+	shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
 
 	//render fullscreen quad
 	Mesh* quad = Mesh::getQuad();
@@ -238,29 +596,249 @@ void Renderer::renderSSAO(Camera* camera)
 	ssao_fbo->unbind();
 
 	shader->disable();
+}
+
+//half resolution copy of the depth (the closest of every 2x2 block) and its normal, so the ssao fetches less memory
+void Renderer::downsampleSSAO()
+{
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	Shader* shader = Shader::Get("ssaoDownsample");
+	shader->enable();
+	shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 0);
+	shader->setTexture("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->width, 1.0 / (float)gbuffers_fbo->height));
+	shader->setUniform("u_uv_scale", viewportScale(ssao_depth_normals->width, ssao_depth_normals->height, render_scale));
+
+	ssao_depth_normals->bind();
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	ssao_depth_normals->unbind();
+
+	shader->disable();
+}
+
+//few samples per pixel rotated with a 4x4 pattern (the blur mixes the neighbours) and a
+//different rotation every frame, accumulated over time with the reprojected previous result
+void Renderer::renderOptimizedSSAO(Camera* camera)
+{
+	Mesh* quad = Mesh::getQuad();
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	Matrix44 inv_vp = screen_viewprojection;
+	inv_vp.inverse();
+	Vector2 nearfar(camera->near_plane, camera->far_plane);
+	Vector2 uv_scale = viewportScale(ssao_fbo->width, ssao_fbo->height, render_scale);
+
+	Shader* shader = Shader::Get("ssaoInterleaved");
+	shader->enable();
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_viewprojection", screen_viewprojection);
+	shader->setUniform("u_uv_scale", uv_scale);
+	shader->setUniform("u_camera_nearfar", nearfar);
+	shader->setTexture("u_depth_normal_texture", ssao_depth_normals->color_textures[0], 0);
+	shader->setUniform3Array("u_points", (float*)&ssao_kernel[0], ssao_kernel.size());
+	shader->setUniform("u_num_samples", (int)ssao_kernel.size());
+	shader->setUniform("u_radius", sphere_radius);
+	//golden angle, so consecutive frames use rotations far from each other
+	shader->setUniform("u_frame_angle", (float)(Application::instance->frame % 1024) * 2.39996f);
+
+	ssao_fbo->bind();
+	quad->render(GL_TRIANGLES);
+	ssao_fbo->unbind();
+	shader->disable();
+
+	//temporal accumulation, the history is kept between frames so it is not part of the render graph
+	ssao_history.prepare(ssao_fbo->width, ssao_fbo->height, GL_RGBA, GL_HALF_FLOAT, GL_NEAREST);
+	ssao_history.swap();
+	FBO* previous = ssao_history.previous();
+	FBO* current = ssao_history.current();
+	current->viewport_scale = render_scale;
+
+	shader = Shader::Get("ssaoTemporal");
+	shader->enable();
+	shader->setTexture("u_texture", ssao_fbo->color_textures[0], 0);
+	shader->setTexture("u_history_texture", previous->color_textures[0], 1);
+	shader->setTexture("u_depth_normal_texture", ssao_depth_normals->color_textures[0], 2);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_prev_viewprojection", ssao_history.prev_viewprojection);
+	shader->setUniform("u_history_weight", ssao_history.valid ? ssao_history_weight : 0.0f);
+	shader->setUniform("u_uv_scale", uv_scale);
+
+	current->bind();
+	quad->render(GL_TRIANGLES);
+	current->unbind();
+	shader->disable();
 
-	// Blur
-	//get the shader for SSAO (remember to create it using the atlas)
-	Shader* blur_shader = Shader::Get("blur");
+	ssao_history.update(screen_viewprojection);
+}
+
+//separable bilateral blur: horizontal from the ao (ssao_fbo or the accumulated history) to ssao_blur and vertical to ssao_fbo
+void Renderer::blurSSAO()
+{
+	Mesh* quad = Mesh::getQuad();
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	Shader* blur_shader = Shader::Get("ssaoBlur");
 	blur_shader->enable();
 
-	blur_shader->setTexture("u_texture", ssao_fbo->color_textures[0], 0);
+	blur_shader->setTexture("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
 	blur_shader->setUniform("u_kernel_size", kernel_size);
-	blur_shader->setUniform("u_offset", Vector2(1.0/ssao_fbo->color_textures[0]->width, 1.0/ssao_fbo->color_textures[0]->height));
+	blur_shader->setUniform("u_depth_sharpness", ssao_depth_sharpness);
+	blur_shader->setUniform("u_iRes", Vector2(1.0 / ssao_fbo->width, 1.0 / ssao_fbo->height));
+	blur_shader->setUniform("u_uv_scale", viewportScale(ssao_fbo->width, ssao_fbo->height, render_scale));
+
+	Texture* source = use_optimized_ssao ? ssao_history.result() : ssao_fbo->color_textures[0];
+
+	ssao_blur->bind();
+	blur_shader->setTexture("u_texture", source, 0);
+	blur_shader->setUniform("u_direction", Vector2(1, 0));
+	quad->render(GL_TRIANGLES);
+	ssao_blur->unbind();
+
+	ssao_fbo->bind();
+	blur_shader->setTexture("u_texture", ssao_blur->color_textures[0], 0);
+	blur_shader->setUniform("u_direction", Vector2(0, 1));
+	quad->render(GL_TRIANGLES);
+	ssao_fbo->unbind();
+
+	blur_shader->disable();
+}
+
+//average luminance of the illumination: log luminance to a power of two target reduced with its mip chain,
+//then adapted over time in a 1x1 target that the tone mapper reads directly (no readback)
+void Renderer::computeExposure()
+{
+	Mesh* quad = Mesh::getQuad();
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
 
-	for (int i = 0; i < number_blur; i++)
+	if (!luminance_texture)
 	{
-		if (i % 2) 
-			ssao_blur->copyTo(ssao_fbo->color_textures[0], blur_shader);
-		else 
-			ssao_fbo->color_textures[0]->copyTo(ssao_blur, blur_shader);
+		luminance_texture = new Texture(LUMINANCE_SIZE, LUMINANCE_SIZE, GL_RGBA, GL_HALF_FLOAT, true);
+		luminance_fbo = new FBO();
+		luminance_fbo->setTexture(luminance_texture);
+		for (int i = 0; i < 2; ++i)
+		{
+			exposure_fbo[i] = new FBO();
+			exposure_fbo[i]->create(1, 1, 1, GL_RGBA, GL_FLOAT, false);
+		}
+		exposure_valid = false;
 	}
 
-	if (number_blur % 2)
-		ssao_fbo->color_textures[0]->copyTo(ssao_blur);
+	Shader* shader = Shader::Get("luminanceLog");
+	shader->enable();
+	shader->setTexture("u_texture", getSceneColor(), 0);
+	shader->setUniform("u_luminance_range", Vector2(min_luminance, max_luminance));
+	luminance_fbo->bind();
+	quad->render(GL_TRIANGLES);
+	luminance_fbo->unbind();
+	shader->disable();
 
-	blur_shader->disable();
+	luminance_texture->generateMipmaps();
+
+	FBO* previous = exposure_fbo[exposure_index];
+	exposure_index = 1 - exposure_index;
+	FBO* current = exposure_fbo[exposure_index];
+
+	shader = Shader::Get("exposureAdapt");
+	shader->enable();
+	shader->setTexture("u_luminance_texture", luminance_texture, 0);
+	shader->setUniform("u_luminance_level", log2f((float)LUMINANCE_SIZE));
+	shader->setTexture("u_previous_texture", previous->color_textures[0], 1);
+	shader->setUniform("u_elapsed_time", Application::instance->elapsed_time);
+	shader->setUniform("u_speed", Vector2(exposure_speed_up, exposure_speed_down));
+	exposure_reset = !exposure_valid;
+	shader->setUniform("u_reset", exposure_reset);
+	current->bind();
+	quad->render(GL_TRIANGLES);
+	current->unbind();
+	shader->disable();
+
+	exposure_valid = true;
+}
+
+//reads back the illumination and the exposure of the last frame to compare the GPU reduction and adaptation with the
+//CPU reference (stalls, debug only). Returns 1 if the relative error of one of them is above the tolerance
+int Renderer::checkExposure(float tolerance)
+{
+	if (!illumination_fbo || !exposure_valid)
+	{
+		std::cout << "[ERROR]: no auto exposure to check, it is computed with the tone mapping" << std::endl;
+		return 1;
+	}
+
+	Texture* texture = getSceneColor();
+	FloatImage image;
+	image.resize(texture->width, texture->height, 3);
+	texture->bind();
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, image.data);
+	texture->unbind();
+
+	//x: adapted luminance, y: luminance of the frame (see exposureAdapt.fs)
+	float gpu[4];
+	float previous[4];
+	exposure_fbo[exposure_index]->color_textures[0]->bind();
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, gpu);
+	exposure_fbo[1 - exposure_index]->color_textures[0]->bind();
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, previous);
+	exposure_fbo[1 - exposure_index]->color_textures[0]->unbind();
+
+	float cpu = averageLuminance(image, min_luminance, max_luminance);
+	float adapted = exposure_reset ? cpu : adaptLuminance(previous[0], cpu, Application::instance->elapsed_time, exposure_speed_up, exposure_speed_down);
+	float error = fabs(gpu[1] - cpu) / std::max(cpu, 1e-6f);
+	float adapted_error = fabs(gpu[0] - adapted) / std::max(adapted, 1e-6f);
+	bool fails = error > tolerance || adapted_error > tolerance;
+	std::cout << (fails ? " * " : " + ") << "Average luminance: GPU " << gpu[1] << ", CPU reference " << cpu << " (" << error * 100.0f << "%). "
+		<< "Adapted from " << (exposure_reset ? cpu : previous[0]) << ": GPU " << gpu[0] << ", CPU reference " << adapted << " (" << adapted_error * 100.0f << "%)" << std::endl;
+	return fails ? 1 : 0;
+}
+
+//bloom pyramid: every level is a 13 tap downsample of the previous one (the first keeps only what is above the threshold),
+//then from the smallest one every level is upsampled with a tent filter and added to the next bigger one.
+//the cost depends on the pyramid, not on the radius of the bloom
+void Renderer::renderBloom()
+{
+	Mesh* quad = Mesh::getQuad();
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	Shader* shader = Shader::Get("bloomDownsample");
+	shader->enable();
+	shader->setUniform("u_threshold", Vector2(bloom_threshold, bloom_knee));
 
+	Texture* source = getSceneColor();
+	for (int i = 0; i < NUM_BLOOM_LEVELS; ++i)
+	{
+		shader->setTexture("u_texture", source, 0);
+		shader->setUniform("u_iRes", Vector2(1.0f / source->width, 1.0f / source->height));
+		shader->setUniform("u_prefilter", i == 0);
+		bloom_fbo[i]->bind();
+		quad->render(GL_TRIANGLES);
+		bloom_fbo[i]->unbind();
+		source = bloom_fbo[i]->color_textures[0];
+	}
+	shader->disable();
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+
+	shader = Shader::Get("bloomUpsample");
+	shader->enable();
+	for (int i = NUM_BLOOM_LEVELS - 1; i > 0; --i)
+	{
+		source = bloom_fbo[i]->color_textures[0];
+		shader->setTexture("u_texture", source, 0);
+		shader->setUniform("u_iRes", Vector2(1.0f / source->width, 1.0f / source->height));
+		bloom_fbo[i - 1]->bind();
+		quad->render(GL_TRIANGLES);
+		bloom_fbo[i - 1]->unbind();
+	}
+	shader->disable();
+
+	glDisable(GL_BLEND);
 }
 
 void Renderer::renderIlluminationToBuffer(Camera* camera)
@@ -294,13 +872,13 @@ void Renderer::renderIlluminationToBuffer(Camera* camera)
 	sh->setTexture("u_emissive_texture", gbuffers_fbo->color_textures[2], 2);
 	sh->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 3);
 
-	Matrix44 inv_vp = camera->viewprojection_matrix;
+	Matrix44 inv_vp = screen_viewprojection;
 	inv_vp.inverse();
 	
 	//pass the inverse projection of the camera to reconstruct world pos.
 	sh->setUniform("u_inverse_viewprojection", inv_vp);
-	//pass the inverse window resolution, this may be useful
-	sh->setUniform("u_iRes", Vector2(1.0 / (float)Application::instance->window_width, 1.0 / (float)Application::instance->window_height));
+	//pass the inverse resolution of the gbuffers, this may be useful
+	sh->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->width, 1.0 / (float)gbuffers_fbo->height));
 
 	//pass all the information about the light and ambient�
 	if (use_gamma_correction)
@@ -310,7 +888,10 @@ void Renderer::renderIlluminationToBuffer(Camera* camera)
 
 	sh->setUniform("u_use_ssao", use_ssao);
 	if (use_ssao)
-		sh->setTexture("u_ssao_texture", ssao_blur, 5);
+	{
+		sh->setTexture("u_ssao_texture", ssao_fbo->color_textures[0], 5);
+		sh->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+	}
 
 	// irradiance uniforms
 	SetIrradianceUniforms(sh, scene);
@@ -333,6 +914,8 @@ void Renderer::renderIlluminationToBuffer(Camera* camera)
 		}
 		else
 			shader = chooseShader(light);	//this sets light uniforms too
+		if (!shader)
+			continue;
 
 		//pass the gbuffers to the shader
 		shader->setTexture("u_color_texture", gbuffers_fbo->color_textures[0], 0);
@@ -340,13 +923,13 @@ void Renderer::renderIlluminationToBuffer(Camera* camera)
 		shader->setTexture("u_extra_texture", gbuffers_fbo->color_textures[2], 2);
 		shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 3);
 
-		Matrix44 inv_vp_mp = camera->viewprojection_matrix;
+		Matrix44 inv_vp_mp = screen_viewprojection;
 		inv_vp_mp.inverse();
 
 		//pass the inverse projection of the camera to reconstruct world pos.
 		shader->setUniform("u_inverse_viewprojection", inv_vp_mp);
-		//pass the inverse window resolution, this may be useful
-		shader->setUniform("u_iRes", Vector2(1.0 / (float)Application::instance->window_width, 1.0 / (float)Application::instance->window_height));
+		//pass the inverse resolution of the gbuffers, this may be useful
+		shader->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->width, 1.0 / (float)gbuffers_fbo->height));
 		shader->setUniform("u_camera_pos", camera->eye);
 
 		if (use_geometry_on_deferred && light->light_type != GTR::DIRECTIONAL)
@@ -398,90 +981,90 @@ void Renderer::renderIlluminationToBuffer(Camera* camera)
 
 		shader->disable();
 	}
+}
 
-	
+void Renderer::renderVolumetricsToBuffer(Camera* camera)
+{
 	// RENDER VOLUME SCATTERING
-	if (use_volumetric)
-	{
-		glDisable(GL_BLEND);
+	glDisable(GL_BLEND);
 
-		Texture* noise = Texture::Get("data/textures/noise.png");
-		noise->bind();
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		noise->unbind();
+	Mesh* quad = Mesh::getQuad();
+	Matrix44 inv_vp = screen_viewprojection;
+	inv_vp.inverse();
 
-		volumetrics_fbo->bind();
-		Shader* sh = Shader::Get("volumetric");
-		sh->enable();
-		
-		Matrix44 m;
-		sh->setUniform("u_model", m);
-		sh->setUniform("u_camera_position", camera->eye);
-		sh->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	Texture* noise = Texture::Get("data/textures/noise.png");
+	noise->bind();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	noise->unbind();
 
-		sh->setUniform("u_quality", u_quality);
-		sh->setUniform("u_air_density", u_air_density);
-		sh->setUniform("u_clamp", u_clamp);
-		sh->setTexture("u_noise_tex", noise, 2);
-		sh->setUniform("u_random", vec3(random(), random(), random()));
+	volumetrics_fbo->bind();
+	Shader* sh = Shader::Get("volumetric");
+	sh->enable();
+	
+	Matrix44 m;
+	sh->setUniform("u_model", m);
+	sh->setUniform("u_camera_position", camera->eye);
+	sh->setUniform("u_viewprojection", camera->viewprojection_matrix);
 
-		//pass the inverse projection of the camera to reconstruct world pos.
-		sh->setUniform("u_inverse_viewprojection", inv_vp);
-		sh->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 1);
-		sh->setUniform("u_iRes", Vector2(1.0 / volumetrics_fbo->width, 1.0 / volumetrics_fbo->height));
-
-		//init arrays
-		const int num_lights = 3;			//modify here (and the #define of the shader)
-		Vector3 light_pos[num_lights];
-		Vector3 light_color[num_lights];
-		float max_dist[num_lights];
-		float light_intensity[num_lights];
-		int light_type[num_lights];
-		float spot_cutoff[num_lights];
-		float spot_exp[num_lights];
-		Vector3 light_dir[num_lights];
-		Matrix44 vpm_light_cam[num_lights];
-		float shadow_bias[num_lights];
-
-		//fill arrays
-		std::vector<Light*> lights = Scene::instance->lights;
-		for (int i = 0; i < num_lights; i++)
-		{
-			light_pos[i] = lights[i]->model.getTranslation();
-			light_color[i] = gamma(lights[i]->color);
-			max_dist[i] = lights[i]->max_distance;
-			light_intensity[i] = lights[i]->intensity / 10.0f;
-			light_type[i] = lights[i]->light_type;
-			spot_cutoff[i] = cosf(lights[i]->spot_cutoff_in_deg * DEG2RAD);
-			spot_exp[i] = lights[i]->spot_exponent;
-			light_dir[i] = lights[i]->model.frontVector();
-			shadow_bias[i] = lights[i]->shadow_bias;
-			vpm_light_cam[i] = lights[i]->camera->viewprojection_matrix;
-		}
+	sh->setUniform("u_quality", u_quality);
+	sh->setUniform("u_air_density", u_air_density);
+	sh->setUniform("u_clamp", u_clamp);
+	sh->setTexture("u_noise_tex", noise, 2);
+	sh->setUniform("u_random", vec3(random(), random(), random()));
 
-		//send to shader
-		sh->setUniform3Array("u_light_position", (float*)light_pos, num_lights);
-		sh->setUniform3Array("u_light_color", (float*)light_color, num_lights);
-		sh->setUniform1Array("u_light_maxdist", (float*)max_dist, num_lights);
-		sh->setUniform1Array("u_light_intensity", (float*)light_intensity, num_lights);
-		sh->setUniform1Array("u_light_type", (int*)light_type, num_lights);
-		sh->setUniform1Array("u_light_spotCosineCutoff", (float*)spot_cutoff, num_lights);
-		sh->setUniform1Array("u_light_spotExponent", (float*)spot_exp, num_lights);
-		sh->setUniform3Array("u_light_direction", (float*)light_dir, num_lights);
-		sh->setUniform1Array("u_shadow_bias", (float*)shadow_bias, num_lights);
-		sh->setMatrix44Array("u_shadow_viewproj", vpm_light_cam, num_lights);
-		sh->setTexture("u_shadowmap1", lights[0]->shadow_fbo->depth_texture, 4);
-		sh->setTexture("u_shadowmap2", lights[1]->shadow_fbo->depth_texture, 5);
-		sh->setTexture("u_shadowmap3", lights[2]->shadow_fbo->depth_texture, 6);
+	//pass the inverse projection of the camera to reconstruct world pos.
+	sh->setUniform("u_inverse_viewprojection", inv_vp);
+	sh->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 1);
+	sh->setUniform("u_iRes", Vector2(1.0 / volumetrics_fbo->width, 1.0 / volumetrics_fbo->height));
+
+	//init arrays
+	const int num_lights = 3;			//modify here (and the #define of the shader)
+	Vector3 light_pos[num_lights];
+	Vector3 light_color[num_lights];
+	float max_dist[num_lights];
+	float light_intensity[num_lights];
+	int light_type[num_lights];
+	float spot_cutoff[num_lights];
+	float spot_exp[num_lights];
+	Vector3 light_dir[num_lights];
+	Matrix44 vpm_light_cam[num_lights];
+	float shadow_bias[num_lights];
+
+	//fill arrays
+	std::vector<Light*> lights = Scene::instance->lights;
+	for (int i = 0; i < num_lights; i++)
+	{
+		light_pos[i] = lights[i]->model.getTranslation();
+		light_color[i] = gamma(lights[i]->color);
+		max_dist[i] = lights[i]->max_distance;
+		light_intensity[i] = lights[i]->intensity / 10.0f;
+		light_type[i] = lights[i]->light_type;
+		spot_cutoff[i] = cosf(lights[i]->spot_cutoff_in_deg * DEG2RAD);
+		spot_exp[i] = lights[i]->spot_exponent;
+		light_dir[i] = lights[i]->model.frontVector();
+		shadow_bias[i] = lights[i]->shadow_bias;
+		vpm_light_cam[i] = lights[i]->camera->viewprojection_matrix;
+	}
 
-		quad->render(GL_TRIANGLES);
-		sh->disable();
-		volumetrics_fbo->unbind(); 
+	//send to shader
+	sh->setUniform3Array("u_light_position", (float*)light_pos, num_lights);
+	sh->setUniform3Array("u_light_color", (float*)light_color, num_lights);
+	sh->setUniform1Array("u_light_maxdist", (float*)max_dist, num_lights);
+	sh->setUniform1Array("u_light_intensity", (float*)light_intensity, num_lights);
+	sh->setUniform1Array("u_light_type", (int*)light_type, num_lights);
+	sh->setUniform1Array("u_light_spotCosineCutoff", (float*)spot_cutoff, num_lights);
+	sh->setUniform1Array("u_light_spotExponent", (float*)spot_exp, num_lights);
+	sh->setUniform3Array("u_light_direction", (float*)light_dir, num_lights);
+	sh->setUniform1Array("u_shadow_bias", (float*)shadow_bias, num_lights);
+	sh->setMatrix44Array("u_shadow_viewproj", vpm_light_cam, num_lights);
+	sh->setTexture("u_shadowmap1", lights[0]->shadow_fbo->depth_texture, 4);
+	sh->setTexture("u_shadowmap2", lights[1]->shadow_fbo->depth_texture, 5);
+	sh->setTexture("u_shadowmap3", lights[2]->shadow_fbo->depth_texture, 6);
 
-		illumination_fbo->bind();
-		glDisable(GL_BLEND);
-	}
+	quad->render(GL_TRIANGLES);
+	sh->disable();
+	volumetrics_fbo->unbind(); 
 }
 
 void GTR::Renderer::renderReflectionsToBuffer(Camera* camera)
@@ -502,19 +1085,26 @@ void GTR::Renderer::renderReflectionsToBuffer(Camera* camera)
 
 	shader->setTexture("u_color_texture", gbuffers_fbo->color_textures[0], 0);
 	shader->setTexture("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
-	shader->setTexture("u_extra_texture", gbuffers_fbo->color_textures[2], 2);
+	shader->setTexture("u_emissive_texture", gbuffers_fbo->color_textures[2], 2);
 	shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 3);
 
-	Matrix44 inv_vp_mp = camera->viewprojection_matrix;
+	Matrix44 inv_vp_mp = screen_viewprojection;
 	inv_vp_mp.inverse();
 
 	//pass the inverse projection of the camera to reconstruct world pos.
 	shader->setUniform("u_inverse_viewprojection", inv_vp_mp);
-	//pass the inverse window resolution, this may be useful
-	shader->setUniform("u_iRes", Vector2(1.0 / (float)Application::instance->window_width, 1.0 / (float)Application::instance->window_height));
+	//pass the inverse resolution of the gbuffers, this may be useful
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->width, 1.0 / (float)gbuffers_fbo->height));
 
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	shader->setUniform("u_viewprojection", screen_viewprojection);
 	shader->setUniform("u_camera_position", camera->eye);
+
+	//split sum: prefiltered probes + the integrated BRDF
+	shader->setTexture("u_brdf_lut", Texture::Get("data/textures/brdfLUT.png", false, false), 14);
+	shader->setUniform("u_max_lod", (float)(NUM_REFLECTION_MIPS - 1));
+	shader->setUniform("u_use_ssr", use_ssr && ssr_fbo != NULL);
+	if (use_ssr && ssr_fbo)
+		shader->setTexture("u_ssr_texture", ssr_fbo->color_textures[0], 15);
 	Vector3 positions[10];
 	
 	for (int i = 0; i < 10; i++)
@@ -545,6 +1135,45 @@ void GTR::Renderer::renderReflectionsToBuffer(Camera* camera)
 
 }
 
+//half resolution reflections traced in screen space over the hierarchical depth, with more rays (GGX lobe) for the
+//rougher surfaces. The alpha keeps how many rays hit, the reflections pass uses the probes for the rest
+void Renderer::renderSSR(Camera* camera)
+{
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+
+	Matrix44 inv_vp = screen_viewprojection;
+	inv_vp.inverse();
+
+	Shader* shader = Shader::Get("ssr");
+	shader->enable();
+	shader->setTexture("u_color_texture", gbuffers_fbo->color_textures[0], 0);
+	shader->setTexture("u_normal_texture", gbuffers_fbo->color_textures[1], 1);
+	shader->setTexture("u_emissive_texture", gbuffers_fbo->color_textures[2], 2);
+	shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 3);
+	shader->setTexture("u_hiz_texture", hiz.texture, 4);
+	shader->setTexture("u_scene_texture", illumination_fbo->color_textures[0], 5);
+	shader->setUniform("u_hiz_levels", hiz.num_levels);
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_viewprojection", screen_viewprojection);
+	//the half resolution target, the uvs are the same as in the gbuffers
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)ssr_fbo->width, 1.0 / (float)ssr_fbo->height));
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+	shader->setUniform("u_screen_scale", viewportScale(gbuffers_fbo->width, gbuffers_fbo->height, render_scale));
+	shader->setUniform("u_max_rays", ssr_max_rays);
+	shader->setUniform("u_max_roughness", ssr_max_roughness);
+	shader->setUniform("u_max_distance", ssr_max_distance);
+	shader->setUniform("u_thickness", ssr_thickness);
+	shader->setUniform("u_max_steps", ssr_max_steps);
+	shader->setUniform("u_frame_angle", (float)(Application::instance->frame % 1024) * 2.39996f);
+
+	ssr_fbo->bind();
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	ssr_fbo->unbind();
+	shader->disable();
+}
+
 void Renderer::showGBuffers()
 {
 	Application* application = Application::instance;
@@ -561,7 +1190,7 @@ void Renderer::showGBuffers()
 		gbuffers_fbo->color_textures[0]->toViewport();
 
 	glViewport(window_width * 0.5, window_height * 0.5, window_width * 0.5, window_height * 0.5);
-	gbuffers_fbo->color_textures[1]->toViewport();
+	gbuffers_fbo->color_textures[1]->toViewport(Shader::Get("showNormals"));
 
 	glViewport(0, 0, window_width * 0.5, window_height * 0.5);
 	gbuffers_fbo->color_textures[2]->toViewport();
@@ -577,13 +1206,14 @@ void Renderer::showSSAO()
 {
 	Application* application = Application::instance;
 	glViewport(0, 0, application->window_width, application->window_height);
-	ssao_blur->toViewport();
+	ssao_fbo->color_textures[0]->toViewport(Shader::Get("ssaoShow"));
 }
 
 //FORWARD
 //render all the scene to viewport
 void Renderer::renderSceneForward(GTR::Scene* scene, Camera* camera)
 {
+	TRACE_SCOPE("Renderer::renderSceneForward");
 	Application* application = Application::instance;
 	rendering_shadowmap = false;
 
@@ -609,7 +1239,7 @@ void Renderer::renderSceneForward(GTR::Scene* scene, Camera* camera)
 
 	renderScene(scene, camera);
 
-	if (application->render_grid)
+	if (application->render_grid && !rendering_layers)
 		drawGrid();
 }
 
@@ -648,6 +1278,7 @@ void Renderer::manageBlendingAndCulling(GTR::Material* material, bool rendering_
 
 std::vector<Light*> Renderer::renderSceneShadowmaps(GTR::Scene* scene)
 {
+	TRACE_SCOPE("Renderer::renderSceneShadowmaps");
 	rendering_shadowmap = true;
 
 	std::vector<Light*> shadow_casting_lights;
@@ -714,27 +1345,85 @@ void Renderer::renderPointShadowmap(Light* light)
 	glViewport(0, 0, Application::instance->window_width, Application::instance->window_height);
 }
 
-//render all the scene
-void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
+//mesh that may be rasterized as occluder
+struct sOccluder {
+	Matrix44 model;
+	Mesh* mesh;
+	float size;			//radius / distance
+};
+
+static void collectOccluders(const Matrix44& prefab_model, GTR::Node* node, Camera* camera, float min_size, std::vector<sOccluder>& occluders)
 {
-	for (auto prefabEnt : scene->prefabs)
+	if (!node->visible)
+		return;
+
+	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	if (node->mesh && node->material && node->material->alpha_mode != GTR::BLEND)
 	{
-		if (prefabEnt->visible) {
+		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
+		float distance = std::max(camera->near_plane, (float)(world_bounding.center - camera->eye).length());
+		float size = world_bounding.halfsize.length() / distance;
+		if (size >= min_size && camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
+			occluders.push_back({ node_model, node->mesh, size });
+	}
 
-			//If we are far enough, we can save time by lowering the number of trinagles of the mesh
-			Vector3 aux = (prefabEnt->model.getTranslation() - Application::instance->camera->eye);
-			float dist = aux.length();
+	for (int i = 0; i < node->children.size(); ++i)
+		collectOccluders(prefab_model, node->children[i], camera, min_size, occluders);
+}
 
-			if (dist > 1000 && prefabEnt->lowres_prefab)
-				renderPrefab(prefabEnt->model, prefabEnt->lowres_prefab, camera);
-			else
-				renderPrefab(prefabEnt->model, prefabEnt->prefab, camera);
+//the nodes hidden behind the depth of the previous frame (Hi-Z) or behind the biggest meshes on screen (software
+//occluders) are not rendered by this camera. Culled nodes are counted in Mesh::num_meshes_culled
+void Renderer::updateOcclusion(Scene* scene, Camera* camera)
+{
+	TRACE_SCOPE("Renderer::updateOcclusion");
+	occlusion_camera = camera;
+	occlusion_test = NULL;
+
+	if (occlusion_culling == OCCLUSION_HIZ)
+	{
+		//only the deferred pipeline builds the Hi-Z, an old one is not used
+		hiz_occlusion.update();
+		if (hiz_occlusion.valid && Application::instance->frame - hiz_occlusion.frame <= 2)
+			occlusion_test = &hiz_occlusion;
+	}
+	else if (occlusion_culling == OCCLUSION_SOFTWARE)
+	{
+		PROFILE_SCOPE("Software occluders");
+		std::vector<sOccluder> occluders;
+		for (auto prefabEnt : scene->prefabs)
+			if (prefabEnt->visible)
+			{
+				collectOccluders(prefabEnt->model, &choosePrefab(prefabEnt, camera)->root, camera, min_occluder_size, occluders);
+			}
+		std::sort(occluders.begin(), occluders.end(), [](const sOccluder& a, const sOccluder& b) { return a.size > b.size; });
+
+		software_occlusion.begin(camera->viewprojection_matrix, OCCLUSION_SOFTWARE_WIDTH, std::max(1, (int)(OCCLUSION_SOFTWARE_WIDTH / camera->aspect)));
+		for (sOccluder& occluder : occluders)
+		{
+			if (software_occlusion.num_triangles >= max_occluder_triangles)
+				break;
+			software_occlusion.rasterize(occluder.model, occluder.mesh);
 		}
+		software_occlusion.end();
+		occlusion_test = &software_occlusion;
+	}
+}
+
+//render all the scene
+void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
+{
+	TRACE_SCOPE("Renderer::renderScene");
+	lod_screen_scale = computeLODScreenScale(camera);
+
+	for (auto prefabEnt : scene->prefabs)
+	{
+		if (prefabEnt->visible)
+			renderPrefab(prefabEnt->model, choosePrefab(prefabEnt, camera), camera);
 	}
 
 	if (rendering_shadowmap) return;
 
-	if (show_light_meshes)
+	if (show_light_meshes && !rendering_layers)
 		for (auto light : scene->lights)
 		{
 			if (light->visible && light->light_type != DIRECTIONAL)
@@ -765,10 +1454,17 @@ void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera*
 		BoundingBox world_bounding = transformBoundingBox(node_model,node->mesh->box);
 		
 		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize) )
+		//(the layers see all around the camera, only the far plane is left)
+		bool visible = rendering_layers ? (world_bounding.center - camera->eye).length() - world_bounding.halfsize.length() < camera->far_plane : camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize);
+		if (visible)
 		{
-			//render node mesh
-			renderMeshWithMaterial( node_model, node->mesh, node->material, camera );
+			//unless it is hidden behind the occluders of the camera
+			if (camera == occlusion_camera && occlusion_test && !rendering_shadowmap && occlusion_test->isOccluded(world_bounding))
+				Mesh::num_meshes_culled++;
+			else if (use_lods && node->mesh->lods.size())
+				renderNodeLODs(prefab_model, node, node_model, world_bounding, camera);
+			else
+				renderMeshWithMaterial( node_model, node->mesh, node->material, camera );
 			//node->mesh->renderBounding(node_model, true);
 		}
 	}
@@ -778,6 +1474,99 @@ void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera*
 		renderNode(prefab_model, node->children[i], camera);
 }
 
+//the prefab is chosen by the camera that renders it (the lowres one for the far entities), the meshes of the prefab
+//have their own levels of detail
+GTR::Prefab* Renderer::choosePrefab(PrefabEntity* entity, Camera* camera)
+{
+	float distance = (entity->model.getTranslation() - camera->eye).length();
+	return distance > LOWRES_PREFAB_DISTANCE && entity->lowres_prefab ? entity->lowres_prefab : entity->prefab;
+}
+
+//pixels of the viewport covered by a unit at distance 1 (perspective) or anywhere (orthographic)
+float Renderer::computeLODScreenScale(Camera* camera)
+{
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	if (camera->type == Camera::ORTHOGRAPHIC)
+		return viewport[3] / std::max(0.0001f, (float)fabs(camera->top - camera->bottom));
+	return viewport[3] / (2.0f * (float)tan(camera->fov * 0.5f * DEG2RAD));
+}
+
+//the coarsest level whose error is under lod_max_error pixels. Going coarser than the current level needs the
+//error to be under the hysteresis too, so a mesh at the limit does not change every frame
+int Renderer::chooseLOD(Mesh* mesh, float pixels_per_unit, int current_level)
+{
+	int level = 0;
+	while (level < (int)mesh->lods.size())
+	{
+		float max_error = level + 1 > current_level ? lod_max_error * (1.0f - lod_hysteresis) : lod_max_error;
+		if (mesh->getLODError(level + 1) * pixels_per_unit > max_error)
+			break;
+		level++;
+	}
+	return level;
+}
+
+//the main camera keeps the level of every node between frames and fades the changes with a dither (both levels
+//render the pixels the other one discards). Other cameras (shadowmaps, probes) choose the level every time
+void Renderer::renderNodeLODs(const Matrix44& prefab_model, GTR::Node* node, Matrix44& node_model, const BoundingBox& world_bounding, Camera* camera)
+{
+	Mesh* mesh = node->mesh;
+	float scale = std::max(node_model.rightVector().length(), std::max(node_model.topVector().length(), node_model.frontVector().length()));
+	float pixels_per_unit = scale * lod_screen_scale;
+	if (camera->type == Camera::PERSPECTIVE)
+	{
+		float distance = (world_bounding.center - camera->eye).length() - world_bounding.halfsize.length();
+		pixels_per_unit /= std::max(distance, camera->near_plane);
+	}
+
+	Application* application = Application::instance;
+	if (camera != application->camera || rendering_shadowmap)
+	{
+		renderMeshWithMaterial(node_model, mesh->getLOD(chooseLOD(mesh, pixels_per_unit, mesh->lods.size())), node->material, camera);
+		return;
+	}
+
+	//a node that was not visible the last frame starts without fading
+	sLODState& state = lod_states[std::make_pair(&prefab_model, node)];
+	if (state.frame < application->frame - 1 || state.frame == 0)
+	{
+		state.level = chooseLOD(mesh, pixels_per_unit, mesh->lods.size());
+		state.previous_level = -1;
+		state.fade = 1.0f;
+	}
+	else if (state.frame != application->frame) //once per frame, the node can be rendered by several passes
+	{
+		int level = chooseLOD(mesh, pixels_per_unit, state.level);
+		if (level != state.level)
+		{
+			state.previous_level = use_lod_cross_fade && lod_fade_time > 0.0f ? state.level : -1;
+			state.level = level;
+			state.fade = 0.0f;
+		}
+		else if (state.previous_level != -1)
+		{
+			state.fade += application->elapsed_time / lod_fade_time;
+			if (state.fade >= 1.0f || !use_lod_cross_fade)
+				state.previous_level = -1;
+		}
+	}
+	state.frame = application->frame;
+
+	if (state.previous_level == -1)
+	{
+		renderMeshWithMaterial(node_model, mesh->getLOD(state.level), node->material, camera);
+		return;
+	}
+
+	float fade = clamp(state.fade, 0.001f, 0.999f);
+	lod_fade = fade;
+	renderMeshWithMaterial(node_model, mesh->getLOD(state.level), node->material, camera);
+	lod_fade = -fade;
+	renderMeshWithMaterial(node_model, mesh->getLOD(state.previous_level), node->material, camera);
+	lod_fade = 0.0f;
+}
+
 //renders a mesh given its transform and material
 void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
 {
@@ -814,15 +1603,19 @@ void Renderer::renderWithoutLights(const Matrix44 model, Mesh* mesh, GTR::Materi
 {
 	manageBlendingAndCulling(material, false);
 
-	Shader* shader = Shader::Get("noLights");
+	Shader* shader = no_lights_shaders->get(rendering_layers ? SHADER_LAYERED : 0);
 	
 	//no shader? then nothing to render
+	if (!shader)
+		return;
 	enableShader(shader);
 
 	//upload uniforms
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	setLayerUniforms(shader);
 	shader->setUniform("u_camera_position", camera->eye);
 	shader->setUniform("u_model", model);
+	shader->setUniform("u_lod_fade", lod_fade);
 
 	if (use_gamma_correction)
 		shader->setUniform("u_ambient_light", gamma(GTR::Scene::instance->ambient_light) * GTR::Scene::instance->ambient_power);
@@ -858,10 +1651,14 @@ void Renderer::renderMultiPass(const Matrix44 model, Mesh* mesh, GTR::Material*
 		manageBlendingAndCulling(material, true, is_first_pass);
 
 		Shader* shader = chooseShader(light);
+		if (!shader)
+			continue;
 
 		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+		setLayerUniforms(shader);
 		shader->setUniform("u_camera_pos", camera->eye);
 		shader->setUniform("u_model", model);
+		shader->setUniform("u_lod_fade", lod_fade);
 
 		if (use_gamma_correction)
 			shader->setUniform("u_ambient_light", gamma(Scene::instance->ambient_light) * GTR::Scene::instance->ambient_power * is_first_pass);
@@ -877,13 +1674,13 @@ void Renderer::renderMultiPass(const Matrix44 model, Mesh* mesh, GTR::Material*
 
 			shader->setTexture("u_depth_texture", gbuffers_fbo->depth_texture, 9);
 
-			Matrix44 inv_vp = camera->viewprojection_matrix;
+			Matrix44 inv_vp = screen_viewprojection;
 			inv_vp.inverse();
 
 			//pass the inverse projection of the camera to reconstruct world pos.
 			shader->setUniform("u_inverse_viewprojection", inv_vp);
-			//pass the inverse window resolution, this may be useful
-			shader->setUniform("u_iRes", Vector2(1.0 / (float)Application::instance->window_width, 1.0 / (float)Application::instance->window_height));
+			//pass the inverse resolution of the gbuffers, this may be useful
+			shader->setUniform("u_iRes", Vector2(1.0 / (float)gbuffers_fbo->width, 1.0 / (float)gbuffers_fbo->height));
 		}
 		else
 			material->setUniforms(shader, is_first_pass);
@@ -899,77 +1696,33 @@ Shader* Renderer::chooseShader(Light* light)
 {
 	Shader* shader;
 	bool use_deferred = Application::instance->current_pipeline == Application::DEFERRED;
-	Scene* scene = Scene::instance;
 
+	//the variant is found by the keywords of the light and the pipeline
+	int keywords = 0;
 	if (light->cast_shadows)
-	{
-		if (AA_shadows)
-		{
-			if (use_deferred) // the second condition take in consideration blend materials
-			{
-				if (forward_for_blends)
-					shader = Shader::Get("deferredBlendAAShadows");
-				else if (use_geometry_on_deferred)
-				{
-					if (show_deferred_light_geometry)
-						shader = Shader::Get("flat");
-					else
-						shader = Shader::Get("deferredLightAAShadowsGeometry");
-				}
-				else
-					shader = Shader::Get("deferredLightAAShadows");
-			}
-			else
-				shader = Shader::Get("lightAAShadows");
-		}
-		else //the shader without AA is so much simple
-		{
-			if (use_deferred)
-			{
-				if (forward_for_blends)
-					shader = Shader::Get("deferredBlendShadows");
-				else if (use_geometry_on_deferred)
-				{
-					if (show_deferred_light_geometry)
-						shader = Shader::Get("flat");
-					else
-						shader = Shader::Get("deferredLightShadowsGeometry");
-				}
-				else
-					shader = Shader::Get("deferredLightShadows");
-			}
-			else
-				shader = Shader::Get("lightShadows");
-		}
-
-		enableShader(shader);
-		light->setLightUniforms(shader);
-		light->setShadowUniforms(shader);
-	}
+		keywords |= AA_shadows ? SHADER_SHADOWS | SHADER_PCF : SHADER_SHADOWS;
+	if (Application::instance->current_illumination == Application::PBR)
+		keywords |= SHADER_PBR;
+	if (rendering_layers)
+		keywords |= SHADER_LAYERED;
+
+	if (use_deferred && forward_for_blends) //forward pass of the blend materials
+		shader = light_shaders->get(keywords | SHADER_BLEND);
+	else if (use_deferred && use_geometry_on_deferred && show_deferred_light_geometry)
+		shader = Shader::Get("flat");
+	else if (use_deferred)
+		shader = deferred_light_shaders->get(use_geometry_on_deferred ? keywords | SHADER_GEOMETRY : keywords);
 	else
-	{
-		if (use_deferred)
-		{
-			if (forward_for_blends)
-				shader = Shader::Get("deferredBlend");
-			else if (use_geometry_on_deferred)
-			{
-				if (show_deferred_light_geometry)
-					shader = Shader::Get("flat");
-				else
-					shader = Shader::Get("deferredLightGeometry");
-			}
-			else
-				shader = Shader::Get("deferredLight");
-		}
-		else
-			shader = Shader::Get("light");
-		//no shader? then nothing to render
-		enableShader(shader);
-		light->setLightUniforms(shader);
-	}
+		shader = light_shaders->get(keywords);
 
-	shader->setUniform("illumination_technique", Application::instance->current_illumination);
+	//no shader? (the variant does not compile) then nothing to render
+	if (!shader)
+		return NULL;
+
+	enableShader(shader);
+	light->setLightUniforms(shader);
+	if (light->cast_shadows)
+		light->setShadowUniforms(shader);
 	return shader;
 }
 
@@ -980,6 +1733,15 @@ void Renderer::enableShader(Shader* shader)
 	shader->enable();
 }
 
+//the cameras of the layers when rendering them at once (see layered.gs)
+void Renderer::setLayerUniforms(Shader* shader)
+{
+	if (!rendering_layers)
+		return;
+	shader->setMatrix44Array("u_layer_viewprojections", layer_viewprojections, 6);
+	shader->setUniform("u_first_layer", first_layer);
+}
+
 void Renderer::renderSimple(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
 {
 	Shader* shader = Shader::Get("flat");
@@ -1030,7 +1792,8 @@ void Renderer::showSceneShadowmaps()
 
 void Renderer::setDefaultGLFlags() 
 {
-	if (!forward_for_blends)
+	//the layers are cleared once for all the passes that render to them
+	if (!forward_for_blends && !rendering_layers)
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // Clear the color and the depth buffer
 
 	//set default flags
@@ -1040,8 +1803,10 @@ void Renderer::setDefaultGLFlags()
 	glFrontFace(GL_CCW); //instead of GL_CCW
 }
 
+//the shadowmaps must be ready before calling this (see computeAllIrradianceCoefficients)
 void Renderer::computeIrradianceCoefficients(sProbe &probe, Scene* scene)
 {
+	TRACE_SCOPE("Renderer::computeIrradianceCoefficients");
 	FloatImage images[6]; //here we will store the six views
 
 	Camera cam;
@@ -1059,24 +1824,107 @@ void Renderer::computeIrradianceCoefficients(sProbe &probe, Scene* scene)
 		cam.enable();
 
 		//render the scene from this point of view
-
-		Application::instance->current_pipeline = Application::FORWARD;
-		std::vector<GTR::Light*> shadow_caster_lights = renderSceneShadowmaps(scene);
 		irr_fbo->bind();
 		renderSceneForward(scene, &cam);
-		Application::instance->current_pipeline = Application::DEFERRED;
-
 		irr_fbo->unbind();
 
 		//read the pixels back and store in a FloatImage
 		images[i].fromTexture(irr_fbo->color_textures[0]);
 	}
-	
-	Application::instance->camera->enable();
 
 	//compute the coefficients given the six images
 	probe.sh = computeSH(images);
+}
 
+//framebuffer with the six faces of PROBE_BATCH probes, NULL if the layered rendering is not supported
+FBO* Renderer::createLayeredTarget(int size, int type)
+{
+	Shader* skybox = skybox_shaders ? skybox_shaders->get(SHADER_LAYERED) : NULL;
+	FBO* fbo = NULL;
+	if (skybox)
+	{
+		//RGB float is not required to be renderable, so RGBA
+		fbo = new FBO();
+		if (!fbo->createLayered(size, size, PROBE_BATCH * 6, GL_RGBA, type))
+		{
+			delete fbo;
+			fbo = NULL;
+		}
+	}
+	if (!fbo)
+	{
+		std::cout << " * Layered rendering not available, the probes are rendered one face at a time" << std::endl;
+		use_layered_probes = false;
+	}
+	return fbo;
+}
+
+//the six faces of every position in a single pass each, the LAYERED variants send every triangle to the layers of the
+//faces it is in (see layered.gs). The faces of the position i are the layers i*6 to i*6+5 of the framebuffer
+void Renderer::renderProbesLayered(Scene* scene, FBO* fbo, Camera* cam, std::vector<Vector3>& positions)
+{
+	assert(positions.size() <= PROBE_BATCH);
+
+	fbo->bind();
+	Vector4 bg_color = scene->bg_color;
+	glClearColor(bg_color.x, bg_color.y, bg_color.z, bg_color.w);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); //all the layers
+
+	rendering_layers = true;
+	for (int i = 0; i < positions.size(); ++i)
+	{
+		//same cameras as the faces rendered one at a time, the last one renders (only its eye is used)
+		Vector3 pos = positions[i];
+		for (int face = 0; face < 6; ++face)
+		{
+			cam->lookAt(pos, pos + cubemapFaceNormals[face][2], cubemapFaceNormals[face][1]);
+			layer_viewprojections[face] = cam->viewprojection_matrix;
+		}
+		first_layer = i * 6;
+		renderSceneForward(scene, cam);
+	}
+	rendering_layers = false;
+	fbo->unbind();
+}
+
+//all the probes of the batch rendered with renderProbesLayered and read back at once. False if it is not supported
+bool Renderer::computeIrradianceCoefficientsLayered(Scene* scene, int first_probe, int num_probes)
+{
+	TRACE_SCOPE("Renderer::computeIrradianceCoefficientsLayered");
+	assert(num_probes <= PROBE_BATCH);
+	int size = irr_fbo->width;
+
+	if (!irr_layered_fbo)
+		irr_layered_fbo = createLayeredTarget(size, GL_FLOAT);
+	if (!irr_layered_fbo)
+		return false;
+
+	Camera cam;
+	cam.setPerspective(90, 1, 0.1, 1000);
+
+	std::vector<Vector3> positions(num_probes);
+	for (int i = 0; i < num_probes; ++i)
+		positions[i] = scene->probes[first_probe + i].pos;
+	renderProbesLayered(scene, irr_layered_fbo, &cam, positions);
+
+	//read back all the layers at once
+	Texture* layers = irr_layered_fbo->color_textures[0];
+	int face_floats = size * size * 3;
+	std::vector<float> pixels(face_floats * 6 * PROBE_BATCH);
+	layers->bind();
+	glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, GL_RGB, GL_FLOAT, &pixels[0]);
+	layers->unbind();
+
+	FloatImage images[6];
+	for (int face = 0; face < 6; ++face)
+		images[face].resize(size, size, 3);
+	for (int i = 0; i < num_probes; ++i)
+	{
+		for (int face = 0; face < 6; ++face)
+			memcpy(images[face].data, &pixels[(i * 6 + face) * face_floats], face_floats * sizeof(float));
+		scene->probes[first_probe + i].sh = computeSH(images);
+	}
+	return true;
 }
 
 void Renderer::renderIrradianceProbe(Vector3 pos, float size, float* coeffs)
@@ -1142,7 +1990,9 @@ void Renderer::renderReflectionProbe(Vector3 pos, float size, Texture* cubemap)
 void Renderer::renderSkybox(Camera* camera, Texture* environment)
 {
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj");
-	Shader* shader = Shader::Get("skybox");
+	Shader* shader = skybox_shaders->get(rendering_layers ? SHADER_LAYERED : 0);
+	if (!shader)
+		return;
 	Matrix44 m;
 	m.setTranslation(camera->eye.x, camera->eye.y, camera->eye.z);
 	m.scale(10,10,10);
@@ -1155,6 +2005,7 @@ void Renderer::renderSkybox(Camera* camera, Texture* environment)
 	shader->enable();
 
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	setLayerUniforms(shader);
 	shader->setUniform("u_camera_position", camera->eye);
 	shader->setUniform("u_model", m);
 
@@ -1187,70 +2038,559 @@ Texture* GTR::CubemapFromHDRE(const char* filename)
 	return texture;
 }
 
+//compact HDR cubemap with storage for all the prefiltered levels
+Texture* GTR::createReflectionCubemap(int size)
+{
+	Texture* cubemap = new Texture();
+	//it is a render target and RGB16F is not required to be renderable, so RGBA
+	cubemap->createCubemap(size, size, NULL, GL_RGBA, GL_HALF_FLOAT, true, GL_RGBA16F);
+
+	//allocate the mips, they are filled when rendering the probe
+	cubemap->generateMipmaps();
+
+	cubemap->bind();
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, NUM_REFLECTION_MIPS - 1);
+	cubemap->unbind();
+
+	return cubemap;
+}
+
 void Renderer::computeIrradiance(Scene* scene)
 {
-	computeAllIrradianceCoefficients(scene);
+	TRACE_SCOPE("Renderer::computeIrradiance");
+	//the scene may have changed, gather the surfels again when needed
+	probe_surfels.clear();
+
+	//continue an unfinished bake if there is one, otherwise start with the direct light
+	std::vector<SphericalHarmonics> direct_sh;
+	int bounce = 1;
+	if (!loadBakeProgress(scene, direct_sh, bounce))
+	{
+		computeAllIrradianceCoefficients(scene);
+		for (sProbe& probe : scene->probes)
+			direct_sh.push_back(probe.sh);
+	}
+
+	if (bounce < irradiance_bounces)
+		computeIrradianceBounces(scene, direct_sh, bounce);
+
 	setIrradianceTexture(scene);
 	writeProbesToDisk(scene);
+
+	//the bake is finished, nothing to resume
+	remove(bake_progress_filename.c_str());
 }
 
-void Renderer::computeAllIrradianceCoefficients(Scene* scene)
+//adds indirect light to the probes: every bounce relights the surfels of the probes with the
+//irradiance of the previous bounce, so the light arriving to the probes has bounced one more time
+void Renderer::computeIrradianceBounces(Scene* scene, std::vector<SphericalHarmonics>& direct_sh, int bounce, bool save_progress)
 {
-	//now compute the coeffs for every probe
-	for (int iP = 0; iP < scene->probes.size(); ++iP)
+	int num_probes = scene->probes.size();
+	if (!num_probes)
+		return;
+	if (probe_surfels.size() != num_probes * 6 * PROBE_SURFELS_SIZE * PROBE_SURFELS_SIZE)
+		gatherProbeSurfels(scene);
+
+	int size = PROBE_SURFELS_SIZE;
+	int face_texels = size * size;
+	long start_time = getTime();
+
+	FloatImage images[6];
+	for (int i = 0; i < 6; ++i)
+		images[i].resize(size, size, 3);
+
+	std::vector<SphericalHarmonics> previous_sh(num_probes);
+
+	for (; bounce < irradiance_bounces; ++bounce)
 	{
-		int probe_index = iP;
-		computeIrradianceCoefficients(scene->probes[probe_index], Scene::instance);
+		long bounce_time = getTime();
+		for (int iP = 0; iP < num_probes; ++iP)
+			previous_sh[iP] = scene->probes[iP].sh;
+
+		float max_change = 0.0f;
+		float max_value = 0.0f;
+
+		for (int iP = 0; iP < num_probes; ++iP)
+		{
+			for (int i = 0; i < 6; ++i)
+			{
+				sProbeSurfel* surfels = &probe_surfels[(iP * 6 + i) * face_texels];
+				for (int index = 0; index < face_texels; ++index)
+				{
+					sProbeSurfel& surfel = surfels[index];
+					Vector3 color;
+					//the sky is already in the direct light, the surfaces reflect the irradiance of the previous bounce (lambert)
+					if (!surfel.sky)
+						color = surfel.albedo * getProbesIrradiance(previous_sh, surfel.pos, surfel.normal) * (1.0f / PI);
+					images[i].setPixel(index % size, index / size, Vector4(color, 1.0f));
+				}
+			}
+
+			//SH are linear, so the indirect light can be projected on its own and added to the direct one
+			SphericalHarmonics indirect = computeSH(images);
+			SphericalHarmonics& sh = scene->probes[iP].sh;
+			for (int c = 0; c < 9; ++c)
+			{
+				Vector3 value = direct_sh[iP].coeffs[c] + indirect.coeffs[c];
+				Vector3 diff = value - sh.coeffs[c];
+				max_change = std::max(max_change, std::max(fabsf(diff.x), std::max(fabsf(diff.y), fabsf(diff.z))));
+				max_value = std::max(max_value, std::max(fabsf(value.x), std::max(fabsf(value.y), fabsf(value.z))));
+				sh.coeffs[c] = value;
+			}
+		}
+
+		//store the progress so a long bake can be resumed
+		if (save_progress)
+			writeBakeProgress(scene, direct_sh, bounce + 1);
+
+		float change = max_value > 0.0f ? max_change / max_value : 0.0f;
+		std::cout << " + Irradiance bounce " << bounce + 1 << "/" << irradiance_bounces << ": change " << change * 100.0f << "% in " << (getTime() - bounce_time) << "ms" << std::endl;
+
+		if (change < bounce_threshold)
+		{
+			std::cout << " + Irradiance converged after " << bounce + 1 << " bounces" << std::endl;
+			break;
+		}
+	}
+
+	std::cout << " + Irradiance bounces computed in " << (getTime() - start_time) * 0.001 << "sec" << std::endl;
+}
+
+//CPU version of getIrradiance in the deferred shader (always interpolated)
+Vector3 Renderer::getProbesIrradiance(std::vector<SphericalHarmonics>& probes_sh, Vector3 pos, Vector3 normal)
+{
+	Vector3 irr_range = end_pos_grid - start_pos_grid;
+	Vector3 grid_pos = pos - start_pos_grid;
+	if (grid_pos.x < 0 || grid_pos.y < 0 || grid_pos.z < 0
+		|| grid_pos.x > irr_range.x || grid_pos.y > irr_range.y || grid_pos.z > irr_range.z)
+		return Vector3();
+
+	Vector3 local_pos = grid_pos + normal * irr_normal_distance * delta_grid;
+	Vector3 norm_pos(clamp(local_pos.x, 0.0f, irr_range.x) / delta_grid.x,
+		clamp(local_pos.y, 0.0f, irr_range.y) / delta_grid.y,
+		clamp(local_pos.z, 0.0f, irr_range.z) / delta_grid.z);
+
+	int dims_x = dim_grid.x;
+	int dims_y = dim_grid.y;
+	int dims_z = dim_grid.z;
+	int x0 = std::min((int)norm_pos.x, dims_x - 1);
+	int y0 = std::min((int)norm_pos.y, dims_y - 1);
+	int z0 = std::min((int)norm_pos.z, dims_z - 1);
+	Vector3 f(norm_pos.x - x0, norm_pos.y - y0, norm_pos.z - z0);
+
+	//trilinear interpolation of the 8 closest probes
+	SphericalHarmonics sh;
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		int dx = corner & 1, dy = (corner >> 1) & 1, dz = (corner >> 2) & 1;
+		int x = std::min(x0 + dx, dims_x - 1);
+		int y = std::min(y0 + dy, dims_y - 1);
+		int z = std::min(z0 + dz, dims_z - 1);
+		float weight = (dx ? f.x : 1.0f - f.x) * (dy ? f.y : 1.0f - f.y) * (dz ? f.z : 1.0f - f.z);
+		SphericalHarmonics& probe_sh = probes_sh[x + y * dims_x + z * dims_x * dims_y];
+		for (int c = 0; c < 9; ++c)
+			sh.coeffs[c] += probe_sh.coeffs[c] * weight;
 	}
+
+	return computeSHIrradiance(sh, normal);
+}
+
+void Renderer::computeAllIrradianceCoefficients(Scene* scene)
+{
+	long start_time = getTime();
+
+	//the lights do not move during the bake, so the shadowmaps are rendered once for all the probes
+	Application::instance->current_pipeline = Application::FORWARD;
+	renderSceneShadowmaps(scene);
+
+	//now compute the coeffs for every probe, PROBE_BATCH at a time if the layered rendering is supported
+	int iP = 0;
+	for (; use_layered_probes && iP < scene->probes.size(); iP += PROBE_BATCH)
+		if (!computeIrradianceCoefficientsLayered(scene, iP, std::min(PROBE_BATCH, (int)scene->probes.size() - iP)))
+			break;
+
+	//otherwise one face at a time
+	for (; iP < scene->probes.size(); ++iP)
+		computeIrradianceCoefficients(scene->probes[iP], scene);
+
+	Application::instance->current_pipeline = Application::DEFERRED;
+	Application::instance->camera->enable();
+
+	std::cout << " + Irradiance baked: " << scene->probes.size() << " probes in " << (getTime() - start_time) * 0.001 << "sec" << std::endl;
 }
 
 void Renderer::setIrradianceTexture(Scene* scene)
 {
-	//create the texture to store the probes (do this ONCE!!!)
-	probes_texture = new Texture(
-		9, //9 coefficients per probe
-		scene->probes.size(), //as many rows as probes
-		GL_RGB, //3 channels per coefficient
-		GL_FLOAT); //they require a high range
+	int num_probes = scene->probes.size();
+	if (!num_probes)
+		return;
 
-		//we must create the color information for the texture. because every SH are 27 floats in the RGB,RGB,... order, we can create an array of SphericalHarmonics and use it as pixels of the texture
-	SphericalHarmonics* sh_data = NULL;
-	sh_data = new SphericalHarmonics[dim_grid.x * dim_grid.y * dim_grid.z];
+	//we must create the color information for the texture. because every SH are 27 floats in the RGB,RGB,... order, we can create an array of SphericalHarmonics and use it as pixels of the texture
+	SphericalHarmonics* sh_data = new SphericalHarmonics[num_probes];
 
 	//here we fill the data of the array with our probes in x,y,z order...
-	for (int i = 0; i < scene->probes.size(); i++)
-	{
+	for (int i = 0; i < num_probes; i++)
 		sh_data[i] = scene->probes[i].sh;
-	}
 
-	//now upload the data to the GPU
-	probes_texture->upload(GL_RGB, GL_FLOAT, false, (uint8*)sh_data);
+	//create the texture to store the probes (only once, later we just upload)
+	//9 coefficients per probe, as many rows as probes, 3 channels per coefficient (they require a high range)
+	//it is only used to display the coefficients, the deferred pass reads the 3D textures
+	if (!probes_texture)
+		probes_texture = new Texture();
+	probes_texture->create(9, num_probes, GL_RGB, GL_FLOAT, false, (uint8*)sh_data);
 
 	//disable any texture filtering when reading
 	probes_texture->bind();
-	glClear(GL_COLOR_BUFFER_BIT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	probes_texture->unbind();
+
+	//the probes are stored in x,y,z order, which is the same layout a 3D texture uses,
+	//so we split the 27 floats of every SH in groups of 4 and store every group in a RGBA 3D texture.
+	//this way the hardware does the trilinear interpolation between the 8 closest probes
+	int dims_x = dim_grid.x;
+	int dims_y = dim_grid.y;
+	int dims_z = dim_grid.z;
+	assert(dims_x * dims_y * dims_z == num_probes);
+
+	float* sh_floats = (float*)sh_data;
+	float* volume_data = new float[num_probes * 4];
+
+	for (int v = 0; v < NUM_PROBE_VOLUMES; v++)
+	{
+		for (int i = 0; i < num_probes; i++)
+			for (int c = 0; c < 4; c++)
+			{
+				int coeff = v * 4 + c;
+				volume_data[i * 4 + c] = coeff < 27 ? sh_floats[i * 27 + coeff] : 0.0f;
+			}
+
+		if (!probes_volumes[v])
+			probes_volumes[v] = new Texture();
+		//half float is enough precision for the irradiance and halves the memory
+		probes_volumes[v]->create3D(dims_x, dims_y, dims_z, GL_RGBA, GL_FLOAT, false, (Uint8*)volume_data, GL_RGBA16F);
+	}
 
 	//always free memory after allocating it!!!
+	delete[] volume_data;
 	delete[] sh_data;
-
 }
 
 void Renderer::SetIrradianceUniforms(Shader* shader, Scene* scene)
 {
+	//sampler arrays must be indexed with constants, so we keep the names here
+	static const char* volume_names[NUM_PROBE_VOLUMES] = { "u_probes_volume[0]", "u_probes_volume[1]", "u_probes_volume[2]",
+		"u_probes_volume[3]", "u_probes_volume[4]", "u_probes_volume[5]", "u_probes_volume[6]" };
+
 	shader->setUniform("u_irr_start", start_pos_grid);
 	shader->setUniform("u_irr_end", end_pos_grid);
 	shader->setUniform("u_irr_normal_distance", irr_normal_distance);
 	shader->setUniform("u_irr_delta", delta_grid);
 	shader->setUniform("u_irr_dims", dim_grid);
-	shader->setUniform("u_num_probes", (int)scene->probes.size());
-	shader->setUniform("u_use_irradiance", use_irradiance);
+	shader->setUniform("u_use_irradiance", use_irradiance && probes_volumes[0] != NULL);
 	shader->setUniform("u_interpolate_probes", interpolate_probes);
-	shader->setTexture("u_probes_texture", probes_texture, 9);
+	for (int i = 0; i < NUM_PROBE_VOLUMES; i++)
+		if (probes_volumes[i])
+			shader->setTexture(volume_names[i], probes_volumes[i], 6 + i);
 	shader->setUniform("u_irradiance_weight", irradiance_weight);
 }
 
+//same decoding as unpackNormal in the shader atlas (octahedral, 12 bits per component in 3 bytes)
+static Vector3 unpackNormal(Vector3 p)
+{
+	float bx = floor(p.x * 255.0f + 0.5f);
+	float by = floor(p.y * 255.0f + 0.5f);
+	float bz = floor(p.z * 255.0f + 0.5f);
+	float hi_x = floor(bz / 16.0f);
+	float hi_y = bz - hi_x * 16.0f;
+	Vector3 n((bx + hi_x * 256.0f) / 4095.0f * 2.0f - 1.0f, (by + hi_y * 256.0f) / 4095.0f * 2.0f - 1.0f, 0.0f);
+	n.z = 1.0f - fabsf(n.x) - fabsf(n.y);
+	if (n.z < 0.0f)
+	{
+		float x = n.x;
+		n.x = (1.0f - fabsf(n.y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		n.y = (1.0f - fabsf(x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	return normalize(n);
+}
+
+//renders a tiny gbuffer from every face of every probe and stores it in probe_surfels,
+//this is done once and then the probes can be relit with relightProbes
+void Renderer::gatherProbeSurfels(Scene* scene)
+{
+	TRACE_SCOPE("Renderer::gatherProbeSurfels");
+	Application* application = Application::instance;
+	long start_time = getTime();
+
+	int size = PROBE_SURFELS_SIZE;
+	int face_texels = size * size;
+
+	if (!surfels_fbo)
+	{
+		surfels_fbo = new FBO();
+		surfels_fbo->create(size, size, 3, GL_RGBA, GL_FLOAT, true);
+	}
+
+	probe_surfels.resize(scene->probes.size() * 6 * face_texels);
+
+	FloatImage albedo, normal, emissive;
+	albedo.resize(size, size, 4);
+	normal.resize(size, size, 4);
+	emissive.resize(size, size, 4);
+	float* depth = new float[face_texels];
+
+	//same cameras used by computeIrradianceCoefficients, so the texels match the images of the SH
+	Camera cam;
+	cam.setPerspective(90, 1, 0.1, 1000);
+
+	bool light_meshes = show_light_meshes;
+	show_light_meshes = false;
+	application->current_pipeline = Application::DEFERRED;
+
+	for (int iP = 0; iP < scene->probes.size(); ++iP)
+	{
+		sProbe& probe = scene->probes[iP];
+		for (int i = 0; i < 6; ++i)
+		{
+			cam.lookAt(probe.pos, probe.pos + cubemapFaceNormals[i][2], cubemapFaceNormals[i][1]);
+			cam.enable();
+
+			surfels_fbo->bind();
+			glClearColor(0.0, 0.0, 0.0, 0.0);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			renderSkybox(&cam, scene->environment);
+			renderScene(scene, &cam);
+			surfels_fbo->unbind();
+
+			albedo.fromTexture(surfels_fbo->color_textures[0]);
+			normal.fromTexture(surfels_fbo->color_textures[1]);
+			emissive.fromTexture(surfels_fbo->color_textures[2]);
+			surfels_fbo->depth_texture->bind();
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, depth);
+			surfels_fbo->depth_texture->unbind();
+
+			Matrix44 inv_vp = cam.viewprojection_matrix;
+			inv_vp.inverse();
+
+			sProbeSurfel* surfels = &probe_surfels[(iP * 6 + i) * face_texels];
+			for (int y = 0; y < size; ++y)
+				for (int x = 0; x < size; ++x)
+				{
+					int index = y * size + x;
+					sProbeSurfel& surfel = surfels[index];
+					surfel.sky = depth[index] >= 1.0f;
+					surfel.albedo = albedo.getPixel(x, y).xyz();
+					if (surfel.sky)
+						continue;
+
+					//reconstruct the world position from the depth
+					Vector4 screen_pos((x + 0.5f) / size * 2.0f - 1.0f, (y + 0.5f) / size * 2.0f - 1.0f, depth[index] * 2.0f - 1.0f, 1.0f);
+					Vector4 world_pos = inv_vp * screen_pos;
+					surfel.pos = world_pos.xyz() * (1.0f / world_pos.w);
+					surfel.normal = unpackNormal(normal.getPixel(x, y).xyz());
+					Vector4 em = emissive.getPixel(x, y);
+					surfel.emissive = em.xyz();
+					surfel.occlusion = em.w;
+				}
+		}
+	}
+
+	delete[] depth;
+	show_light_meshes = light_meshes;
+	application->camera->enable();
+
+	std::cout << " + Probe surfels gathered: " << probe_surfels.size() << " in " << (getTime() - start_time) * 0.001 << "sec" << std::endl;
+}
+
+//recomputes the SH of every probe from its surfels and the current lights (diffuse only, like the forward bake with phong),
+//and the irradiance_bounces of the bake from them
+void Renderer::relightProbes(Scene* scene)
+{
+	TRACE_SCOPE("Renderer::relightProbes");
+	if (scene->probes.empty())
+		return;
+	if (probe_surfels.size() != scene->probes.size() * 6 * PROBE_SURFELS_SIZE * PROBE_SURFELS_SIZE)
+		gatherProbeSurfels(scene);
+
+	long start_time = getTime();
+	int size = PROBE_SURFELS_SIZE;
+	int face_texels = size * size;
+
+	//read back a low resolution copy of the shadowmaps (point lights are not supported, they are not shadowed)
+	const int shadow_size = 512;
+	std::vector<Light*> lights;
+	for (Light* light : scene->lights)
+		if (light->visible)
+			lights.push_back(light);
+	FloatImage* shadowmaps = new FloatImage[lights.size()];
+	Texture* shadow_copy = new Texture(shadow_size, shadow_size, GL_RGB, GL_FLOAT, false);
+	for (int l = 0; l < lights.size(); ++l)
+	{
+		Light* light = lights[l];
+		if (!light->cast_shadows || !light->shadow_fbo || light->light_type == GTR::POINT)
+			continue;
+		light->shadow_fbo->depth_texture->copyTo(shadow_copy, Shader::getDefaultShader("screen"));
+		shadowmaps[l].fromTexture(shadow_copy);
+	}
+	delete shadow_copy;
+
+	Vector3 ambient = (use_gamma_correction ? gamma(scene->ambient_light) : scene->ambient_light) * scene->ambient_power;
+
+	std::vector<SphericalHarmonics> direct_sh(scene->probes.size());
+	FloatImage images[6];
+	for (int i = 0; i < 6; ++i)
+		images[i].resize(size, size, 3);
+
+	for (int iP = 0; iP < scene->probes.size(); ++iP)
+	{
+		for (int i = 0; i < 6; ++i)
+		{
+			sProbeSurfel* surfels = &probe_surfels[(iP * 6 + i) * face_texels];
+			for (int index = 0; index < face_texels; ++index)
+			{
+				sProbeSurfel& surfel = surfels[index];
+				Vector3 color = surfel.albedo;
+				if (!surfel.sky)
+				{
+					Vector3 light_sum = ambient * surfel.occlusion;
+					for (int l = 0; l < lights.size(); ++l)
+					{
+						Light* light = lights[l];
+						Vector3 light_pos = light->model.getTranslation();
+						Vector3 L;
+						float factor = light->intensity;
+						if (light->light_type == GTR::DIRECTIONAL)
+							L = normalize(light->model.frontVector() * -1.0f);
+						else
+						{
+							L = light_pos - surfel.pos;
+							float dist = L.length();
+							L = L * (1.0f / dist);
+							float att = clamp((light->max_distance - dist) / light->max_distance, 0.0f, 1.0f);
+							factor *= att * att;
+							if (light->light_type == GTR::SPOT)
+							{
+								float spot_cosine = dot(normalize(light->model.frontVector()), L * -1.0f);
+								if (spot_cosine < cosf(light->spot_cutoff_in_deg * DEG2RAD))
+									continue;
+								factor *= powf(spot_cosine, light->spot_exponent);
+							}
+						}
+						float NdotL = dot(surfel.normal, L);
+						if (NdotL <= 0.0f || factor <= 0.0f)
+							continue;
+
+						//shadow test, same as isShadowed() in the shaders but without the adaptative bias
+						FloatImage& shadowmap = shadowmaps[l];
+						if (shadowmap.data)
+						{
+							Vector4 proj = light->camera->viewprojection_matrix * Vector4(surfel.pos, 1.0f);
+							float u = (proj.x / proj.w) * 0.5f + 0.5f;
+							float v = (proj.y / proj.w) * 0.5f + 0.5f;
+							float real_depth = ((proj.z - light->shadow_bias) / proj.w) * 0.5f + 0.5f;
+							bool outside = u < 0.0f || u > 1.0f || v < 0.0f || v > 1.0f || real_depth < 0.0f || real_depth > 1.0f;
+							if (outside && light->light_type == GTR::SPOT)
+								continue;
+							if (!outside)
+							{
+								int sx = clamp(u * shadow_size, 0.0f, shadow_size - 1.0f);
+								int sy = clamp(v * shadow_size, 0.0f, shadow_size - 1.0f);
+								if (shadowmap.getPixel(sx, sy).x < real_depth)
+									continue;
+							}
+						}
+
+						light_sum += (use_gamma_correction ? gamma(light->color) : light->color) * (NdotL * factor);
+					}
+					color = surfel.albedo * light_sum + surfel.emissive;
+				}
+				images[i].setPixel(index % size, index / size, Vector4(color, 1.0f));
+			}
+		}
+		scene->probes[iP].sh = direct_sh[iP] = computeSH(images);
+	}
+	delete[] shadowmaps;
+
+	//the indirect light of the bake depends on the direct one, so it is bounced again from the new lights
+	if (irradiance_bounces > 1)
+		computeIrradianceBounces(scene, direct_sh, 1, false);
+
+	setIrradianceTexture(scene);
+
+	std::cout << " + Probes relit in " << (getTime() - start_time) << "ms" << std::endl;
+}
+
+//parameters of the lights that change what the probes receive
+std::vector<float> Renderer::getLightsState(Scene* scene)
+{
+	std::vector<float> state;
+	for (Light* light : scene->lights)
+	{
+		float* m = light->model.m;
+		state.insert(state.end(), m, m + 16);
+		state.push_back(light->color.x);
+		state.push_back(light->color.y);
+		state.push_back(light->color.z);
+		state.push_back(light->intensity);
+		state.push_back(light->max_distance);
+		state.push_back(light->light_type);
+		state.push_back(light->spot_cutoff_in_deg);
+		state.push_back(light->spot_exponent);
+		state.push_back(light->visible);
+		state.push_back(light->cast_shadows);
+	}
+	return state;
+}
+
+//what the baked probes depend on: the lights, the entities, the ambient and sky and the settings of the bounces
+uint64_t Renderer::computeBakeHash(Scene* scene)
+{
+	std::vector<float> state = getLightsState(scene);
+	for (PrefabEntity* entity : scene->prefabs)
+	{
+		float* m = entity->model.m;
+		state.insert(state.end(), m, m + 16);
+		state.push_back(entity->visible);
+	}
+	state.push_back(scene->ambient_light.x);
+	state.push_back(scene->ambient_light.y);
+	state.push_back(scene->ambient_light.z);
+	state.push_back(scene->ambient_power);
+	state.push_back(scene->bg_color.x);
+	state.push_back(scene->bg_color.y);
+	state.push_back(scene->bg_color.z);
+	state.push_back(bounce_threshold);
+
+	//FNV-1a of the bytes
+	uint64_t hash = 14695981039346656037ULL;
+	const unsigned char* bytes = (const unsigned char*)state.data();
+	for (size_t i = 0; i < state.size() * sizeof(float); ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+//relights the probes when any of the lights has changed since the last time
+void Renderer::updateDynamicIrradiance(Scene* scene)
+{
+	TRACE_SCOPE("Renderer::updateDynamicIrradiance");
+	if (!dynamic_irradiance || !use_irradiance)
+		return;
+
+	std::vector<float> state = getLightsState(scene);
+	if (state == relight_lights_state)
+		return;
+	relight_lights_state = state;
+	relightProbes(scene);
+}
+
 void Renderer::writeProbesToDisk(Scene* scene)
 {
 	//fill header structure
@@ -1272,6 +2612,62 @@ void Renderer::writeProbesToDisk(Scene* scene)
 	std::cout << "* Probes coefficients written in " + probes_filename + "\n";
 }
 
+void Renderer::writeBakeProgress(Scene* scene, std::vector<SphericalHarmonics>& direct_sh, int bounce)
+{
+	sIrrBakeHeader header;
+	header.grid.start = start_pos_grid;
+	header.grid.end = end_pos_grid;
+	header.grid.dims = dim_grid;
+	header.grid.delta = delta_grid;
+	header.grid.num_probes = scene->probes.size();
+	header.bounce = bounce;
+	header.bounces = irradiance_bounces;
+	header.scene_hash = computeBakeHash(scene);
+
+	//the direct light is needed to continue, and the probes store the last bounce
+	FILE* f = fopen(bake_progress_filename.c_str(), "wb");
+	if (!f)
+		return;
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(&direct_sh[0], sizeof(SphericalHarmonics), direct_sh.size(), f);
+	fwrite(&(scene->probes[0]), sizeof(sProbe), scene->probes.size(), f);
+	fclose(f);
+}
+
+bool Renderer::loadBakeProgress(Scene* scene, std::vector<SphericalHarmonics>& direct_sh, int& bounce)
+{
+	FILE* f = fopen(bake_progress_filename.c_str(), "rb");
+	if (!f)
+		return false;
+
+	sIrrBakeHeader header;
+	bool read = fread(&header, sizeof(header), 1, f) == 1;
+
+	//only valid if it was baking the same grid
+	if (!read || header.grid.num_probes != scene->probes.size() || header.grid.start.distance(start_pos_grid) > 0.001 || header.grid.end.distance(end_pos_grid) > 0.001)
+	{
+		fclose(f);
+		return false;
+	}
+
+	//and the same scene, with the same lights and bounces
+	if (header.bounces != irradiance_bounces || header.scene_hash != computeBakeHash(scene))
+	{
+		std::cout << " * The unfinished irradiance bake is from another scene or settings, starting again" << std::endl;
+		fclose(f);
+		return false;
+	}
+
+	direct_sh.resize(header.grid.num_probes);
+	fread(&direct_sh[0], sizeof(SphericalHarmonics), direct_sh.size(), f);
+	fread(&scene->probes[0], sizeof(sProbe), scene->probes.size(), f);
+	fclose(f);
+
+	bounce = header.bounce;
+	std::cout << " + Resuming irradiance bake from bounce " << bounce << std::endl;
+	return true;
+}
+
 bool Renderer::loadProbesFromDisk(Scene* scene)
 {
 	//load probes info from disk
@@ -1305,38 +2701,130 @@ bool Renderer::loadProbesFromDisk(Scene* scene)
 
 void Renderer::computeReflection(Scene* scene)
 {
+	TRACE_SCOPE("Renderer::computeReflection");
+	Application* application = Application::instance;
+	long start_time = getTime();
+
+	//the lights do not move during the bake, so the shadowmaps are rendered once for all the probes and faces
+	application->current_pipeline = Application::FORWARD;
+	renderSceneShadowmaps(scene);
+
+	//all the faces share the same camera, only the orientation changes
 	Camera cam;
-	for (sReflectionProbe* rProbe : scene->reflection_probes)
+	cam.setPerspective(90.0f, 1, 1.0f, 10000.f);
+
+	//the probes are rendered to this cubemap and then prefiltered into their own
+	if (!reflections_capture)
+		reflections_capture = createReflectionCubemap();
+	int size = reflections_capture->width;
+	int num_probes = scene->reflection_probes.size();
+
+	//PROBE_BATCH probes in one pass each if the layered rendering is supported, then their layers are copied to the capture
+	int iP = 0;
+	if (use_layered_probes && !refl_layered_fbo)
+		refl_layered_fbo = createLayeredTarget(size, GL_HALF_FLOAT);
+	for (; use_layered_probes && refl_layered_fbo && iP < num_probes; iP += PROBE_BATCH)
 	{
+		int batch_size = std::min(PROBE_BATCH, num_probes - iP);
+		std::vector<Vector3> positions(batch_size);
+		for (int i = 0; i < batch_size; ++i)
+			positions[i] = scene->reflection_probes[iP + i]->pos;
+		renderProbesLayered(scene, refl_layered_fbo, &cam, positions);
+
+		//the layers of every probe to the faces of the capture
+		Texture* layers = refl_layered_fbo->color_textures[0];
+		GLuint read_fbo = 0;
+		glGenFramebuffers(1, &read_fbo);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		for (int i = 0; i < batch_size; ++i)
+		{
+			reflections_capture->bind();
+			for (int face = 0; face < 6; ++face)
+			{
+				glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, layers->texture_id, 0, i * 6 + face);
+				glCopyTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, 0, 0, 0, 0, size, size);
+			}
+			reflections_capture->unbind();
+
+			reflections_capture->generateMipmaps();
+			prefilterReflection(reflections_capture, scene->reflection_probes[iP + i]->cubemap);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo); //the prefilter unbinds it
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, FBO::screen_fbo_id);
+		glDeleteFramebuffers(1, &read_fbo);
+	}
+
+	//otherwise one face at a time
+	for (; iP < num_probes; ++iP)
+	{
+		sReflectionProbe* rProbe = scene->reflection_probes[iP];
 		//render the view from every side
 		for (int i = 0; i < 6; ++i)
 		{
-			Application* application = Application::instance;
 			//assign cubemap face to FBO
-			reflections_fbo->setTexture(rProbe->cubemap, i);
+			reflections_fbo->setTexture(reflections_capture, i);
 
 			//render view
 			Vector3 eye = rProbe->pos;
 			Vector3 center = rProbe->pos + cubemapFaceNormals[i][2];
 			Vector3 up = cubemapFaceNormals[i][1];
 			cam.lookAt(eye, center, up);
-			cam.setPerspective(90.0f, 1, 1.0f, 10000.f);
 			cam.enable();
-			application->current_pipeline = Application::FORWARD;
-			std::vector<GTR::Light*> shadow_caster_lights = application->renderer->renderSceneShadowmaps(Scene::instance);
 			reflections_fbo->bind();
-			application->renderer->renderSceneForward(Scene::instance, &cam);
-			application->current_pipeline = Application::DEFERRED;
+			renderSceneForward(scene, &cam);
 			reflections_fbo->unbind();
 		}
 
-		//generate the mipmaps
-		rProbe->cubemap->generateMipmaps();
+		//the mipmaps of the capture are used by the prefilter to avoid aliasing
+		reflections_capture->generateMipmaps();
+		prefilterReflection(reflections_capture, rProbe->cubemap);
+	}
+
+	application->current_pipeline = Application::DEFERRED;
+	application->camera->enable();
+
+	std::cout << " + Reflections baked: " << scene->reflection_probes.size() << " probes in " << (getTime() - start_time) * 0.001 << "sec" << std::endl;
+}
+
+//convolves the source cubemap with the GGX lobe, storing every roughness in a mip of the destination cubemap
+void Renderer::prefilterReflection(Texture* source, Texture* cubemap)
+{
+	Mesh* quad = Mesh::getQuad();
+	Shader* shader = Shader::Get("prefilterCubemap");
+
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+
+	for (int level = 0; level < NUM_REFLECTION_MIPS; ++level)
+	{
+		float roughness = level / (float)(NUM_REFLECTION_MIPS - 1);
+		for (int face = 0; face < 6; ++face)
+		{
+			reflections_fbo->setTexture(cubemap, face, level);
+			reflections_fbo->bind();
+
+			shader->enable();
+			shader->setTexture("u_environment", source, 0);
+			shader->setUniform("u_roughness", roughness);
+			shader->setUniform("u_face", face);
+			shader->setUniform("u_num_samples", level == 0 ? 1 : 64);
+			shader->setUniform("u_env_size", source->width);
+			quad->render(GL_TRIANGLES);
+			shader->disable();
+
+			reflections_fbo->unbind();
+		}
 	}
+
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
 }
 
 void Renderer::renderToViewport(Camera* camera, Scene* scene)
 {
+	TRACE_SCOPE("Renderer::renderToViewport");
 	if (use_tone_mapping)
 	{
 		Shader* shader = Shader::Get("toneMapper");
@@ -1346,21 +2834,19 @@ void Renderer::renderToViewport(Camera* camera, Scene* scene)
 		shader->setUniform("u_igamma", 1 / gamma_factor);
 		shader->setUniform("u_scale", tonemap_scale);
 		shader->setUniform("u_average_lum", average_lum);
-		illumination_fbo->color_textures[0]->toViewport(shader);
+		shader->setUniform("u_auto_exposure", use_auto_exposure && exposure_valid);
+		shader->setUniform("u_use_bloom", use_bloom && bloom_fbo[0] != NULL);
+		if (use_bloom && bloom_fbo[0])
+			shader->setTexture("u_bloom_texture", bloom_fbo[0]->color_textures[0], 2);
+		shader->setUniform("u_bloom_intensity", bloom_intensity);
+		if (exposure_fbo[exposure_index])
+			shader->setTexture("u_exposure_texture", exposure_fbo[exposure_index]->color_textures[0], 1);
+		getSceneColor()->toViewport(shader);
 	}
 	else if (use_gamma_correction)
-		illumination_fbo->color_textures[0]->toViewport(Shader::Get("degammaDeferred"));
+		getSceneColor()->toViewport(Shader::Get("degammaDeferred"));
 	else
-		illumination_fbo->color_textures[0]->toViewport();
-
-	if (use_reflections)
-	{
-		renderReflectionsToBuffer(camera);
-		Texture::UnbindAll();
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-		reflections_component->color_textures[0]->toViewport();
-	}
+		getSceneColor()->toViewport();
 
 	if (use_volumetric)
 	{
@@ -1369,11 +2855,11 @@ void Renderer::renderToViewport(Camera* camera, Scene* scene)
 		
 		Shader* blur_shader = Shader::Get("blur");
 		blur_shader->enable();
-		blur_shader->setTexture("u_texture", volumetrics_fbo->color_textures[0], 0);
+		blur_shader->setTexture("u_texture", volumetrics_texture, 0);
 		blur_shader->setUniform("u_kernel_size", kernel_size);
-		blur_shader->setUniform("u_offset", Vector2(1.0 / volumetrics_fbo->color_textures[0]->width, 1.0 / volumetrics_fbo->color_textures[0]->height));
+		blur_shader->setUniform("u_offset", Vector2(1.0 / volumetrics_texture->width, 1.0 / volumetrics_texture->height));
 		
-		volumetrics_fbo->color_textures[0]->toViewport(blur_shader);
+		volumetrics_texture->toViewport(blur_shader);
 	}
 
 	if (show_probes)
@@ -1395,7 +2881,7 @@ void Renderer::renderToViewport(Camera* camera, Scene* scene)
 	if (show_ssao && use_ssao)
 		showSSAO();
 
-	if (show_coefficients)
+	if (show_coefficients && probes_texture)
 		probes_texture->toViewport();
 }
 
@@ -1421,10 +2907,56 @@ void Renderer::renderInMenu(Scene* scene)
 		ImGui::SliderInt("Kernel size", &kernel_size, 1, 15);
 		if (kernel_size % 2 == 0) kernel_size++;
 		ssao_changed |= ImGui::SliderFloat("Radius of the spheres", &sphere_radius, 0.0f, 20.0f);
-		ImGui::SliderInt("Number of blurs", &number_blur, 1, 10);
+		ImGui::SliderFloat("Blur depth sharpness", &ssao_depth_sharpness, 0.0f, 50.0f);
+		if (ImGui::Checkbox("Optimized SSAO", &use_optimized_ssao))
+			ssao_history.invalidate();
+		if (use_optimized_ssao)
+		{
+			ssao_changed |= ImGui::SliderInt("Samples per pixel", &ssao_samples, 4, 64);
+			ImGui::SliderFloat("History weight", &ssao_history_weight, 0.0f, 0.98f);
+		}
 			
 		if (ssao_changed)	//generate sphere again
+		{
 			random_points = GTR::generateSpherePoints(number_points, sphere_radius, use_ssao_plus);
+			ssao_kernel = GTR::generateSpherePoints(ssao_samples, 1.0f, use_ssao_plus);
+		}
+	}
+
+	if (Application::instance->current_pipeline == Application::DEFERRED)
+	{
+		ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
+		ImGui::Text("Render graph:");
+		render_graph->renderInMenu();
+	}
+
+	ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
+	ImGui::Text("Occlusion culling:");
+	ImGui::Combo("Occluders", &occlusion_culling, "None\0Hi-Z (previous frame)\0Software occluders\0");
+	if (occlusion_culling == OCCLUSION_HIZ)
+	{
+		if (Application::instance->current_pipeline != Application::DEFERRED)
+			ImGui::Text("The Hi-Z is only built by the deferred pipeline");
+		else
+			ImGui::Text("Hi-Z %dx%d (mip %d) of frame %ld", hiz_occlusion.read_width, hiz_occlusion.read_height, hiz_occlusion.read_level, hiz_occlusion.frame);
+	}
+	else if (occlusion_culling == OCCLUSION_SOFTWARE)
+	{
+		ImGui::SliderInt("Occluder triangles", &max_occluder_triangles, 1000, 200000);
+		ImGui::SliderFloat("Min occluder size", &min_occluder_size, 0.01f, 1.0f);
+		ImGui::Text("%d occluders, %d triangles", software_occlusion.num_occluders, software_occlusion.num_triangles);
+	}
+
+	ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
+	ImGui::Text("Levels of detail:");
+	ImGui::Checkbox("Use LODs", &use_lods);
+	if (use_lods)
+	{
+		ImGui::SliderFloat("Max error (pixels)", &lod_max_error, 0.1f, 16.0f, "%.2f", 2.0f);
+		ImGui::SliderFloat("Hysteresis", &lod_hysteresis, 0.0f, 0.9f);
+		ImGui::Checkbox("Cross-fade", &use_lod_cross_fade);
+		if (use_lod_cross_fade)
+			ImGui::SliderFloat("Fade time (s)", &lod_fade_time, 0.05f, 2.0f);
 	}
 
 	ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
@@ -1432,6 +2964,31 @@ void Renderer::renderInMenu(Scene* scene)
 	ImGui::Checkbox("Reverse Shadowmap", &reverse_shadowmap);
 	ImGui::Checkbox("Apply AntiAliasing to Shadows", &AA_shadows);
 
+	ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
+	ImGui::Text("Antialiasing:");
+	if (ImGui::Checkbox("TAA", &use_taa))
+	{
+		taa_history.invalidate();
+		reflections_history.invalidate();
+	}
+	ImGui::SliderFloat("TAA history weight", &taa_history_weight, 0.0f, 0.98f);
+
+	if (Application::instance->current_pipeline == Application::DEFERRED)
+	{
+		ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
+		ImGui::Text("Dynamic resolution:");
+		ImGui::Checkbox("Dynamic resolution", &use_dynamic_resolution);
+		if (use_dynamic_resolution)
+		{
+			ImGui::SliderFloat("Frame budget (ms)", &frame_budget_ms, 4.0f, 50.0f);
+			ImGui::SliderFloat("Min scale", &min_render_scale, 0.25f, 1.0f);
+			Profiler* profiler = Profiler::instance;
+			ImGui::Text("Scale %.2f (%dx%d), frame %.2f ms", render_scale, (int)(Application::instance->window_width * render_scale), (int)(Application::instance->window_height * render_scale), profiler ? profiler->getFrameTime() : 0.0f);
+			if (!profiler || !profiler->enabled)
+				ImGui::Text("The profiler must be enabled to measure the frame");
+		}
+	}
+
 	ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
 	ImGui::Text("Color Correction:");
 	ImGui::Checkbox("Apply Gamma Correction", &use_gamma_correction);
@@ -1441,7 +2998,27 @@ void Renderer::renderInMenu(Scene* scene)
 		ImGui::SliderFloat("Gamma factor", &gamma_factor, 0.1, 5);
 		ImGui::SliderFloat("Intensity representing white", &lum_white, 0.1, 5);
 		ImGui::SliderFloat("Tonemap scale", &tonemap_scale, 0.1, 5);
-		ImGui::SliderFloat("Average luminance", &average_lum, 0.1, 5);
+		if (ImGui::Checkbox("Auto exposure", &use_auto_exposure))
+			exposure_valid = false;
+		if (use_auto_exposure)
+		{
+			ImGui::SliderFloat("Adaptation speed (brighter)", &exposure_speed_up, 0.1f, 10.0f);
+			ImGui::SliderFloat("Adaptation speed (darker)", &exposure_speed_down, 0.1f, 10.0f);
+			ImGui::SliderFloat("Min luminance", &min_luminance, 0.0001f, 1.0f, "%.4f", 3.0f);
+			ImGui::SliderFloat("Max luminance", &max_luminance, 1.0f, 1000.0f, "%.1f", 3.0f);
+			if (ImGui::Button("Compare with CPU reference"))
+				checkExposure();
+		}
+		else
+			ImGui::SliderFloat("Average luminance", &average_lum, 0.1, 5);
+
+		ImGui::Checkbox("Bloom", &use_bloom);
+		if (use_bloom)
+		{
+			ImGui::SliderFloat("Bloom threshold", &bloom_threshold, 0.0f, 10.0f);
+			ImGui::SliderFloat("Bloom knee", &bloom_knee, 0.0f, 2.0f);
+			ImGui::SliderFloat("Bloom intensity", &bloom_intensity, 0.0f, 1.0f);
+		}
 	}
 
 	ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
@@ -1451,6 +3028,12 @@ void Renderer::renderInMenu(Scene* scene)
 	ImGui::Checkbox("Show irrandiance probes", &show_probes);
 	ImGui::Checkbox("Show coefficients", &show_coefficients);
 	ImGui::Checkbox("Interpolate probes", &interpolate_probes);
+	ImGui::Checkbox("Relight probes when lights change", &dynamic_irradiance);
+	ImGui::SliderInt("Irradiance bounces", &irradiance_bounces, 1, 8);
+	ImGui::Checkbox("Layered probes (one pass per probe)", &use_layered_probes);
+	ImGui::SliderFloat("Bounce threshold", &bounce_threshold, 0.0f, 0.1f);
+	if (ImGui::Button("Relight probes"))
+		relightProbes(scene);
 	if (ImGui::Button("Re-compute irradiance"))
 	{
 		show_light_meshes = false;
@@ -1464,10 +3047,21 @@ void Renderer::renderInMenu(Scene* scene)
 	ImGui::Checkbox("Use reflections", &use_reflections);
 	ImGui::Checkbox("Show reflection probes", &show_rProbes);
 	ImGui::DragFloat("Refl normal distance", &refl_normal_distance);
+	ImGui::Checkbox("Screen space reflections", &use_ssr);
+	if (use_ssr)
+	{
+		ImGui::SliderInt("SSR max rays", &ssr_max_rays, 1, 16);
+		ImGui::SliderFloat("SSR max roughness", &ssr_max_roughness, 0.0f, 1.0f);
+		ImGui::DragFloat("SSR ray length", &ssr_max_distance, 1.0f, 1.0f, 5000.0f);
+		ImGui::DragFloat("SSR thickness", &ssr_thickness, 0.1f, 0.1f, 200.0f);
+		ImGui::SliderInt("SSR max steps", &ssr_max_steps, 8, 256);
+	}
 
 	ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
 	ImGui::Text("Volume Scattering:");
 	ImGui::Checkbox("Use volume scattering", &use_volumetric);
+	if (ImGui::Checkbox("Temporal accumulation", &use_temporal_volumetrics))
+		volumetrics_history.invalidate();
 	ImGui::SliderInt("Quality", &u_quality, 10, 130);
 	ImGui::SliderFloat("Air density", &u_air_density, 0.001f, 0.01f);
 	ImGui::SliderFloat("Distance sensibility", &u_clamp, 1.0f, 20.0f);
@@ -1475,4 +3069,4 @@ void Renderer::renderInMenu(Scene* scene)
 	ImGui::Spacing(); ImGui::Spacing(); ImGui::Spacing();
 	ImGui::Text("Decals:");
 	ImGui::Checkbox("Show Decal", &show_decal);
-}
\ No newline at end of file
+}
\ No newline at end of file
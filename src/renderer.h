@@ -3,6 +3,10 @@
 #include "BaseEntity.h"
 #include "scene.h"
 #include "sphericalharmonics.h"
+#include "rendergraph.h"
+#include "temporal.h"
+#include "hiz.h"
+#include "occlusion.h"
 
 //forward declarations
 class Camera;
@@ -11,6 +15,21 @@ namespace GTR {
 	class Prefab;
 	class Material;
 	
+	//number of 3D textures used to store the probes SH (27 floats packed in RGBA groups)
+	const int NUM_PROBE_VOLUMES = 7;
+
+	//reflection probes are stored prefiltered, one roughness level per mip (128, 64, ..., 4)
+	const int REFLECTION_PROBE_SIZE = 128;
+	const int NUM_REFLECTION_MIPS = 6;
+
+	//the bloom is computed in a pyramid of half float targets, from 1/2 to 1/32 of the screen
+	const int NUM_BLOOM_LEVELS = 5;
+
+	//what hides the nodes in the occlusion culling
+	enum eOcclusionCulling { OCCLUSION_NONE, OCCLUSION_HIZ, OCCLUSION_SOFTWARE };
+	const int OCCLUSION_HIZ_SIZE = 256;			//max size of the mip of the Hi-Z read back
+	const int OCCLUSION_SOFTWARE_WIDTH = 256;	//software occluders, the height follows the aspect of the camera
+
 	//struct to store probes
 	struct sProbe {
 		Vector3 pos; //where is located
@@ -25,6 +44,19 @@ namespace GTR {
 		Texture* cubemap = NULL;
 	};
 
+	//sample of the scene seen from a probe (a texel of its cubemap), stored to relight the probes without rendering again
+	const int PROBE_SURFELS_SIZE = 8; //resolution of every face
+
+	const int PROBE_BATCH = 16; //probes that share the layers of the framebuffer when baking them (6 layers each)
+	struct sProbeSurfel {
+		Vector3 pos;
+		Vector3 normal;
+		Vector3 albedo;		//if it is sky, the color of the sky
+		Vector3 emissive;
+		float occlusion;
+		bool sky;
+	};
+
 	// strict for writing probes to disk
 	struct sIrrHeader {
 		Vector3 start;
@@ -34,6 +66,25 @@ namespace GTR {
 		int num_probes;
 	};
 
+	//header of the file used to resume a multi-bounce bake
+	struct sIrrBakeHeader {
+		sIrrHeader grid;
+		int bounce;				//bounces already computed
+		int bounces;			//irradiance_bounces of the bake
+		uint64_t scene_hash;	//lights, entities and settings of the bake (see computeBakeHash)
+	};
+
+	//level of detail of a node of a prefab entity seen by the main camera, kept between frames
+	struct sLODState {
+		int level;
+		int previous_level;	//level fading out, -1 when there is no fade
+		float fade;			//how much of the new level is visible (0 to 1)
+		long frame;			//last frame it was rendered
+	};
+
+	//meshes of a prefab far enough use the lowres version of the prefab (if it has one)
+	const float LOWRES_PREFAB_DISTANCE = 1000.0f;
+
 
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code cleaner
@@ -44,17 +95,48 @@ namespace GTR {
 		bool show_light_meshes;				//Light information
 
 		// FBOs & Textures
+		RenderGraph* render_graph;			//owns the frame targets, assigns the FBOs below every frame
 		FBO* illumination_fbo;
 		FBO* gbuffers_fbo;
 		FBO* ssao_fbo;
-		Texture* ssao_blur;
+		FBO* ssao_blur;						//intermediate target of the separable blur
+		FBO* ssao_depth_normals;			//half resolution depth and normals for the optimized ssao
+		TemporalHistory ssao_history;		//accumulated ao of the previous frames
+		TemporalHistory taa_history;		//antialiased illumination
+		TemporalHistory volumetrics_history;
+		TemporalHistory reflections_history;
 		Texture* probes_texture;
+		Texture* probes_volumes[NUM_PROBE_VOLUMES];
 		FBO* irr_fbo;
+		FBO* irr_layered_fbo;				//the faces of PROBE_BATCH probes, one per layer
+		FBO* surfels_fbo;
 		FBO* reflections_fbo;
+		Texture* reflections_capture;		//cubemap where the probes are rendered before prefiltering
+		FBO* refl_layered_fbo;				//the faces of PROBE_BATCH reflection probes, copied to reflections_capture
 		FBO* reflections_component;
+		FBO* ssr_fbo;						//half resolution screen space reflections
+		HiZBuffer hiz;						//closest and farthest depth of the gbuffers, also for the occlusion culling and ssao
+		HiZOcclusion hiz_occlusion;			//the Hi-Z of the previous frame on the CPU
+		SoftwareOcclusion software_occlusion;
+		DepthPyramid* occlusion_test;		//used this frame, NULL without occlusion culling
+		Camera* occlusion_camera;			//only the passes of this camera are culled (not the shadowmaps or probes)
 		FBO* volumetrics_fbo;
-		Texture* depth_texture_aux;
-		Texture* normal_texture_aux;
+		Texture* volumetrics_texture;		//volumetrics and reflections after the temporal accumulation (if enabled)
+		Texture* reflections_texture;
+		FBO* decals_fbo;					//GB0 and GB2 of the gbuffers, without depth
+		Texture* luminance_texture;			//log luminance of the frame, its mip chain is the reduction
+		FBO* luminance_fbo;
+		FBO* exposure_fbo[2];				//adapted luminance of the previous frames (1x1 ping-pong)
+		FBO* bloom_fbo[NUM_BLOOM_LEVELS];
+		FBO* illumination_upscaled;			//full size copies of the scaled targets when there is no temporal pass to upscale them
+		FBO* volumetrics_upscaled;
+		FBO* reflections_upscaled;
+		FBO* reflections_composite;			//scene color plus the reflections in HDR, before the exposure, bloom and tone mapping
+		Matrix44 screen_viewprojection;		//viewprojection to the uvs of the scaled targets (the camera one without dynamic resolution)
+		ShaderPermutations* light_shaders;	//forward lighting (also the blend materials of the deferred pipeline)
+		ShaderPermutations* deferred_light_shaders;
+		ShaderPermutations* no_lights_shaders;
+		ShaderPermutations* skybox_shaders;
 
 		// FLAGS
 		bool show_gbuffers;					//Deferred general
@@ -67,12 +149,39 @@ namespace GTR {
 		bool show_ssao;
 		int kernel_size;
 		float sphere_radius;
-		int number_blur;
+		float ssao_depth_sharpness;			//how much the blur respects the depth edges
+		bool use_optimized_ssao;			//half resolution inputs, interleaved kernel and temporal accumulation
+		int ssao_samples;
+		float ssao_history_weight;
 		int number_points;
 
 		bool reverse_shadowmap;				//Shadows
 		bool AA_shadows;
 		bool rendering_shadowmap;
+		bool rendering_layers;				//LAYERED variants, every draw call goes to 6 layers from first_layer
+		Matrix44 layer_viewprojections[6];
+		int first_layer;
+
+		int occlusion_culling;				//Occlusion culling (eOcclusionCulling)
+		int max_occluder_triangles;			//budget of the software occluders, the biggest meshes on screen first
+		float min_occluder_size;			//radius / distance of a mesh to be an occluder
+
+		bool use_lods;						//Levels of detail of the meshes, chosen by their error on screen
+		float lod_max_error;				//pixels
+		float lod_hysteresis;				//a coarser level must be under this fraction less of the error
+		bool use_lod_cross_fade;			//dithered fade between the levels (main camera only)
+		float lod_fade_time;				//seconds
+		float lod_screen_scale;				//pixels of a unit at distance 1 (or anywhere with orthographic cameras)
+		std::map<std::pair<const Matrix44*, GTR::Node*>, sLODState> lod_states; //by model of the entity and node
+		float lod_fade;						//u_lod_fade of the mesh being rendered
+
+		bool use_taa;						//Temporal antialiasing (jittered projection, reprojected history)
+		float taa_history_weight;			//also used by the temporal volumetrics and reflections
+
+		bool use_dynamic_resolution;		//Dynamic resolution (the scene targets use a part of the viewport to keep the frame time)
+		float frame_budget_ms;				//GPU time of the frame to keep
+		float min_render_scale;
+		float render_scale;					//current scale of the gbuffers, ssao, lighting, volumetrics and reflections
 
 		bool use_gamma_correction;			//Color correction
 		bool use_tone_mapping;
@@ -82,16 +191,27 @@ namespace GTR {
 		bool show_probes;
 		bool show_coefficients;
 		bool interpolate_probes;
+		bool dynamic_irradiance;
+		int irradiance_bounces;				//1 means only direct light
+		bool use_layered_probes;			//the 6 faces of a probe in one pass (geometry shader) and PROBE_BATCH probes per readback
+		float bounce_threshold;				//stop bouncing when the probes change less than this (relative)
 		float irr_normal_distance;
 		float refl_normal_distance;
 
 		bool use_reflections;				//Reflection
 		bool show_rProbes;
+		bool use_ssr;						//screen space reflections traced over the hierarchical depth, the probes where they miss
+		int ssr_max_rays;
+		float ssr_max_roughness;
+		float ssr_max_distance;
+		float ssr_thickness;
+		int ssr_max_steps;
 
 		bool use_volumetric;				//Volumetric
 		int u_quality;
 		float u_air_density;
 		float u_clamp;
+		bool use_temporal_volumetrics;		//accumulates the frames, so less steps are needed
 
 		bool show_decal;					//Decal
 		Mesh* decal_cube;
@@ -100,15 +220,31 @@ namespace GTR {
 		float lum_white;
 		float tonemap_scale;
 		float average_lum;
+		bool use_auto_exposure;				//Auto exposure (average_lum measured every frame)
+		float exposure_speed_up;			//adaptation speed when the frame gets brighter
+		float exposure_speed_down;
+		float min_luminance;				//range of the luminance of the pixels in the average
+		float max_luminance;
+		bool use_bloom;						//Bloom
+		float bloom_threshold;
+		float bloom_knee;					//soft transition around the threshold
+		float bloom_intensity;
 		
 		// Vectors, Aux and Imgui
 		std::vector<GTR::Light*> shadow_caster_lights;	//vector that stores the lights that uses shadows
 		std::vector<Vector3> random_points;				//vector of random points for the irradiance
+		std::vector<Vector3> ssao_kernel;				//points of the optimized ssao (unit radius)
+		int exposure_index;								//exposure_fbo with the last frame
+		bool exposure_valid;
+		bool exposure_reset;							//the last frame started the adaptation (no previous luminance)
 		Vector3 dim_grid;								//Grid parameters for irradiance
 		Vector3 start_pos_grid;
 		Vector3 end_pos_grid;
 		Vector3 delta_grid;
 		std::string probes_filename;					//Name of the file that stores the probes
+		std::string bake_progress_filename;				//Name of the file that stores the last bounce of an unfinished bake
+		std::vector<sProbeSurfel> probe_surfels;		//6 faces of PROBE_SURFELS_SIZE^2 surfels per probe
+		std::vector<float> relight_lights_state;		//lights parameters used in the last relight
 
 
 		// FLAGS & SELECTORS
@@ -117,14 +253,31 @@ namespace GTR {
 		void manageBlendingAndCulling(GTR::Material* material, bool rendering_light, bool is_first_pass = true);
 		void enableShader(Shader* shader);
 		Shader* chooseShader(GTR::Light* light);
+		void setLayerUniforms(Shader* shader);
 
 		// RENDER to Buffers
+		void renderDeferred(Scene* scene, Camera* camera);
 		void renderGBuffers(Scene* scene, Camera* camera);
 		void renderToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
 		std::vector<GTR::Light*> renderSceneShadowmaps(GTR::Scene* scene); //to render the scene to texture (shadowmap)
 		void renderSSAO(Camera* camera);
+		void downsampleSSAO();
+		void renderOptimizedSSAO(Camera* camera);
+		void blurSSAO();
 		void renderIlluminationToBuffer(Camera* camera);
+		void renderVolumetricsToBuffer(Camera* camera);
 		void renderReflectionsToBuffer(Camera* camera);
+		void renderSSR(Camera* camera);
+		void updateOcclusion(Scene* scene, Camera* camera);
+		Texture* accumulateTemporal(TemporalHistory& history, Texture* current, Camera* camera, const Matrix44& viewprojection, float weight);
+		Texture* getIlluminationColor();	//illumination, antialiased if the TAA is enabled
+		Texture* getSceneColor();			//the illumination plus the reflections
+		void compositeReflections();
+		void updateRenderScale();
+		Texture* upscaleTarget(FBO* source, FBO* target);
+		void computeExposure();
+		void renderBloom();
+		int checkExposure(float tolerance = 0.05f);
 		
 		// BUFFERS to Viewport
 		void renderToViewport(Camera* camera, Scene* scene);
@@ -139,15 +292,32 @@ namespace GTR {
 		bool loadProbesFromDisk(Scene* scene);
 		void computeIrradiance(Scene* scene);									//Irradiance
 		void computeIrradianceCoefficients(sProbe &probe, Scene* scene);
+		bool computeIrradianceCoefficientsLayered(Scene* scene, int first_probe, int num_probes);
+		FBO* createLayeredTarget(int size, int type);
+		void renderProbesLayered(Scene* scene, FBO* fbo, Camera* cam, std::vector<Vector3>& positions);
 		void computeAllIrradianceCoefficients(Scene* scene);
+		void computeIrradianceBounces(Scene* scene, std::vector<SphericalHarmonics>& direct_sh, int bounce, bool save_progress = true);
+		Vector3 getProbesIrradiance(std::vector<SphericalHarmonics>& probes_sh, Vector3 pos, Vector3 normal);
+		void writeBakeProgress(Scene* scene, std::vector<SphericalHarmonics>& direct_sh, int bounce);
+		bool loadBakeProgress(Scene* scene, std::vector<SphericalHarmonics>& direct_sh, int& bounce);
+		uint64_t computeBakeHash(Scene* scene);
+		std::vector<float> getLightsState(Scene* scene);
 		void setIrradianceTexture(Scene* scene);
 		void SetIrradianceUniforms(Shader* shader, Scene* scene);
+		void gatherProbeSurfels(Scene* scene);									//Relight
+		void relightProbes(Scene* scene);
+		void updateDynamicIrradiance(Scene* scene);
 		void computeReflection(Scene* scene);									//Reflection
+		void prefilterReflection(Texture* source, Texture* cubemap);
 
 		// MAIN Render Scene
 		void renderScene(GTR::Scene* scene, Camera* camera); //to render a scene
 		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera); //to render a whole prefab (with all its nodes)
 		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera); //to render one node from the prefab and its children
+		void renderNodeLODs(const Matrix44& prefab_model, GTR::Node* node, Matrix44& node_model, const BoundingBox& world_bounding, Camera* camera);
+		int chooseLOD(Mesh* mesh, float pixels_per_unit, int current_level);
+		float computeLODScreenScale(Camera* camera);
+		GTR::Prefab* choosePrefab(PrefabEntity* entity, Camera* camera);
 		void renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera); //to render one mesh given its material and transformation matrix
 		// other render types
 		void renderSceneForward(GTR::Scene* scene, Camera* camera); //forward render to viewport
@@ -162,5 +332,6 @@ namespace GTR {
 	};
 
 	Texture* CubemapFromHDRE(const char* filename);
+	Texture* createReflectionCubemap(int size = REFLECTION_PROBE_SIZE);
 
-};
\ No newline at end of file
+};
\ No newline at end of file
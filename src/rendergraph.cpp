@@ -0,0 +1,267 @@
+#include "rendergraph.h"
+#include "utils.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace GTR;
+
+//frames a target of the pool can stay unused before being released
+const int POOL_MAX_UNUSED_FRAMES = 60;
+
+sRenderTargetDesc::sRenderTargetDesc(float scale, int num_textures, int format, int type, bool depth, int filter, bool dynamic)
+{
+	this->scale = scale;
+	this->width = 0;
+	this->height = 0;
+	this->num_textures = num_textures;
+	this->format = format;
+	this->type = type;
+	this->depth = depth;
+	this->filter = filter;
+	this->dynamic = dynamic;
+}
+
+size_t GTR::textureBytes(int width, int height, int format, int type)
+{
+	int channels = 4;
+	switch (format)
+	{
+	case GL_RED: case GL_DEPTH_COMPONENT: channels = 1; break;
+	case GL_RG: channels = 2; break;
+	case GL_RGB: channels = 3; break;
+	}
+
+	int bytes = 1;
+	switch (type)
+	{
+	case GL_HALF_FLOAT: bytes = 2; break;
+	case GL_FLOAT: case GL_UNSIGNED_INT: bytes = 4; break;
+	}
+
+	return (size_t)width * height * channels * bytes;
+}
+
+static size_t targetBytes(const sRenderTargetDesc& desc, int width, int height)
+{
+	size_t bytes = textureBytes(width, height, desc.format, desc.type) * desc.num_textures;
+	if (desc.depth)
+		bytes += textureBytes(width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+	return bytes;
+}
+
+static bool sameTarget(const sRenderTargetDesc& a, const sRenderTargetDesc& b)
+{
+	return a.num_textures == b.num_textures && a.format == b.format && a.type == b.type && a.depth == b.depth && a.filter == b.filter && a.dynamic == b.dynamic;
+}
+
+RenderGraph::RenderGraph()
+{
+	width = height = 0;
+	render_scale = 1.0f;
+	requested_bytes = allocated_bytes = 0;
+}
+
+RenderGraph::~RenderGraph()
+{
+	clearPool();
+}
+
+void RenderGraph::beginFrame(int width, int height)
+{
+	if (width != this->width || height != this->height)
+		resize(width, height);
+
+	resources.clear();
+	passes.clear();
+}
+
+int RenderGraph::addResource(const char* name, sRenderTargetDesc desc, FBO** fbo_binding, Texture** texture_binding)
+{
+	sResource resource;
+	resource.name = name;
+	resource.desc = desc;
+	resource.width = desc.width ? desc.width : std::max(1, (int)(width * desc.scale));
+	resource.height = desc.height ? desc.height : std::max(1, (int)(height * desc.scale));
+	resource.fbo_binding = fbo_binding;
+	resource.texture_binding = texture_binding;
+	resource.first_pass = resource.last_pass = -1;
+	resource.pool_index = -1;
+	resources.push_back(resource);
+	return resources.size() - 1;
+}
+
+int RenderGraph::addPass(const char* name, std::vector<int> inputs, std::vector<int> outputs, std::function<void()> execute, bool enabled, bool side_effect)
+{
+	sPass pass;
+	pass.name = name;
+	pass.trace_name = Tracer::internName(name);
+	pass.inputs = inputs;
+	pass.outputs = outputs;
+	pass.execute = execute;
+	pass.enabled = enabled;
+	pass.side_effect = side_effect;
+	pass.culled = false;
+	passes.push_back(pass);
+	return passes.size() - 1;
+}
+
+void RenderGraph::compile()
+{
+	//cull: walking backwards, a pass is needed if it is enabled and someone reads what it writes
+	std::vector<bool> needed(resources.size(), false);
+	for (int i = passes.size() - 1; i >= 0; --i)
+	{
+		sPass& pass = passes[i];
+		bool used = pass.side_effect;
+		for (int output : pass.outputs)
+			used |= needed[output];
+		pass.culled = !pass.enabled || !used;
+		if (pass.culled)
+			continue;
+		for (int input : pass.inputs)
+			needed[input] = true;
+	}
+
+	//lifetime of every target, from the first pass that uses it to the last one
+	for (int i = 0; i < passes.size(); ++i)
+	{
+		sPass& pass = passes[i];
+		if (pass.culled)
+			continue;
+		for (int k = 0; k < 2; ++k)
+			for (int index : (k ? pass.outputs : pass.inputs))
+			{
+				sResource& resource = resources[index];
+				if (resource.first_pass == -1)
+					resource.first_pass = i;
+				resource.last_pass = i;
+			}
+	}
+
+	//assign the FBOs, in order of first use so freed targets can be reused by the next ones
+	std::vector<int> order;
+	for (int i = 0; i < resources.size(); ++i)
+		if (resources[i].first_pass != -1)
+			order.push_back(i);
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return resources[a].first_pass < resources[b].first_pass; });
+
+	for (sPoolEntry& entry : pool)
+		entry.busy_until = -1;
+
+	requested_bytes = 0;
+	for (int index : order)
+	{
+		sResource& resource = resources[index];
+		requested_bytes += targetBytes(resource.desc, resource.width, resource.height);
+
+		for (int i = 0; i < pool.size(); ++i)
+		{
+			sPoolEntry& entry = pool[i];
+			if (entry.busy_until < resource.first_pass && entry.width == resource.width && entry.height == resource.height && sameTarget(entry.desc, resource.desc))
+			{
+				resource.pool_index = i;
+				break;
+			}
+		}
+
+		if (resource.pool_index == -1)
+		{
+			sPoolEntry entry;
+			entry.fbo = new FBO();
+			entry.fbo->create(resource.width, resource.height, resource.desc.num_textures, resource.desc.format, resource.desc.type, resource.desc.depth);
+			if (resource.desc.filter != GL_NEAREST)
+				for (int t = 0; t < resource.desc.num_textures; ++t)
+				{
+					entry.fbo->color_textures[t]->bind();
+					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, resource.desc.filter);
+					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, resource.desc.filter);
+					entry.fbo->color_textures[t]->unbind();
+				}
+			entry.desc = resource.desc;
+			entry.width = resource.width;
+			entry.height = resource.height;
+			pool.push_back(entry);
+			resource.pool_index = pool.size() - 1;
+		}
+
+		sPoolEntry& entry = pool[resource.pool_index];
+		entry.busy_until = resource.last_pass;
+		entry.unused_frames = 0;
+	}
+
+	//release the targets nobody has used for a while
+	for (int i = pool.size() - 1; i >= 0; --i)
+	{
+		if (pool[i].busy_until != -1 || ++pool[i].unused_frames < POOL_MAX_UNUSED_FRAMES)
+			continue;
+		delete pool[i].fbo;
+		pool.erase(pool.begin() + i);
+		for (sResource& resource : resources)
+			if (resource.pool_index > i)
+				resource.pool_index--;
+	}
+
+	allocated_bytes = 0;
+	for (sPoolEntry& entry : pool)
+		allocated_bytes += targetBytes(entry.desc, entry.width, entry.height);
+
+	//let the renderer know where every target is
+	for (sResource& resource : resources)
+	{
+		FBO* fbo = resource.pool_index != -1 ? pool[resource.pool_index].fbo : NULL;
+		if (fbo)
+			fbo->viewport_scale = resource.desc.dynamic ? render_scale : 1.0f;
+		if (resource.fbo_binding)
+			*resource.fbo_binding = fbo;
+		if (resource.texture_binding)
+			*resource.texture_binding = fbo ? fbo->color_textures[0] : NULL;
+	}
+}
+
+void RenderGraph::execute()
+{
+	for (sPass& pass : passes)
+		if (!pass.culled)
+		{
+			PROFILE_SCOPE(pass.trace_name);
+			pass.execute();
+		}
+}
+
+void RenderGraph::resize(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	clearPool();
+}
+
+void RenderGraph::clearPool()
+{
+	for (sPoolEntry& entry : pool)
+		delete entry.fbo;
+	pool.clear();
+	allocated_bytes = 0;
+}
+
+void RenderGraph::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	const float mb = 1.0f / (1024.0f * 1024.0f);
+	ImGui::Text("Targets: %.1f MB (%.1f MB without aliasing, %.1f MB saved)", allocated_bytes * mb, requested_bytes * mb, requested_bytes > allocated_bytes ? (requested_bytes - allocated_bytes) * mb : 0.0f);
+	if (render_scale != 1.0f)
+		ImGui::Text("Dynamic targets at %d%%", (int)(render_scale * 100.0f));
+
+	for (sPass& pass : passes)
+		ImGui::Text("%s %s", pass.culled ? "[culled]" : "        ", pass.name.c_str());
+
+	for (sResource& resource : resources)
+	{
+		if (resource.pool_index == -1)
+			ImGui::Text("%s: not allocated", resource.name.c_str());
+		else
+			ImGui::Text("%s: %dx%d%s, target %d, passes %d-%d", resource.name.c_str(), resource.width, resource.height, resource.desc.dynamic ? " (dynamic)" : "", resource.pool_index, resource.first_pass, resource.last_pass);
+	}
+#endif
+}
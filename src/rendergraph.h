@@ -0,0 +1,96 @@
+#pragma once
+
+#include "includes.h"
+#include "fbo.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace GTR {
+
+	//description of a render target, the graph creates (or reuses) an FBO that matches it
+	struct sRenderTargetDesc {
+		float scale;		//size relative to the window, used when width is 0
+		int width;			//absolute size in pixels
+		int height;
+		int num_textures;
+		int format;
+		int type;
+		bool depth;			//adds a depth texture
+		int filter;			//GL_NEAREST or GL_LINEAR, targets with different filters are never shared
+		bool dynamic;		//rendered with the dynamic resolution of the graph (only the bottom-left part of the target is used)
+
+		sRenderTargetDesc(float scale = 1.0f, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool depth = false, int filter = GL_NEAREST, bool dynamic = false);
+	};
+
+	//size of a texture of the given format and type
+	size_t textureBytes(int width, int height, int format, int type);
+
+	// Every frame the renderer declares the passes with the targets they read and write,
+	// the graph culls the passes whose results are not used, computes the lifetime of every
+	// target and assigns FBOs from a pool, so targets that are not alive at the same time share memory
+	class RenderGraph
+	{
+	public:
+		struct sResource {
+			std::string name;
+			sRenderTargetDesc desc;
+			int width;				//resolved size
+			int height;
+			FBO** fbo_binding;		//pointers of the renderer updated with the assigned FBO (NULL if culled)
+			Texture** texture_binding;
+			int first_pass;			//lifetime, in pass order
+			int last_pass;
+			int pool_index;			//-1 if not allocated this frame
+		};
+
+		struct sPass {
+			std::string name;
+			const char* trace_name;	//interned, the events of the trace keep the pointer after the pass is cleared
+			std::vector<int> inputs;
+			std::vector<int> outputs;
+			std::function<void()> execute;
+			bool enabled;
+			bool side_effect;		//renders to the screen, it is never culled
+			bool culled;
+		};
+
+		struct sPoolEntry {
+			FBO* fbo;
+			sRenderTargetDesc desc;
+			int width;
+			int height;
+			int busy_until;			//last pass using it this frame
+			int unused_frames;
+		};
+
+		int width;
+		int height;
+		float render_scale;			//viewport scale of the dynamic targets, they keep their full size so changing it does not reallocate
+		std::vector<sResource> resources;
+		std::vector<sPass> passes;
+		std::vector<sPoolEntry> pool;
+
+		size_t requested_bytes;		//memory needed if every target had its own FBO
+		size_t allocated_bytes;		//memory of the pool
+
+		RenderGraph();
+		~RenderGraph();
+
+		//starts the declaration of a new frame
+		void beginFrame(int width, int height);
+		int addResource(const char* name, sRenderTargetDesc desc, FBO** fbo_binding, Texture** texture_binding = NULL);
+		int addPass(const char* name, std::vector<int> inputs, std::vector<int> outputs, std::function<void()> execute, bool enabled = true, bool side_effect = false);
+
+		void compile();
+		void execute();
+
+		//releases all the targets, they are created again with the new size
+		void resize(int width, int height);
+		void clearPool();
+
+		void renderInMenu();
+	};
+
+};
@@ -6,6 +6,7 @@
 using namespace GTR;
 
 Scene* Scene::instance = nullptr;
+bool Scene::bake_missing_irradiance = true;
 
 
 Scene::Scene()
@@ -65,7 +66,8 @@ void Scene::defineIrradianceGrid(Vector3 offset)
 				probes.push_back(p);
 			}
 
-	renderer->computeIrradiance(instance);
+	if (bake_missing_irradiance)
+		renderer->computeIrradiance(instance);
 }
 
 void Scene::defineReflectionGrid(Vector3 offset)
@@ -101,17 +103,9 @@ void Scene::defineReflectionGrid(Vector3 offset)
 
 				//and its position
 				rProbe->pos = start_refl_grid + delta_refl_grid * Vector3(x, y, z);
-				rProbe->cubemap = new Texture();
-				rProbe->cubemap->createCubemap(
-					512, 512,
-					NULL,
-					GL_RGB, GL_UNSIGNED_INT, false);
+				rProbe->cubemap = createReflectionCubemap();
 
 				reflection_probes.push_back(rProbe);
-
-				rProbe->cubemap->bind();
-				glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-				glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 			}
 
 	placeReflectionProbe(Vector3(0, 270, 0), offset);	// top house
@@ -132,17 +126,9 @@ void Scene::placeReflectionProbe(Vector3 pos, Vector3 offset)
 
 	//top probe
 	rProbe->pos = pos + offset;
-	rProbe->cubemap = new Texture();
-	rProbe->cubemap->createCubemap(
-		512, 512,
-		NULL,
-		GL_RGB, GL_UNSIGNED_INT, false);
+	rProbe->cubemap = createReflectionCubemap();
 
 	reflection_probes.push_back(rProbe);
-
-	rProbe->cubemap->bind();
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 }
 
 void Scene::AddEntity(BaseEntity* entity)
@@ -21,6 +21,9 @@ namespace GTR {
 		//instance delcaration
 		static Scene* instance;
 
+		//defineIrradianceGrid bakes the probes when they are not on disk, the batch bake disables it to bake only once
+		static bool bake_missing_irradiance;
+
 		//list to store al entities of the scene
 		std::vector<Light*> lights;
 		std::vector<PrefabEntity*> prefabs;
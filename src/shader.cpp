@@ -6,11 +6,65 @@
 #include <functional> 
 #include <cctype>
 #include <locale>
+#include <cstdint>
+#include <set>
+#include <ctime>
+#include <sys/stat.h>
 
 #include "texture.h"
+#include "trace.h"
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
+bool Shader::s_use_binary_cache = true;
+bool Shader::s_hot_reload = true;
+
+//how often the hot reload checks the atlas file (ms)
+const long HOT_RELOAD_INTERVAL = 500;
+
+#ifndef GL_COMPLETION_STATUS_KHR
+	#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+//changes when the layout of the cache file changes
+const uint32_t SHADER_CACHE_MAGIC = 0x43425348; //"HSBC"
+const uint32_t SHADER_CACHE_VERSION = 1;
+
+struct sProgramBinary {
+	GLenum format;
+	std::vector<char> data;
+};
+typedef std::map<uint64_t, sProgramBinary> ProgramBinaries;
+
+//cache of the atlas loaded, the variants compiled later are added to it
+static ProgramBinaries s_binaries;
+static std::string s_cache_filename;
+static std::string s_driver;
+static bool s_cache_enabled = false;
+static bool s_cache_dirty = false;			//programs compiled by the hot reload, saved when all of them finish
+static bool s_parallel_compile = false;
+
+//the atlas as it was loaded, to find what changes
+static std::map<std::string, std::string> s_atlas_sources;					//sub-files without resolving the #includes
+static std::map<std::string, std::vector<std::string>> s_atlas_includes;	//sub-files included by every sub-file
+static std::map<std::string, std::string> s_atlas_declarations;				//header line of every program
+static time_t s_atlas_time = 0;
+static uint64_t s_atlas_hash = 0;
+
+//program compiled by the hot reload, the target keeps the previous one until it finishes
+struct sReloadJob {
+	std::string name;
+	Shader* target;
+	Shader* pending;
+	bool is_new;			//the target is not in s_Shaders yet
+	bool from_cache;
+	uint64_t hash;
+	ShaderPermutations* permutations;	//set of the variant, NULL for the other programs
+};
+static std::vector<sReloadJob> s_reload_jobs;
+
+std::map<std::string, ShaderPermutations*> ShaderPermutations::s_permutations;
+const char* ShaderPermutations::s_keyword_names[NUM_SHADER_KEYWORDS] = { "SHADOWS", "PCF", "GEOMETRY", "BLEND", "PBR", "LAYERED" };
 
 
 //typedef unsigned int GLhandle;
@@ -56,6 +110,8 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+int64_t Shader::num_binds = 0;
+int64_t Shader::num_uniform_uploads = 0;
 
 Shader::Shader()
 {
@@ -63,6 +119,7 @@ Shader::Shader()
 		Shader::init();
 	compiled = false;
 	from_atlas = false;
+	vs = fs = gs = program = 0;
 }
 
 Shader::~Shader()
@@ -153,6 +210,227 @@ static inline std::string trim(std::string str) {
 	return str;
 }
 
+static bool hasExtension(const char* name)
+{
+	GLint num_extensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+	for (int i = 0; i < num_extensions; ++i)
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+			return true;
+	return false;
+}
+
+//program binaries are core since 4.1, older drivers may have the extension
+static bool programBinariesSupported()
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+		GLint num_formats = 0;
+		if (hasExtension("GL_ARB_get_program_binary"))
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+		supported = num_formats > 0;
+	}
+	return supported == 1;
+}
+
+//asks the driver to compile with its own threads (GL_ARB/KHR_parallel_shader_compile), false if not supported
+static bool enableParallelCompile()
+{
+	typedef void (APIENTRY *MaxShaderCompilerThreadsFunc)(GLuint count);
+	MaxShaderCompilerThreadsFunc func = NULL;
+	if (hasExtension("GL_KHR_parallel_shader_compile"))
+		func = (MaxShaderCompilerThreadsFunc)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+	else if (hasExtension("GL_ARB_parallel_shader_compile"))
+		func = (MaxShaderCompilerThreadsFunc)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsARB");
+	if (!func)
+		return false;
+	func(0xFFFFFFFF); //as many threads as the driver wants
+	return true;
+}
+
+//FNV-1a, 64 bits
+static uint64_t hashFNV(const std::string& str, uint64_t hash = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < str.size(); ++i)
+	{
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+//cache file: magic, version, number of programs and for every one its hash, format, size and binary
+static bool readBinaryCache(const std::string& filename, ProgramBinaries& binaries)
+{
+	FILE* file = fopen(filename.c_str(), "rb");
+	if (!file)
+		return false;
+
+	uint32_t header[3] = { 0, 0, 0 };
+	bool valid = fread(header, sizeof(uint32_t), 3, file) == 3 && header[0] == SHADER_CACHE_MAGIC && header[1] == SHADER_CACHE_VERSION;
+	for (uint32_t i = 0; valid && i < header[2]; ++i)
+	{
+		uint64_t hash = 0;
+		uint32_t info[2] = { 0, 0 };
+		if (fread(&hash, sizeof(hash), 1, file) != 1 || fread(info, sizeof(uint32_t), 2, file) != 2 || !info[1])
+		{
+			valid = false;
+			break;
+		}
+		sProgramBinary& binary = binaries[hash];
+		binary.format = info[0];
+		binary.data.resize(info[1]);
+		valid = fread(&binary.data[0], 1, info[1], file) == info[1];
+	}
+	fclose(file);
+
+	if (!valid)
+	{
+		std::cout << " - Shader binary cache not valid, it will be created again: " << filename << std::endl;
+		binaries.clear();
+	}
+	return valid;
+}
+
+static bool writeBinaryCache(const std::string& filename, const ProgramBinaries& binaries)
+{
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file)
+	{
+		std::cout << " - Shader binary cache can not be written: " << filename << std::endl;
+		return false;
+	}
+
+	uint32_t header[3] = { SHADER_CACHE_MAGIC, SHADER_CACHE_VERSION, (uint32_t)binaries.size() };
+	fwrite(header, sizeof(uint32_t), 3, file);
+	for (auto& it : binaries)
+	{
+		uint32_t info[2] = { (uint32_t)it.second.format, (uint32_t)it.second.data.size() };
+		fwrite(&it.first, sizeof(uint64_t), 1, file);
+		fwrite(info, sizeof(uint32_t), 2, file);
+		fwrite(&it.second.data[0], 1, it.second.data.size(), file);
+	}
+	fclose(file);
+	return true;
+}
+
+static time_t getModificationTime(const std::string& filename)
+{
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0)
+		return 0;
+	return info.st_mtime;
+}
+
+//name of the sub-file of an #include line, empty for other lines
+static std::string getInclude(const std::string& line)
+{
+	if (line.compare(0, 8, "#include") != 0)
+		return "";
+	std::string param = trim(line.substr(8));
+	if (param.size() >= 2 && param[0] == '\"')
+		param = param.substr(1, param.size() - 2);
+	return param;
+}
+
+//splits the atlas in sub-files (the header is the one without name) and lists the ones included by every sub-file
+static void parseAtlas(const std::string& content, std::map<std::string, std::string>& sources, std::map<std::string, std::vector<std::string>>& includes)
+{
+	sources.clear();
+	includes.clear();
+
+	std::vector<std::string> lines = tokenize(content, "\n");
+	std::string subfile_name = "";
+	for (int i = 0; i < lines.size(); ++i)
+	{
+		std::string& line = lines[i];
+		if (line[0] == '\\')
+		{
+			subfile_name = trim(line.substr(1, std::string::npos));
+			sources[subfile_name] = "";
+			includes[subfile_name].clear();
+			continue;
+		}
+		std::string include = getInclude(trim(line));
+		if (include.size())
+			includes[subfile_name].push_back(include);
+		sources[subfile_name] += line + "\n";
+	}
+}
+
+//code of a sub-file with its #includes replaced by their code
+static std::string resolveSubfile(const std::string& name, std::map<std::string, std::string>& resolved, int depth)
+{
+	auto it = resolved.find(name);
+	if (it != resolved.end())
+		return it->second;
+	if (depth > 32)
+	{
+		std::cout << " - Error: Shader #include loop in: " << name << std::endl;
+		return "";
+	}
+
+	std::string code;
+	std::vector<std::string> lines = tokenize(s_atlas_sources[name], "\n");
+	for (int i = 0; i < lines.size(); ++i)
+	{
+		std::string include = getInclude(trim(lines[i]));
+		if (include.empty())
+			code += lines[i] + "\n";
+		else if (s_atlas_sources.count(include))
+			code += resolveSubfile(include, resolved, depth + 1) + "\n";
+		else
+			std::cout << " - Error: Shader #include not found: " << include << std::endl;
+	}
+	resolved[name] = code;
+	return code;
+}
+
+static void resolveAtlas()
+{
+	std::map<std::string, std::string> resolved;
+	for (auto& it : s_atlas_sources)
+		resolveSubfile(it.first, resolved, 0);
+	Shader::s_shaders_atlas = resolved;
+}
+
+//"name vs fs [macros]" line of the header, false for empty lines and comments
+static bool parseDeclaration(std::string line, std::string& name, std::string& vs_filename, std::string& fs_filename, std::string& macros)
+{
+	line = trim(line);
+	if(line.size() == 0 || line.substr(0,2) == "//")
+		return false;
+	int pos = line.find_first_of(' ');
+	int pos2 = line.find_first_of(' ',pos+1);
+	int pos3 = line.find_first_of(' ',pos2+1);
+	if(pos3 == -1)
+		pos3 = std::string::npos;
+	name = line.substr(0,pos);
+	vs_filename = trim(line.substr(pos+1,pos2 - pos));
+	fs_filename = trim(line.substr(pos2+1,pos3 - pos2));
+	macros = "";
+	if(pos3 != std::string::npos)
+		macros = line.substr(pos3+1);
+	return true;
+}
+
+//mask of a "[KEYWORD ...]" list
+static int parseKeywords(const std::string& macros, const std::string& name)
+{
+	int mask = 0;
+	std::vector<std::string> keywords = tokenize(macros.substr(1, macros.find(']') - 1), " \t");
+	for (std::string& keyword : keywords)
+	{
+		int index = std::find(ShaderPermutations::s_keyword_names, ShaderPermutations::s_keyword_names + NUM_SHADER_KEYWORDS, keyword) - ShaderPermutations::s_keyword_names;
+		if (index < NUM_SHADER_KEYWORDS)
+			mask |= 1 << index;
+		else
+			std::cout << " * Error in shader atlas, unknown keyword " << keyword << " in " << name << std::endl;
+	}
+	return mask;
+}
+
 void Shader::setMacros(const char* macros)
 {
 	this->macros = macros;
@@ -161,6 +439,7 @@ void Shader::setMacros(const char* macros)
 
 bool Shader::LoadAtlas(const char* filename)
 {
+	TRACE_SCOPE_DETAIL("Shader::LoadAtlas", filename);
 	std::string content;
 	if (!readFile(filename, content))
 	{
@@ -168,104 +447,547 @@ bool Shader::LoadAtlas(const char* filename)
 		return false;
 	}
 
+	//a full load replaces the programs being compiled by the hot reload
+	cancelReloads();
+
 	//separate subfiles
 	s_shader_atlas_filename = filename;
-	std::vector<std::string> lines = tokenize(content, "\n");
-	std::string subfile_name = "";
-	std::string subfile_content = "";
+	s_atlas_time = getModificationTime(filename);
+	s_atlas_hash = hashFNV(content);
+	parseAtlas(content, s_atlas_sources, s_atlas_includes);
+	resolveAtlas();
 
+	//compile shaders
+	long start_time = getTime();
+	std::string shaders = s_shaders_atlas[""];
+	s_atlas_declarations.clear();
+
+	struct sAtlasProgram {
+		std::string name;
+		std::string vs_filename;
+		std::string fs_filename;
+		Shader* shader;
+		uint64_t hash;
+		bool from_cache;
+	};
+	std::vector<sAtlasProgram> programs;
+
+	//the binaries only work with the same driver
+	std::string driver = std::string((const char*)glGetString(GL_VENDOR)) + (const char*)glGetString(GL_RENDERER) + (const char*)glGetString(GL_VERSION);
+	bool use_cache = s_use_binary_cache && programBinariesSupported();
+	std::string cache_filename = getBinaryCacheFilename(filename);
+	ProgramBinaries cache;
+	if (use_cache)
+		readBinaryCache(cache_filename, cache);
+
+	//the cache keeps only the programs of the atlas as it is now
+	ProgramBinaries binaries;
+	int num_permutations = 0;
+	int num_variants = 0;
+
+	bool parallel = s_parallel_compile = enableParallelCompile();
+
+	std::vector<std::string> lines = tokenize(shaders, "\n");
 	for (int i = 0; i < lines.size(); ++i)
 	{
-		std::string& line = lines[i];
-		std::string line_trimmed = trim(line);
-		if(line[0] == '\\')
+		std::string name, vs_filename, fs_filename, macros;
+		if (!parseDeclaration(lines[i], name, vs_filename, fs_filename, macros))
+			continue;
+		s_atlas_declarations[name] = trim(lines[i]);
+		std::string vs_code = s_shaders_atlas[vs_filename];
+		std::string fs_code = s_shaders_atlas[fs_filename];
+		if(!vs_code.size() || !fs_code.size())
 		{
-			s_shaders_atlas[ subfile_name ] = subfile_content; //store previous one
-			subfile_name = trim(line.substr(1,std::string::npos));
-			subfile_content = "";
+			std::cout << " * Error in shader atlas, couldnt find files for " << name << std::endl;
 			continue;
 		}
-		else if (line_trimmed[0] == '#')
+
+		//permutations, only the variants in the cache are created now
+		if (macros.size() && macros[0] == '[')
 		{
-			int pos = line_trimmed.find_first_of(' ');
-			if (pos != std::string::npos)
+			ShaderPermutations* permutations = ShaderPermutations::Get(name.c_str());
+			if (!permutations)
 			{
-				std::string cmd = line_trimmed.substr(1, pos - 1);
-				std::string param = trim(line_trimmed.substr(pos));
-				if (cmd == "include" && !param.empty())
+				permutations = new ShaderPermutations(name);
+				ShaderPermutations::s_permutations[name] = permutations;
+			}
+			permutations->release();
+			permutations->vs_code = vs_code;
+			permutations->fs_code = fs_code;
+			permutations->keywords = parseKeywords(macros, name);
+			permutations->gs_code = permutations->keywords & SHADER_LAYERED ? s_shaders_atlas["layered.gs"] : "";
+			if ((permutations->keywords & SHADER_LAYERED) && !permutations->gs_code.size())
+				std::cout << " * Error in shader atlas, couldnt find layered.gs for " << name << std::endl;
+			num_permutations++;
+
+			for (int mask = 0; use_cache && mask < NUM_SHADER_VARIANTS; ++mask)
+			{
+				if (mask & ~permutations->keywords)
+					continue;
+				std::string gs_code = permutations->getGeometryCode(permutations->gs_code, mask);
+				uint64_t hash = hashFNV(driver, hashFNV(gs_code, hashFNV(permutations->getCode(fs_code, mask), hashFNV(permutations->getCode(vs_code, mask)))));
+				auto binary = cache.find(hash);
+				if (binary == cache.end())
+					continue;
+				Shader* shader = new Shader();
+				if (!shader->loadBinary(binary->second.format, binary->second.data))
 				{
-					if (param[0] == '\"')
-						param = param.substr(1, param.size() - 2);
-					auto it = s_shaders_atlas.find(param);
-					if (it != s_shaders_atlas.end())
-						subfile_content += it->second + "\n";
-					else
-						std::cout << " - Error: Shader #include not found: " << param << std::endl;
+					delete shader;
 					continue;
 				}
+				shader->vs_filename = vs_filename;
+				shader->ps_filename = fs_filename;
+				shader->from_atlas = true;
+				permutations->variants[mask] = shader;
+				permutations->good_vs_code = vs_code;
+				permutations->good_fs_code = fs_code;
+				permutations->good_gs_code = permutations->gs_code;
+				binaries[hash] = binary->second;
+				num_variants++;
+			}
+			continue;
+		}
+
+		vs_code = macros + "\n" + vs_code;
+		fs_code = macros + "\n" + fs_code;
+
+		Shader* shader = NULL;
+		auto it = s_Shaders.find( name );
+		if(it == s_Shaders.end())
+		{
+			shader = new Shader();
+			s_Shaders[ name ] = shader;
+		}
+		else
+		{
+			shader = it->second;
+			shader->release();
+		}
+
+		sAtlasProgram program;
+		program.name = name;
+		program.vs_filename = vs_filename;
+		program.fs_filename = fs_filename;
+		program.shader = shader;
+		program.hash = hashFNV(driver, hashFNV(fs_code, hashFNV(vs_code)));
+		program.from_cache = false;
+
+		auto binary = cache.find(program.hash);
+		if (use_cache && binary != cache.end() && shader->loadBinary(binary->second.format, binary->second.data))
+			program.from_cache = true;
+		else
+			shader->submitFromMemory(vs_code, fs_code); //the result is checked below, when all of them are submitted
+		programs.push_back(program);
+	}
+
+	//wait for the compilation, all the programs submitted are finished even if one fails
+	int num_compiled = 0;
+	int num_errors = 0;
+	for (sAtlasProgram& program : programs)
+	{
+		Shader* shader = program.shader;
+		if (!program.from_cache)
+		{
+			num_compiled++;
+			if (!shader->finishCompile())
+			{
+				s_Shaders.erase(program.name);
+				delete shader;
+				std::cout << " * Compilation error in shader at atlas: " << program.name << std::endl;
+				num_errors++;
+				continue;
 			}
 		}
-		subfile_content += line + "\n";
+
+		shader->vs_filename = program.vs_filename;
+		shader->ps_filename = program.fs_filename;
+		shader->from_atlas = true;
+
+		if (!use_cache)
+			continue;
+		if (program.from_cache)
+			binaries[program.hash] = cache[program.hash];
+		else if (!shader->getBinary(binaries[program.hash].format, binaries[program.hash].data))
+			binaries.erase(program.hash);
 	}
-	s_shaders_atlas[ subfile_name ] = subfile_content;
 
-	//compile shaders
-	std::string shaders = s_shaders_atlas[""];
+	if (use_cache && (num_compiled || binaries.size() != cache.size()))
+		writeBinaryCache(cache_filename, binaries);
+
+	s_binaries = binaries;
+	s_cache_filename = cache_filename;
+	s_driver = driver;
+	s_cache_enabled = use_cache;
+
+	std::cout << " + Shader atlas: " << programs.size() << " programs in " << (getTime() - start_time) << " ms (" << programs.size() - num_compiled << " from the binary cache, " << num_compiled << " compiled" << (parallel ? " in parallel" : "") << "), "
+		<< num_permutations << " with permutations (" << num_variants << " variants from the binary cache)" << std::endl;
+
+	return num_errors == 0;
+}
+
+ShaderPermutations::ShaderPermutations(const std::string& name)
+{
+	this->name = name;
+	keywords = 0;
+	failed = 0;
+	reload_failed = false;
+	for (int i = 0; i < NUM_SHADER_VARIANTS; ++i)
+		variants[i] = NULL;
+}
+
+ShaderPermutations::~ShaderPermutations()
+{
+	release();
+}
+
+void ShaderPermutations::release()
+{
+	for (int i = 0; i < NUM_SHADER_VARIANTS; ++i)
+	{
+		delete variants[i];
+		variants[i] = NULL;
+	}
+	failed = 0;
+}
+
+ShaderPermutations* ShaderPermutations::Get(const char* name)
+{
+	auto it = s_permutations.find(name);
+	return it != s_permutations.end() ? it->second : NULL;
+}
+
+std::string ShaderPermutations::getCode(const std::string& code, int mask)
+{
+	std::string defines;
+	for (int i = 0; i < NUM_SHADER_KEYWORDS; ++i)
+		if (mask & (1 << i))
+			defines += std::string("#define ") + s_keyword_names[i] + "\n";
+
+	size_t pos = code.find("#version");
+	if (pos == std::string::npos)
+		return defines + code;
+	pos = code.find('\n', pos);
+	if (pos == std::string::npos)
+		return code + "\n" + defines;
+	return code.substr(0, pos + 1) + defines + code.substr(pos + 1);
+}
+
+std::string ShaderPermutations::getVariantName(int mask)
+{
+	std::string variant_name = name + " [";
+	for (int i = 0; i < NUM_SHADER_KEYWORDS; ++i)
+		if (mask & (1 << i))
+			variant_name += std::string(variant_name.back() == '[' ? "" : " ") + s_keyword_names[i];
+	return variant_name + "]";
+}
+
+Shader* ShaderPermutations::compileVariant(int mask)
+{
+	if (failed & (1ull << mask))
+		return NULL;
+
+	long start_time = getTime();
+	std::string vs = getCode(vs_code, mask);
+	std::string fs = getCode(fs_code, mask);
+	std::string gs = getGeometryCode(gs_code, mask);
+
+	Shader* shader = variants[mask];
+	if (!shader)
+		shader = variants[mask] = new Shader();
+	if (!shader->compileFromMemory(vs, fs, gs))
+	{
+		std::cout << " * Compilation error in shader variant: " << getVariantName(mask) << std::endl;
+
+		//a hot reload broke the code, the last code that worked keeps rendering until it is fixed
+		bool has_good_code = good_vs_code.size() && (good_vs_code != vs_code || good_fs_code != fs_code || good_gs_code != gs_code);
+		if (has_good_code)
+		{
+			vs = getCode(good_vs_code, mask);
+			fs = getCode(good_fs_code, mask);
+			gs = getGeometryCode(good_gs_code, mask);
+		}
+		if (!has_good_code || !shader->compileFromMemory(vs, fs, gs))
+		{
+			failed |= 1ull << mask;
+			return NULL;
+		}
+		std::cout << " + Shader variant compiled from the previous version of the atlas: " << getVariantName(mask) << std::endl;
+	}
+	else if (good_vs_code.empty())
+	{
+		good_vs_code = vs_code;
+		good_fs_code = fs_code;
+		good_gs_code = gs_code;
+	}
+	shader->from_atlas = true;
+	std::cout << " + Shader variant compiled: " << getVariantName(mask) << " in " << (getTime() - start_time) << " ms" << std::endl;
+
+	//saved so the next runs load it with the atlas
+	if (s_cache_enabled)
+	{
+		uint64_t hash = hashFNV(s_driver, hashFNV(gs, hashFNV(fs, hashFNV(vs))));
+		sProgramBinary& binary = s_binaries[hash];
+		if (shader->getBinary(binary.format, binary.data))
+			writeBinaryCache(s_cache_filename, s_binaries);
+		else
+			s_binaries.erase(hash);
+	}
+	return shader;
+}
+
+void Shader::UpdateHotReload()
+{
+	finishReloads(false);
+
+	if (!s_hot_reload || s_shader_atlas_filename.empty())
+		return;
+
+	static long last_check = 0;
+	long now = getTime();
+	if (now - last_check < HOT_RELOAD_INTERVAL)
+		return;
+	last_check = now;
+
+	//the time has a resolution of seconds and editors may save in several writes,
+	//so the content is also checked during the second after a change
+	time_t time = getModificationTime(s_shader_atlas_filename);
+	if (!time || (time == s_atlas_time && std::time(NULL) - time > 1))
+		return;
+	s_atlas_time = time;
+
+	std::string content;
+	if (!readFile(s_shader_atlas_filename, content))
+		return;
+	uint64_t hash = hashFNV(content);
+	if (hash == s_atlas_hash)
+		return;
+	s_atlas_hash = hash;
+	reloadChangedAtlas(content);
+}
+
+void Shader::reloadChangedAtlas(const std::string& content)
+{
+	std::map<std::string, std::string> sources;
+	std::map<std::string, std::vector<std::string>> includes;
+	parseAtlas(content, sources, includes);
+
+	//sub-files modified (or removed)
+	std::set<std::string> changed;
+	for (auto& it : sources)
+	{
+		auto old = s_atlas_sources.find(it.first);
+		if (old == s_atlas_sources.end() || old->second != it.second)
+			changed.insert(it.first);
+	}
+	for (auto& it : s_atlas_sources)
+		if (!sources.count(it.first))
+			changed.insert(it.first);
+	int num_modified = changed.size();
+
+	//and the ones that include them, following the graph of includes backwards
+	std::map<std::string, std::vector<std::string>> included_by;
+	for (auto& it : includes)
+		for (std::string& include : it.second)
+			included_by[include].push_back(it.first);
+	std::vector<std::string> stack(changed.begin(), changed.end());
+	while (stack.size())
+	{
+		std::string name = stack.back();
+		stack.pop_back();
+		for (std::string& dependent : included_by[name])
+			if (changed.insert(dependent).second)
+				stack.push_back(dependent);
+	}
+
+	s_atlas_sources = sources;
+	s_atlas_includes = includes;
+	resolveAtlas();
 
-	lines = tokenize(shaders, "\n");
+	//programs that use any of them, or whose declaration changed
+	int num_programs = 0;
+	std::vector<std::string> lines = tokenize(s_shaders_atlas[""], "\n");
 	for (int i = 0; i < lines.size(); ++i)
 	{
-		std::string& line = lines[i];
-		line = trim(line);
-		if(line.size() == 0 || line.substr(0,2) == "//")
+		std::string name, vs_filename, fs_filename, macros;
+		if (!parseDeclaration(lines[i], name, vs_filename, fs_filename, macros))
+			continue;
+		std::string declaration = trim(lines[i]);
+		bool layered = macros.size() && macros[0] == '[' && macros.find("LAYERED") != std::string::npos;
+		if (s_atlas_declarations[name] == declaration && !changed.count(vs_filename) && !changed.count(fs_filename) && !(layered && changed.count("layered.gs")))
 			continue;
-		int pos = line.find_first_of(' ');
-		int pos2 = line.find_first_of(' ',pos+1);
-		int pos3 = line.find_first_of(' ',pos2+1);
-		if(pos3 == -1)
-			pos3 = std::string::npos;
-		std::string name = line.substr(0,pos);
-		std::string vs_filename = trim(line.substr(pos+1,pos2 - pos));
-		std::string fs_filename = trim(line.substr(pos2+1,pos3 - pos2));
-		std::string macros = "";
-		if(pos3 != std::string::npos)
-			macros = line.substr(pos3+1);
+		s_atlas_declarations[name] = declaration;
+
 		std::string vs_code = s_shaders_atlas[vs_filename];
 		std::string fs_code = s_shaders_atlas[fs_filename];
-		if(!vs_code.size() || !fs_code.size())
+		if (!vs_code.size() || !fs_code.size())
 		{
 			std::cout << " * Error in shader atlas, couldnt find files for " << name << std::endl;
 			continue;
 		}
 
-		vs_code = macros + "\n" + vs_code;
-		fs_code = macros + "\n" + fs_code;
+		//permutations, the variants in use are compiled again and the others when they are used
+		if (macros.size() && macros[0] == '[')
+		{
+			ShaderPermutations* permutations = ShaderPermutations::Get(name.c_str());
+			if (!permutations)
+			{
+				permutations = new ShaderPermutations(name);
+				ShaderPermutations::s_permutations[name] = permutations;
+			}
+			permutations->vs_code = vs_code;
+			permutations->fs_code = fs_code;
+			permutations->keywords = parseKeywords(macros, name);
+			permutations->gs_code = permutations->keywords & SHADER_LAYERED ? s_shaders_atlas["layered.gs"] : "";
+			permutations->failed = 0;
+			permutations->reload_failed = false;
+
+			for (int mask = 0; mask < NUM_SHADER_VARIANTS; ++mask)
+			{
+				Shader* variant = permutations->variants[mask];
+				if (!variant)
+					continue;
+				if (variant->compiled && !(mask & ~permutations->keywords))
+				{
+					startReload(permutations->getVariantName(mask), variant, false, permutations->getCode(vs_code, mask), permutations->getCode(fs_code, mask), permutations->getGeometryCode(permutations->gs_code, mask), permutations);
+					num_programs++;
+					continue;
+				}
+				cancelReloads(variant);
+				delete variant;
+				permutations->variants[mask] = NULL;
+			}
+			continue;
+		}
 
-		Shader* shader = NULL;
-		auto it = s_Shaders.find( name );
-		if(it == s_Shaders.end())
+		auto it = s_Shaders.find(name);
+		bool is_new = it == s_Shaders.end();
+		startReload(name, is_new ? new Shader() : it->second, is_new, macros + "\n" + vs_code, macros + "\n" + fs_code, "");
+		num_programs++;
+	}
+
+	std::cout << " + Shader atlas changed: " << num_modified << " sub-files modified, " << changed.size() - num_modified << " that include them, " << num_programs << " programs to compile" << std::endl;
+}
+
+void Shader::startReload(const std::string& name, Shader* target, bool is_new, const std::string& vs_code, const std::string& fs_code, const std::string& gs_code, ShaderPermutations* permutations)
+{
+	cancelReloads(target);
+	for (sReloadJob& job : s_reload_jobs)
+		if (job.name == name) //a new program changed again before finishing
 		{
-			shader = new Shader();
-			s_Shaders[ name ] = shader;
+			cancelReloads(job.target);
+			break;
+		}
+
+	sReloadJob job;
+	job.name = name;
+	job.target = target;
+	job.pending = new Shader();
+	job.is_new = is_new;
+	job.hash = hashFNV(s_driver, hashFNV(gs_code, hashFNV(fs_code, hashFNV(vs_code))));
+	job.permutations = permutations;
+
+	//an edit that was undone is still in the cache
+	auto binary = s_binaries.find(job.hash);
+	job.from_cache = s_cache_enabled && binary != s_binaries.end() && job.pending->loadBinary(binary->second.format, binary->second.data);
+	if (!job.from_cache)
+		job.pending->submitFromMemory(vs_code, fs_code, gs_code);
+	s_reload_jobs.push_back(job);
+}
+
+void Shader::finishReloads(bool wait)
+{
+	for (int i = 0; i < s_reload_jobs.size(); ++i)
+	{
+		sReloadJob& job = s_reload_jobs[i];
+
+		//without parallel compilation the driver compiles when asked for the result, so this frame stalls anyway
+		if (!job.from_cache && !wait && s_parallel_compile)
+		{
+			GLint done = 0;
+			glGetProgramiv(job.pending->program, GL_COMPLETION_STATUS_KHR, &done);
+			if (!done)
+				continue;
+		}
+
+		if (job.from_cache || job.pending->finishCompile())
+		{
+			job.target->takeProgram(job.pending);
+			job.target->from_atlas = true;
+			if (job.is_new)
+				s_Shaders[job.name] = job.target;
+			if (s_cache_enabled && !job.from_cache)
+			{
+				sProgramBinary& binary = s_binaries[job.hash];
+				if (job.target->getBinary(binary.format, binary.data))
+					s_cache_dirty = true;
+				else
+					s_binaries.erase(job.hash);
+			}
+			std::cout << " + Shader reloaded: " << job.name << (job.from_cache ? " (from the binary cache)" : "") << std::endl;
 		}
 		else
-			shader = it->second;
-	
-		if (!shader->compileFromMemory(vs_code,fs_code))
 		{
-			delete shader;
-			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
-            return false; //stop here
-			continue;
+			std::cout << " * Compilation error in shader " << job.name << ", the previous version is kept" << std::endl;
+			if (job.is_new)
+				delete job.target;
+			if (job.permutations)
+				job.permutations->reload_failed = true;
 		}
 
-		shader->vs_filename = vs_filename;
-		shader->ps_filename = fs_filename;
-		shader->from_atlas = true;
-		std::cout << " + Shader from atlas: " << name << std::endl;
+		ShaderPermutations* permutations = job.permutations;
+		delete job.pending;
+		s_reload_jobs.erase(s_reload_jobs.begin() + i);
+		--i;
+
+		//when all the variants in use compiled, the new code becomes the one the other variants fall back to
+		if (permutations && !permutations->reload_failed && std::none_of(s_reload_jobs.begin(), s_reload_jobs.end(), [permutations](const sReloadJob& other) { return other.permutations == permutations; }))
+		{
+			permutations->good_vs_code = permutations->vs_code;
+			permutations->good_fs_code = permutations->fs_code;
+			permutations->good_gs_code = permutations->gs_code;
+		}
 	}
 
-	return true;
+	if (s_reload_jobs.empty() && s_cache_dirty)
+	{
+		writeBinaryCache(s_cache_filename, s_binaries);
+		s_cache_dirty = false;
+	}
+}
+
+void Shader::cancelReloads(Shader* target)
+{
+	for (int i = s_reload_jobs.size() - 1; i >= 0; --i)
+	{
+		sReloadJob& job = s_reload_jobs[i];
+		if (target && job.target != target)
+			continue;
+		delete job.pending;
+		if (job.is_new)
+			delete job.target;
+		s_reload_jobs.erase(s_reload_jobs.begin() + i);
+	}
+}
+
+void Shader::takeProgram(Shader* other)
+{
+	release();
+	vs = other->vs;
+	fs = other->fs;
+	gs = other->gs;
+	program = other->program;
+	compiled = other->compiled;
+	other->vs = other->fs = other->gs = other->program = 0;
+	other->compiled = false;
+}
+
+std::string Shader::getBinaryCacheFilename(const char* atlas_filename)
+{
+	std::string filename = atlas_filename;
+	size_t pos = filename.find_last_of('.');
+	if (pos != std::string::npos && filename.find_first_of("/\\", pos) == std::string::npos)
+		filename = filename.substr(0, pos);
+	return filename + ".cache";
 }
 
 bool Shader::compile()
@@ -294,7 +1016,12 @@ bool Shader::hasInfoLog() const
 
 // ******************************************
 
-bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
+bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm)
+{
+	return submitFromMemory(vsm, psm, gsm) && finishCompile();
+}
+
+bool Shader::submitFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm)
 {
 	if (glCreateProgram == 0)
 	{
@@ -305,21 +1032,23 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	program = glCreateProgram();
 	assert (glGetError() == GL_NO_ERROR);
 
-	if (!createVertexShaderObject(vsm))
-	{
-		printf("Vertex shader compilation failed\n");
-		return false;
-	}
+	//the driver only keeps the binary if it is asked before linking
+	if (programBinariesSupported())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 
-	if (!createFragmentShaderObject(psm))
-	{
-		printf("Fragment shader compilation failed\n");
-		return false;
-	}
+	createVertexShaderObject(vsm);
+	createFragmentShaderObject(psm);
+	if (gsm.size())
+		createGeometryShaderObject(gsm);
 
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
+	return true;
+}
+
+bool Shader::finishCompile()
+{
 	GLint linked=0;
     
 	glGetProgramiv(program,GL_LINK_STATUS,&linked);
@@ -327,7 +1056,14 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 
 	if (!linked)
 	{
-		saveProgramInfoLog(program);
+		if (!checkShaderObject(vs))
+			printf("Vertex shader compilation failed\n");
+		else if (!checkShaderObject(fs))
+			printf("Fragment shader compilation failed\n");
+		else if (gs && !checkShaderObject(gs))
+			printf("Geometry shader compilation failed\n");
+		else
+			saveProgramInfoLog(program);
 		release();
 		return false;
 	}
@@ -370,6 +1106,11 @@ bool Shader::createFragmentShaderObject(const std::string& shader)
 	return createShaderObject(GL_FRAGMENT_SHADER,fs,shader);
 }
 
+bool Shader::createGeometryShaderObject(const std::string& shader)
+{
+	return createShaderObject(GL_GEOMETRY_SHADER,gs,shader);
+}
+
 bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code)
 {
 	handle = glCreateShader(type);
@@ -385,6 +1126,14 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	glCompileShader(handle);
 	assert( glGetError() == GL_NO_ERROR );
 
+	glAttachShader(program,handle);
+	assert( glGetError() == GL_NO_ERROR );
+
+	return true;
+}
+
+bool Shader::checkShaderObject(GLuint handle)
+{
 	GLint compile=0;
 	glGetShaderiv(handle,GL_COMPILE_STATUS,&compile);
 	assert( glGetError() == GL_NO_ERROR );
@@ -393,6 +1142,13 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	if (!compile)
 	{
 		saveShaderInfoLog(handle);
+
+		GLint length = 0;
+		glGetShaderiv(handle, GL_SHADER_SOURCE_LENGTH, &length);
+		std::string fullcode(length, '\0');
+		if (length)
+			glGetShaderSource(handle, length, NULL, &fullcode[0]);
+
         std::cout << "Shader code:\n " << std::endl;
 		std::vector<std::string> lines = split( fullcode, '\n' );
 		for( size_t i = 0; i < lines.size(); ++i)
@@ -401,12 +1157,41 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 		return false;
 	}
 
-	glAttachShader(program,handle);
-	assert( glGetError() == GL_NO_ERROR );
+	return true;
+}
+
+//a binary saved by getBinary, the driver rejects it if it changed (the program is compiled again then)
+bool Shader::loadBinary(GLenum format, const std::vector<char>& data)
+{
+	program = glCreateProgram();
+	glProgramBinary(program, format, &data[0], (GLsizei)data.size());
+
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	glGetError(); //a rejected binary may leave an error
+
+	if (!linked)
+	{
+		release();
+		return false;
+	}
 
+	compiled = true;
 	return true;
 }
 
+bool Shader::getBinary(GLenum& format, std::vector<char>& data)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return false;
+
+	data.resize(length);
+	glGetProgramBinary(program, length, NULL, &format, &data[0]);
+	return glGetError() == GL_NO_ERROR;
+}
+
 
 void Shader::release()
 {
@@ -424,6 +1209,13 @@ void Shader::release()
 		fs = 0;
 	}
 
+	if (gs)
+	{
+		glDeleteShader(gs);
+		assert (glGetError() == GL_NO_ERROR);
+		gs = 0;
+	}
+
 	if (program)
 	{
 		glDeleteProgram(program);
@@ -434,6 +1226,8 @@ void Shader::release()
 	locations.clear();
 
 	compiled = false;
+	if (current == this)
+		current = NULL;
 }
 
 
@@ -443,6 +1237,7 @@ void Shader::enable()
 		return;
 
 	current = this;
+	num_binds++;
 
 	glUseProgram(program);
     GLuint err = glGetError();
@@ -565,6 +1360,7 @@ void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
 	glActiveTexture(GL_TEXTURE0 + slot);
 	glBindTexture(tex->texture_type, tex->texture_id);
+	Texture::num_binds++;
 	setUniform1(varname, slot);
 	glActiveTexture(GL_TEXTURE0 + slot);
 }
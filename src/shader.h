@@ -10,18 +10,34 @@
 #include <map>
 #include "framework.h"
 #include <cassert>
+#include <cstdint>
 
 #ifdef _DEBUG
-	#define CHECK_SHADER_VAR(a,b) if (a == -1) return
+	#define CHECK_SHADER_VAR(a,b) do { if (a == -1) return; Shader::num_uniform_uploads++; } while (0)
 	//#define CHECK_SHADER_VAR(a,b) if (a == -1) { std::cout << "Shader error: Var not found in shader: " << b << std::endl; return; } 
 #else
-	#define CHECK_SHADER_VAR(a,b) if (a == -1) return
+	#define CHECK_SHADER_VAR(a,b) do { if (a == -1) return; Shader::num_uniform_uploads++; } while (0)
 #endif
 
 class Texture;
+class ShaderPermutations;
+
+//feature keywords of the permutations of a program, every one is a bit of the mask of a variant
+enum eShaderKeyword {
+	SHADER_SHADOWS = 1 << 0,
+	SHADER_PCF = 1 << 1,		//filtered shadows, needs SHADOWS
+	SHADER_GEOMETRY = 1 << 2,	//deferred lights rendered with their volume instead of a quad
+	SHADER_BLEND = 1 << 3,		//forward lighting of blended materials on top of the deferred frame
+	SHADER_PBR = 1 << 4,
+	SHADER_LAYERED = 1 << 5		//every triangle is sent to several layers of the framebuffer by the geometry shader of the atlas (layered.gs)
+};
+const int NUM_SHADER_KEYWORDS = 6;
+const int NUM_SHADER_VARIANTS = 1 << NUM_SHADER_KEYWORDS;
 
 class Shader
 {
+	friend class ShaderPermutations;
+
 	int last_slot;
 
 	static bool s_ready; //used to initialize shader vars
@@ -29,6 +45,10 @@ class Shader
 public:
 	static Shader* current;
 
+	//render stats, they only grow (see Profiler::sRenderStats)
+	static int64_t num_binds;				//programs enabled (only when the program changes)
+	static int64_t num_uniform_uploads;	//uniforms sent, the missing ones are not counted
+
 	Shader();
 	virtual ~Shader();
 
@@ -39,7 +59,7 @@ public:
 	virtual bool load(const std::string& vsf, const std::string& psf, const char* macros);
 
 	//internal functions
-	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm);
+	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm = "");	//gsm is optional
 	virtual void release();
 	virtual void enable();
 	virtual void disable();
@@ -118,6 +138,17 @@ public:
 	static std::string s_shader_atlas_filename;
 	static std::map<std::string, std::string> s_shaders_atlas; //stores strings, no shaders
 
+	//the programs of the atlas are saved by the driver (glGetProgramBinary) next to the atlas, keyed by a hash of
+	//their code and the driver, so only the ones that changed are compiled again
+	static bool s_use_binary_cache;
+	static std::string getBinaryCacheFilename(const char* atlas_filename);
+
+	//the atlas file is checked every frame (at intervals), when it changes only the programs that use the modified
+	//sub-files (directly or through #includes) are compiled again, in the background. The previous program keeps
+	//rendering until the new one is ready, or for good if the new one does not compile
+	static bool s_hot_reload;
+	static void UpdateHotReload();
+
 	static Shader* getDefaultShader(std::string name);
 
 protected:
@@ -130,7 +161,23 @@ protected:
 
 	bool createVertexShaderObject(const std::string& shader);
 	bool createFragmentShaderObject(const std::string& shader);
+	bool createGeometryShaderObject(const std::string& shader);
 	bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
+	bool checkShaderObject(GLuint handle);
+
+	//compileFromMemory in two steps: submit does not wait for the driver, so several programs can compile in parallel
+	bool submitFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm = "");
+	bool finishCompile();
+
+	bool loadBinary(GLenum format, const std::vector<char>& data);
+	bool getBinary(GLenum& format, std::vector<char>& data);
+
+	//hot reload, the programs compiled in the background replace the ones of their target when they finish
+	static void reloadChangedAtlas(const std::string& content);
+	static void startReload(const std::string& name, Shader* target, bool is_new, const std::string& vs_code, const std::string& fs_code, const std::string& gs_code, ShaderPermutations* permutations = NULL);
+	static void finishReloads(bool wait);
+	static void cancelReloads(Shader* target = NULL);	//NULL for all of them
+	void takeProgram(Shader* other);
 	void saveShaderInfoLog(GLuint obj);
 	void saveProgramInfoLog(GLuint obj);
 
@@ -138,6 +185,7 @@ protected:
 
 	GLuint vs;
 	GLuint fs;
+	GLuint gs;			//0 for the programs without geometry shader
 	GLuint program;
 	std::string log;
 
@@ -158,4 +206,48 @@ public:
 	loctable locations;	
 };
 
+// A program of the atlas declared with feature keywords: "name vs fs [SHADOWS PCF ...]".
+// Every combination of its keywords (variant) is the same code with a #define per keyword enabled,
+// the variants are indexed by the mask so the render loop gets them without string lookups.
+// The variants in the binary cache are loaded with the atlas, the others are compiled the first time they are used.
+// After a hot reload that breaks the code, the variants not used yet are compiled from the last code that worked
+class ShaderPermutations
+{
+public:
+	std::string name;
+	std::string vs_code;
+	std::string fs_code;
+	std::string gs_code;				//layered.gs of the atlas when LAYERED is declared, only the LAYERED variants use it
+	std::string good_vs_code;			//last code whose variants in use compiled, empty until one compiles
+	std::string good_fs_code;
+	std::string good_gs_code;
+	bool reload_failed;					//a variant of the current hot reload did not compile
+	int keywords;						//mask of the keywords declared, the other bits of a mask are ignored
+	Shader* variants[NUM_SHADER_VARIANTS];
+	uint64_t failed;					//bit per variant that did not compile, they are not tried again until the atlas is reloaded
+
+	ShaderPermutations(const std::string& name);
+	~ShaderPermutations();
+
+	//NULL if the variant does not compile
+	Shader* get(int mask) {
+		mask &= keywords;
+		Shader* shader = variants[mask];
+		return shader && shader->compiled ? shader : compileVariant(mask);
+	}
+
+	//code of a variant, the #defines go after the #version line
+	std::string getCode(const std::string& code, int mask);
+	std::string getGeometryCode(const std::string& code, int mask) { return mask & SHADER_LAYERED ? getCode(code, mask) : ""; } //empty without LAYERED
+	std::string getVariantName(int mask);
+	void release();
+
+	static ShaderPermutations* Get(const char* name);
+	static std::map<std::string, ShaderPermutations*> s_permutations;
+	static const char* s_keyword_names[NUM_SHADER_KEYWORDS];
+
+private:
+	Shader* compileVariant(int mask);
+};
+
 #endif
\ No newline at end of file
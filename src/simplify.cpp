@@ -0,0 +1,511 @@
+#include "simplify.h"
+#include "mesh.h"
+#include "prefab.h"
+#include "gltf_loader.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+using namespace GTR;
+
+//a new triangle that turns more than this (cosine) is a flip or a sliver, the collapse is not done
+const float SIMPLIFY_MIN_NORMAL_DOT = 0.2f;
+//weight of the planes that keep the seams and the borders in place
+const double SIMPLIFY_EDGE_WEIGHT = 4.0;
+
+void MeshSimplifier::sQuadric::clear()
+{
+	memset(a, 0, sizeof(a));
+}
+
+void MeshSimplifier::sQuadric::addPlane(const Vector3& n, double d, double weight)
+{
+	a[0] += weight * n.x * n.x; a[1] += weight * n.x * n.y; a[2] += weight * n.x * n.z; a[3] += weight * n.x * d;
+	a[4] += weight * n.y * n.y; a[5] += weight * n.y * n.z; a[6] += weight * n.y * d;
+	a[7] += weight * n.z * n.z; a[8] += weight * n.z * d;
+	a[9] += weight * d * d;
+}
+
+void MeshSimplifier::sQuadric::add(const sQuadric& q)
+{
+	for (int i = 0; i < 10; ++i)
+		a[i] += q.a[i];
+}
+
+double MeshSimplifier::sQuadric::evaluate(const Vector3& p) const
+{
+	double x = p.x, y = p.y, z = p.z;
+	return a[0] * x * x + 2.0 * a[1] * x * y + 2.0 * a[2] * x * z + 2.0 * a[3] * x
+		+ a[4] * y * y + 2.0 * a[5] * y * z + 2.0 * a[6] * y
+		+ a[7] * z * z + 2.0 * a[8] * z
+		+ a[9];
+}
+
+MeshSimplifier::MeshSimplifier()
+{
+	num_triangles = 0;
+	error = 0.0f;
+}
+
+//key of a position, the vertices in the same place are the same point of the surface
+struct sPositionKey {
+	unsigned int bits[3];
+	bool operator == (const sPositionKey& k) const { return bits[0] == k.bits[0] && bits[1] == k.bits[1] && bits[2] == k.bits[2]; }
+};
+
+struct sPositionKeyHash {
+	size_t operator()(const sPositionKey& k) const { return (k.bits[0] * 73856093u) ^ (k.bits[1] * 19349663u) ^ (k.bits[2] * 83492791u); }
+};
+
+static Vector3 triangleNormal(const Vector3& a, const Vector3& b, const Vector3& c)
+{
+	return (b - a).cross(c - a);
+}
+
+void MeshSimplifier::init(const std::vector<Vector3>& mesh_positions, const std::vector<Vector3u>& mesh_triangles)
+{
+	vertex_ids.clear();
+	vertex_positions.clear();
+	positions.clear();
+	triangles.clear();
+	heap.clear();
+	error = 0.0f;
+
+	//only the vertices used, welded by position
+	std::unordered_map<unsigned int, unsigned int> local_vertices;
+	std::unordered_map<sPositionKey, unsigned int, sPositionKeyHash> welded;
+	triangles.reserve(mesh_triangles.size());
+	for (const Vector3u& mesh_triangle : mesh_triangles)
+	{
+		Vector3u t;
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int id = mesh_triangle.v[k];
+			auto it = local_vertices.find(id);
+			if (it == local_vertices.end())
+			{
+				sPositionKey key;
+				memcpy(key.bits, &mesh_positions[id], sizeof(key.bits));
+				auto position = welded.insert(std::make_pair(key, (unsigned int)positions.size()));
+				if (position.second)
+					positions.push_back(mesh_positions[id]);
+
+				it = local_vertices.insert(std::make_pair(id, (unsigned int)vertex_ids.size())).first;
+				vertex_ids.push_back(id);
+				vertex_positions.push_back(position.first->second);
+			}
+			t.v[k] = it->second;
+		}
+
+		//degenerated, two corners in the same place
+		if (getPosition(t, 0) == getPosition(t, 1) || getPosition(t, 1) == getPosition(t, 2) || getPosition(t, 2) == getPosition(t, 0))
+			continue;
+		triangles.push_back(t);
+	}
+
+	int num_positions = (int)positions.size();
+	removed_triangles.assign(triangles.size(), false);
+	position_triangles.assign(num_positions, std::vector<unsigned int>());
+	quadrics.resize(num_positions);
+	for (sQuadric& q : quadrics)
+		q.clear();
+	special.assign(num_positions, false);
+	locked.assign(num_positions, false);
+	versions.assign(num_positions, 0);
+	num_triangles = (int)triangles.size();
+
+	//plane of every triangle in the quadric of its positions
+	for (unsigned int i = 0; i < triangles.size(); ++i)
+	{
+		const Vector3u& t = triangles[i];
+		for (int k = 0; k < 3; ++k)
+			position_triangles[getPosition(t, k)].push_back(i);
+
+		Vector3 normal = triangleNormal(positions[getPosition(t, 0)], positions[getPosition(t, 1)], positions[getPosition(t, 2)]);
+		double length = normal.length();
+		if (length < 1e-12)
+			continue;
+		normal = normal * (float)(1.0 / length);
+		double d = -normal.dot(positions[getPosition(t, 0)]);
+		for (int k = 0; k < 3; ++k)
+			quadrics[getPosition(t, k)].addPlane(normal, d);
+	}
+
+	//seams and borders: a plane through the edge, perpendicular to the triangle, keeps the edge where it is
+	std::vector<unsigned int> neighbours;
+	for (int a = 0; a < num_positions; ++a)
+	{
+		int special_edges = 0;
+		getNeighbours(a, neighbours);
+		for (unsigned int b : neighbours)
+		{
+			if (!isSpecialEdge(a, b))
+				continue;
+			special_edges++;
+			for (unsigned int index : position_triangles[a])
+			{
+				const Vector3u& t = triangles[index];
+				if (!hasPosition(t, b))
+					continue;
+				Vector3 normal = triangleNormal(positions[getPosition(t, 0)], positions[getPosition(t, 1)], positions[getPosition(t, 2)]);
+				Vector3 plane = (positions[b] - positions[a]).cross(normal);
+				double length = plane.length();
+				if (length < 1e-12)
+					continue;
+				plane = plane * (float)(1.0 / length);
+				quadrics[a].addPlane(plane, -plane.dot(positions[a]), SIMPLIFY_EDGE_WEIGHT);
+			}
+		}
+
+		//the ends of the seams and borders, and where several of them meet, do not move
+		special[a] = special_edges > 0;
+		if (special_edges && special_edges != 2)
+			locked[a] = true;
+	}
+
+	for (int i = 0; i < num_positions; ++i)
+		pushCollapses(i);
+}
+
+int MeshSimplifier::simplify(int target_triangles, float max_error)
+{
+	std::vector< std::pair<unsigned int, unsigned int> > vertex_remap;
+	while (num_triangles > target_triangles && heap.size())
+	{
+		std::pop_heap(heap.begin(), heap.end());
+		sCollapse c = heap.back();
+
+		//one of the ends changed after it was added, there is a newer one
+		if (versions[c.from] != c.version_from || versions[c.to] != c.version_to)
+		{
+			heap.pop_back();
+			continue;
+		}
+
+		//the cheapest one is over the error, it stays for the next call
+		float collapse_error = (float)sqrt(std::max(c.cost, 0.0));
+		if (max_error > 0.0f && collapse_error > max_error)
+		{
+			std::push_heap(heap.begin(), heap.end());
+			break;
+		}
+		heap.pop_back();
+
+		if (!canCollapse(c.from, c.to, vertex_remap))
+			continue;
+		collapse(c.from, c.to, vertex_remap);
+		error = std::max(error, collapse_error);
+	}
+	return num_triangles;
+}
+
+void MeshSimplifier::getTriangles(std::vector<Vector3u>& result)
+{
+	result.clear();
+	result.reserve(num_triangles);
+	for (unsigned int i = 0; i < triangles.size(); ++i)
+		if (!removed_triangles[i])
+		{
+			const Vector3u& t = triangles[i];
+			result.push_back(Vector3u(vertex_ids[t.x], vertex_ids[t.y], vertex_ids[t.z]));
+		}
+}
+
+void MeshSimplifier::pushCollapses(unsigned int position)
+{
+	std::vector<unsigned int> neighbours;
+	getNeighbours(position, neighbours);
+	for (unsigned int neighbour : neighbours)
+	{
+		pushCollapse(position, neighbour);
+		pushCollapse(neighbour, position);
+	}
+}
+
+void MeshSimplifier::pushCollapse(unsigned int from, unsigned int to)
+{
+	if (locked[from] || (special[from] && !isSpecialEdge(from, to)))
+		return;
+
+	sQuadric q = quadrics[from];
+	q.add(quadrics[to]);
+
+	sCollapse c;
+	c.cost = q.evaluate(positions[to]);
+	c.from = from;
+	c.to = to;
+	c.version_from = versions[from];
+	c.version_to = versions[to];
+	heap.push_back(c);
+	std::push_heap(heap.begin(), heap.end());
+}
+
+void MeshSimplifier::getNeighbours(unsigned int position, std::vector<unsigned int>& neighbours)
+{
+	neighbours.clear();
+	for (unsigned int index : position_triangles[position])
+	{
+		if (removed_triangles[index])
+			continue;
+		const Vector3u& t = triangles[index];
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int p = getPosition(t, k);
+			if (p != position && std::find(neighbours.begin(), neighbours.end(), p) == neighbours.end())
+				neighbours.push_back(p);
+		}
+	}
+}
+
+//a border (one triangle), a non manifold edge (more than two) or a seam (the triangles use different vertices)
+bool MeshSimplifier::isSpecialEdge(unsigned int a, unsigned int b)
+{
+	int count = 0;
+	unsigned int vertices_a[2], vertices_b[2];
+	for (unsigned int index : position_triangles[a])
+	{
+		const Vector3u& t = triangles[index];
+		if (removed_triangles[index] || !hasPosition(t, b))
+			continue;
+		if (count < 2)
+			for (int k = 0; k < 3; ++k)
+			{
+				if (getPosition(t, k) == a)
+					vertices_a[count] = t.v[k];
+				else if (getPosition(t, k) == b)
+					vertices_b[count] = t.v[k];
+			}
+		count++;
+	}
+	if (count != 2)
+		return true;
+	return vertices_a[0] != vertices_a[1] || vertices_b[0] != vertices_b[1];
+}
+
+bool MeshSimplifier::canCollapse(unsigned int from, unsigned int to, std::vector< std::pair<unsigned int, unsigned int> >& vertex_remap)
+{
+	if (locked[from] || (special[from] && !isSpecialEdge(from, to)))
+		return false;
+
+	//every vertex of from goes to the vertex of to in the same triangle of the edge, so the attributes stay
+	//continuous (a seam vertex moves with its side of the seam)
+	vertex_remap.clear();
+	int edge_triangles = 0;
+	for (unsigned int index : position_triangles[from])
+	{
+		const Vector3u& t = triangles[index];
+		if (removed_triangles[index] || !hasPosition(t, to))
+			continue;
+		edge_triangles++;
+
+		unsigned int vertex_from = 0, vertex_to = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			if (getPosition(t, k) == from)
+				vertex_from = t.v[k];
+			else if (getPosition(t, k) == to)
+				vertex_to = t.v[k];
+		}
+		auto it = std::find_if(vertex_remap.begin(), vertex_remap.end(), [&](const std::pair<unsigned int, unsigned int>& r) { return r.first == vertex_from; });
+		if (it == vertex_remap.end())
+			vertex_remap.push_back(std::make_pair(vertex_from, vertex_to));
+		else if (it->second != vertex_to)
+			return false;
+	}
+	if (!edge_triangles)
+		return false;
+
+	for (unsigned int index : position_triangles[from])
+	{
+		const Vector3u& t = triangles[index];
+		if (removed_triangles[index] || hasPosition(t, to))
+			continue;
+		for (int k = 0; k < 3; ++k)
+			if (getPosition(t, k) == from && std::find_if(vertex_remap.begin(), vertex_remap.end(), [&](const std::pair<unsigned int, unsigned int>& r) { return r.first == t.v[k]; }) == vertex_remap.end())
+				return false; //a vertex of from that does not touch the edge
+	}
+
+	//link condition: the only positions around both ends are the ones of the triangles of the edge, otherwise
+	//the surface would fold over itself
+	std::vector<unsigned int> from_neighbours, to_neighbours;
+	getNeighbours(from, from_neighbours);
+	getNeighbours(to, to_neighbours);
+	int shared = 0;
+	for (unsigned int neighbour : from_neighbours)
+		if (std::find(to_neighbours.begin(), to_neighbours.end(), neighbour) != to_neighbours.end())
+			shared++;
+	if (shared != edge_triangles)
+		return false;
+
+	//the triangles that stay must not flip
+	for (unsigned int index : position_triangles[from])
+	{
+		const Vector3u& t = triangles[index];
+		if (removed_triangles[index] || hasPosition(t, to))
+			continue;
+
+		Vector3 p[3];
+		for (int k = 0; k < 3; ++k)
+			p[k] = positions[getPosition(t, k)];
+		Vector3 before = triangleNormal(p[0], p[1], p[2]);
+		for (int k = 0; k < 3; ++k)
+			if (getPosition(t, k) == from)
+				p[k] = positions[to];
+		Vector3 after = triangleNormal(p[0], p[1], p[2]);
+
+		double length = before.length() * after.length();
+		if (length < 1e-20 || before.dot(after) < SIMPLIFY_MIN_NORMAL_DOT * length)
+			return false;
+	}
+	return true;
+}
+
+void MeshSimplifier::collapse(unsigned int from, unsigned int to, const std::vector< std::pair<unsigned int, unsigned int> >& vertex_remap)
+{
+	for (unsigned int index : position_triangles[from])
+	{
+		if (removed_triangles[index])
+			continue;
+		Vector3u& t = triangles[index];
+		if (hasPosition(t, to))
+		{
+			removed_triangles[index] = true;
+			num_triangles--;
+			continue;
+		}
+		for (int k = 0; k < 3; ++k)
+			if (getPosition(t, k) == from)
+				for (const std::pair<unsigned int, unsigned int>& remap : vertex_remap)
+					if (remap.first == t.v[k])
+					{
+						t.v[k] = remap.second;
+						break;
+					}
+		position_triangles[to].push_back(index);
+	}
+	position_triangles[from].clear();
+
+	//the triangles that are gone are not needed anymore
+	std::vector<unsigned int>& around = position_triangles[to];
+	around.erase(std::remove_if(around.begin(), around.end(), [&](unsigned int index) { return removed_triangles[index]; }), around.end());
+
+	quadrics[to].add(quadrics[from]);
+	versions[from]++;
+	versions[to]++;
+	pushCollapses(to);
+}
+
+//meshes of the prefab, without repeating the instanced ones
+static void getPrefabMeshes(Node* node, std::vector<Mesh*>& meshes, std::set<Mesh*>& added)
+{
+	if (node->mesh && added.insert(node->mesh).second)
+		meshes.push_back(node->mesh);
+	for (Node* child : node->children)
+		getPrefabMeshes(child, meshes, added);
+}
+
+static int getNumTriangles(Mesh* mesh)
+{
+	return mesh->indices.size() ? (int)mesh->indices.size() : (int)mesh->getNumVertices() / 3;
+}
+
+int GTR::simplifyPrefabs(const char* folder)
+{
+	//only the meshes are needed
+	Mesh::auto_upload_to_vram = false;
+	Mesh::use_binary = true;
+	Mesh::generate_lods = true;
+	Mesh::rebuild_bins = true;
+	load_textures = false;
+
+	std::vector<std::string> prefabs = listFolder(folder, true);
+	if (prefabs.empty())
+	{
+		std::cout << "[ERROR]: no prefabs found in " << folder << std::endl;
+		return 1;
+	}
+
+	int num_errors = 0;
+	for (std::string& name : prefabs)
+	{
+		std::string filename = std::string(folder) + "/" + name + "/scene.gltf";
+		FILE* file = fopen(filename.c_str(), "rb");
+		if (!file)
+			continue;
+		fclose(file);
+
+		std::cout << " + Simplifying " << filename << std::endl;
+		long start = getTime();
+		Prefab* prefab = loadGLTF(filename.c_str());
+		if (!prefab)
+		{
+			num_errors++;
+			continue;
+		}
+
+		std::vector<Mesh*> meshes;
+		std::set<Mesh*> added;
+		getPrefabMeshes(&prefab->root, meshes, added);
+		for (Mesh* mesh : meshes)
+		{
+			std::cout << "\t" << mesh->name << ": " << getNumTriangles(mesh);
+			for (int i = 0; i < mesh->lods.size(); ++i)
+				std::cout << " > " << getNumTriangles(mesh->lods[i]) << " (" << mesh->lod_errors[i] << ")";
+			std::cout << std::endl;
+		}
+		std::cout << "\t" << meshes.size() << " meshes in " << (getTime() - start) << " ms" << std::endl;
+	}
+	return num_errors ? 1 : 0;
+}
+
+int GTR::benchmarkSimplifier(const char* filename)
+{
+	Mesh::auto_upload_to_vram = false;
+	Mesh::generate_lods = false;
+	load_textures = false;
+
+	Prefab* prefab = loadGLTF(filename);
+	if (!prefab)
+		return 1;
+
+	std::vector<Mesh*> meshes;
+	std::set<Mesh*> added;
+	getPrefabMeshes(&prefab->root, meshes, added);
+	int num_triangles = 0;
+	for (Mesh* mesh : meshes)
+		num_triangles += getNumTriangles(mesh);
+	int num_cores = std::max(1, (int)std::thread::hardware_concurrency());
+	std::cout << " + Benchmark " << filename << ": " << meshes.size() << " meshes, " << num_triangles << " triangles, " << num_cores << " cores" << std::endl;
+
+	//a ratio of 0 simplifies by error: 0.1% of the radius of every mesh
+	const float ratios[] = { 0.5f, 0.25f, 0.1f, 0.02f, 0.0f };
+	for (float ratio : ratios)
+	{
+		const int threads[] = { 1, num_cores };
+		for (int t = 0; t < (num_cores > 1 ? 2 : 1); ++t)
+		{
+			Mesh::simplify_threads = threads[t];
+			int result_triangles = 0;
+			float max_error = 0.0f;
+			long start = getTime();
+			for (Mesh* mesh : meshes)
+			{
+				float error = 0.0f;
+				Mesh* simplified = ratio ? mesh->simplify((int)(getNumTriangles(mesh) * ratio), 0.0f, &error) : mesh->simplify(0, mesh->radius * 0.001f, &error);
+				result_triangles += getNumTriangles(simplified);
+				max_error = std::max(max_error, error);
+				delete simplified;
+			}
+			long time = getTime() - start;
+			std::cout << "\t" << (ratio ? std::to_string((int)(ratio * 100)) + "%" : std::string("error")) << " threads " << threads[t] << ": " << result_triangles << " triangles, error " << max_error << ", " << time << " ms" << std::endl;
+		}
+	}
+	Mesh::simplify_threads = 0;
+	return 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "framework.h"
+
+#include <vector>
+
+namespace GTR {
+
+	// Quadric error metric simplification (Garland and Heckbert): every position accumulates the planes of its
+	// triangles and the edges that move the surface the least are collapsed first. A collapse moves one end of the
+	// edge onto the other one (half edge), so the simplified triangles still index the vertices of the mesh and keep
+	// their attributes.
+	// The vertices in the same position with different attributes (UV or normal seams) move together, and only along
+	// the seam, like the borders. Both have extra planes through the edges so they keep their shape. The ends of a seam
+	// or a border (more than two of these edges in a position) and the non manifold edges never move
+	class MeshSimplifier
+	{
+	public:
+		//symmetric 4x4 matrix, the sum of the squared distances to the planes
+		struct sQuadric {
+			double a[10];
+			void clear();
+			void addPlane(const Vector3& normal, double d, double weight = 1.0);
+			void add(const sQuadric& q);
+			double evaluate(const Vector3& p) const;
+		};
+
+		//move the position from onto the position to
+		struct sCollapse {
+			double cost;
+			unsigned int from;
+			unsigned int to;
+			unsigned int version_from;
+			unsigned int version_to;
+			bool operator < (const sCollapse& c) const { return cost > c.cost; } //cheapest first in the heap
+		};
+
+		std::vector<unsigned int> vertex_ids;					//index in the mesh of every vertex
+		std::vector<unsigned int> vertex_positions;				//position of every vertex
+		std::vector<Vector3> positions;
+		std::vector<Vector3u> triangles;						//indices of the vertices
+		std::vector<bool> removed_triangles;
+		std::vector< std::vector<unsigned int> > position_triangles;	//triangles around every position (some may not be valid anymore)
+		std::vector<sQuadric> quadrics;
+		std::vector<bool> special;								//seams and borders, only move along them
+		std::vector<bool> locked;
+		std::vector<unsigned int> versions;						//changes every time the position changes, to discard old collapses
+		std::vector<sCollapse> heap;
+
+		int num_triangles;			//triangles left
+		float error;				//distance (mesh units) of the worst collapse done
+
+		MeshSimplifier();
+
+		//the vertices with the same attributes must be welded before (the same index for the same vertex), only the
+		//vertices used by the triangles are kept
+		void init(const std::vector<Vector3>& mesh_positions, const std::vector<Vector3u>& mesh_triangles);
+		//collapses edges until there are target_triangles left, the next collapse moves the surface more than max_error
+		//(0 for no limit) or nothing else can be collapsed. Returns the triangles left
+		int simplify(int target_triangles, float max_error = 0.0f);
+		//triangles left, with the indices of the mesh
+		void getTriangles(std::vector<Vector3u>& result);
+
+	private:
+		unsigned int getPosition(const Vector3u& t, int k) { return vertex_positions[t.v[k]]; }
+		bool hasPosition(const Vector3u& t, unsigned int position) { return getPosition(t, 0) == position || getPosition(t, 1) == position || getPosition(t, 2) == position; }
+		void pushCollapses(unsigned int position);
+		void pushCollapse(unsigned int from, unsigned int to);
+		bool isSpecialEdge(unsigned int a, unsigned int b);
+		bool canCollapse(unsigned int from, unsigned int to, std::vector< std::pair<unsigned int, unsigned int> >& vertex_remap);
+		void collapse(unsigned int from, unsigned int to, const std::vector< std::pair<unsigned int, unsigned int> >& vertex_remap);
+		void getNeighbours(unsigned int position, std::vector<unsigned int>& neighbours);
+	};
+
+	//command line tools, they do not need a window and return the exit code
+	//--simplify [folder]: generates the levels of detail of every prefab in the folder and writes their bins
+	int simplifyPrefabs(const char* folder = "data/prefabs");
+	//--simplify-benchmark [file.gltf]: times the simplification of the meshes of a prefab with one thread and all of them
+	int benchmarkSimplifier(const char* filename = "data/prefabs/gmc/scene.gltf");
+
+};
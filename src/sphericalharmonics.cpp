@@ -1,4 +1,5 @@
 #include "sphericalharmonics.h"
+#include "trace.h"
 
 //system axis
 Vector3 cubemapFaceNormals[6][3] = {
@@ -43,6 +44,7 @@ float texelSolidAngle(float aU, float aV, float width, float height) {
 // give me a cubemap, its size and number of channels
 // and i'll give you spherical harmonics
 SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
+    TRACE_SCOPE("computeSH");
     int size = images[0].width;
     int channels = 3;
     SphericalHarmonics sh;
@@ -122,3 +124,30 @@ SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
         linear_sh.coeffs[i] = sh.coeffs[i] * (4 * PI / weightAccum);
     return linear_sh;
 }
+
+// evaluates the irradiance of the SH in the direction of the normal (cosine lobe convolution)
+Vector3 computeSHIrradiance( const SphericalHarmonics& sh, Vector3 normal ) {
+    const float cosineA0 = PI;
+    const float cosineA1 = (2.0f * PI) / 3.0f;
+    const float cosineA2 = PI * 0.25f;
+    float dx = normal.x;
+    float dy = normal.y;
+    float dz = normal.z;
+
+    float lobe[sh_length] = {
+        0.282095f * cosineA0,
+        0.488603f * dy * cosineA1,
+        0.488603f * dz * cosineA1,
+        0.488603f * dx * cosineA1,
+        1.092548f * dx * dy * cosineA2,
+        1.092548f * dy * dz * cosineA2,
+        0.315392f * (3.0f * dz * dz - 1.0f) * cosineA2,
+        1.092548f * dx * dz * cosineA2,
+        0.546274f * (dx * dx - dy * dy) * cosineA2
+    };
+
+    Vector3 irradiance;
+    for (int i = 0; i < sh_length; i++)
+        irradiance += sh.coeffs[i] * lobe[i];
+    return irradiance;
+}
@@ -10,3 +10,4 @@ struct SphericalHarmonics {
 };
 
 SphericalHarmonics computeSH( FloatImage images[], bool degamma = false);
+Vector3 computeSHIrradiance( const SphericalHarmonics& sh, Vector3 normal ); //same as ComputeSHIrradiance in the shaders
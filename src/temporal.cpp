@@ -0,0 +1,46 @@
+#include "temporal.h"
+#include "texture.h"
+
+using namespace GTR;
+
+TemporalHistory::TemporalHistory()
+{
+	fbos[0] = fbos[1] = NULL;
+	index = 0;
+	valid = false;
+}
+
+TemporalHistory::~TemporalHistory()
+{
+	delete fbos[0];
+	delete fbos[1];
+}
+
+void TemporalHistory::prepare(int width, int height, int format, int type, int filter)
+{
+	for (int i = 0; i < 2; ++i)
+	{
+		FBO* fbo = fbos[i];
+		if (fbo && fbo->width == width && fbo->height == height && fbo->color_textures[0]->format == format && fbo->color_textures[0]->type == type)
+			continue;
+
+		if (!fbo)
+			fbo = fbos[i] = new FBO();
+		fbo->create(width, height, 1, format, type, false);
+
+		//the history is sampled in the reprojected position, usually between texels
+		Texture* texture = fbo->color_textures[0];
+		texture->bind();
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+		texture->unbind();
+
+		valid = false;
+	}
+}
+
+void TemporalHistory::update(const Matrix44& viewprojection)
+{
+	prev_viewprojection = viewprojection;
+	valid = true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "includes.h"
+#include "framework.h"
+#include "fbo.h"
+
+namespace GTR {
+
+	// History of a temporal accumulation (TAA, ssao, volumetrics...): two targets used as ping-pong,
+	// the one written this frame reads the other one reprojected with the viewprojection of the last frame.
+	// It is kept between frames, so it is not part of the render graph
+	class TemporalHistory
+	{
+	public:
+		FBO* fbos[2];
+		int index;						//fbos with the last result
+		bool valid;						//false when there is nothing accumulated (first frame, resized, toggled...)
+		Matrix44 prev_viewprojection;
+
+		TemporalHistory();
+		~TemporalHistory();
+
+		//creates the targets if needed, if they change the history is lost
+		void prepare(int width, int height, int format = GL_RGBA, int type = GL_HALF_FLOAT, int filter = GL_LINEAR);
+
+		//starts a new frame, current() is written reading previous()
+		void swap() { index = 1 - index; }
+		FBO* current() { return fbos[index]; }
+		FBO* previous() { return fbos[1 - index]; }
+		Texture* result() { return fbos[index] ? fbos[index]->color_textures[0] : NULL; }
+
+		//the frame is done, viewprojection is the one used to reproject the next frame
+		void update(const Matrix44& viewprojection);
+		void invalidate() { valid = false; }
+	};
+
+};
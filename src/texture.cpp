@@ -8,6 +8,7 @@
 #include "mesh.h"
 #include "shader.h"
 #include "extra/picopng.h"
+#include "trace.h"
 #include <cassert>
 
 //bilinear interpolation
@@ -41,6 +42,8 @@ Vector4 Image::getPixelInterpolatedHigh(float x, float y, bool repeat) {
 
 
 std::map<std::string, Texture*> Texture::sTexturesLoaded;
+int64_t Texture::num_binds = 0;
+int64_t Texture::num_blits = 0;
 int Texture::default_mag_filter = GL_LINEAR;
 int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 FBO* Texture::global_fbo = NULL;
@@ -142,6 +145,39 @@ void Texture::create3D(unsigned int width, unsigned int height, unsigned int dep
 	upload3D(format, type, mipmaps, data, internal_format);
 }
 
+void Texture::create2DArray(unsigned int width, unsigned int height, unsigned int layers, unsigned int format, unsigned int type, unsigned int internal_format)
+{
+	assert(width && height && layers && "texture must have a size");
+
+	if (internal_format == 0 && type == GL_FLOAT)
+		internal_format = format == GL_RGB ? GL_RGB32F : GL_RGBA32F;
+	else if (internal_format == 0 && type == GL_HALF_FLOAT)
+		internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+
+	this->width = (float)width;
+	this->height = (float)height;
+	this->depth = (float)layers;
+	this->format = format;
+	this->internal_format = internal_format;
+	this->type = type;
+	this->mipmaps = false;
+
+	if (this->texture_id != 0)
+		clear();
+
+	this->texture_type = GL_TEXTURE_2D_ARRAY;
+	glGenTextures(1, &texture_id);
+
+	glBindTexture(this->texture_type, texture_id);
+	glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, layers, 0, format, type, NULL);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error creating texture");
+}
+
 void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 {
 	assert(width && height && "texture must have a size");
@@ -187,6 +223,7 @@ Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
 
 bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int type)
 {
+	TRACE_SCOPE_DETAIL("Texture::load", filename);
 	std::string str = filename;
 	std::string ext = str.substr(str.size() - 4, 4);
 	Image* image = NULL;
@@ -409,6 +446,7 @@ void Texture::bind()
 {
 	//glEnable(this->texture_type); //enable the textures 
 	glBindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
+	num_binds++;
 }
 
 void Texture::unbind()
@@ -479,6 +517,7 @@ Texture* Texture::getWhiteTexture()
 
 void Texture::copyTo(Texture* destination, Shader* shader)
 {
+	num_blits++;
 	if (!destination)
 	{
 		glDepthFunc(GL_ALWAYS);
@@ -665,10 +704,7 @@ bool Image::saveTGA(const char* filename, bool flip_y)
 
 	FILE *file = fopen(filename, "wb");
 	if (file == NULL)
-	{
-		fclose(file);
 		return false;
-	}
 
 	unsigned short header_short[3];
 	header_short[0] = width;
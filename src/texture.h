@@ -9,6 +9,7 @@
 #include <map>
 #include <string>
 #include <cassert>
+#include <cstdint>
 
 class Shader;
 class FBO;
@@ -94,6 +95,10 @@ public:
 	//textures manager
 	static std::map<std::string, Texture*> sTexturesLoaded;
 
+	//render stats, they only grow (see Profiler::sRenderStats)
+	static int64_t num_binds;
+	static int64_t num_blits;		//copies between textures (copyTo) and framebuffer blits
+
 	GLuint texture_id; // GL id to identify the texture in opengl, every texture must have its own id
 	float width;
 	float height;
@@ -122,6 +127,7 @@ public:
 	void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void createCubemap(unsigned int width, unsigned int height, Uint8** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = GL_RGBA32F);
+	void create2DArray(unsigned int width, unsigned int height, unsigned int layers, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, unsigned int internal_format = 0); //empty, to render to its layers
 
 	void upload(Image* img);
 	void upload(FloatImage* img);
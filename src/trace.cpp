@@ -0,0 +1,157 @@
+#include "trace.h"
+#include "includes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+using namespace GTR;
+
+std::atomic<bool> Tracer::enabled(false);
+std::mutex Tracer::mutex;
+std::vector<Tracer::sThreadBuffer*> Tracer::buffers;
+std::set<std::string> Tracer::names;
+
+static const std::chrono::steady_clock::time_point trace_start = std::chrono::steady_clock::now();
+
+double Tracer::getTime()
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - trace_start).count();
+}
+
+Tracer::sThreadBuffer* Tracer::getThreadBuffer()
+{
+	thread_local sThreadBuffer* buffer = NULL;
+	if (!buffer)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		buffer = new sThreadBuffer();
+		buffer->thread_id = (int)buffers.size();
+		buffer->count = 0;
+		buffer->base = 0;
+		buffer->events.resize(TRACE_BUFFER_EVENTS);
+		buffers.push_back(buffer);
+	}
+	return buffer;
+}
+
+const char* Tracer::internName(const char* name)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return names.insert(name).first->c_str();
+}
+
+//only the thread of the buffer writes in it, the count is published after the event is written
+void Tracer::record(const char* name, double start, const char* detail)
+{
+	sThreadBuffer* buffer = getThreadBuffer();
+	unsigned int index = buffer->count.load(std::memory_order_relaxed);
+	sEvent& event = buffer->events[index % TRACE_BUFFER_EVENTS];
+	event.name = name;
+	event.start = start;
+	event.duration = getTime() - start;
+	if (detail)
+	{
+		strncpy(event.detail, detail, TRACE_DETAIL_LENGTH - 1);
+		event.detail[TRACE_DETAIL_LENGTH - 1] = 0;
+	}
+	else
+		event.detail[0] = 0;
+	buffer->count.store(index + 1, std::memory_order_release);
+}
+
+static void writeJSONString(FILE* file, const char* text)
+{
+	fputc('"', file);
+	for (const char* c = text; *c; ++c)
+	{
+		if (*c == '"' || *c == '\\')
+			fputc('\\', file);
+		if ((unsigned char)*c >= 32)
+			fputc(*c, file);
+	}
+	fputc('"', file);
+}
+
+//the threads keep recording while the events are copied, the ones that may have been overwritten meanwhile
+//(the oldest of the buffer, and the slot being written after them) are skipped
+bool Tracer::exportJSON(const char* filename)
+{
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+	{
+		std::cout << "[ERROR]: trace could not be saved: " << filename << std::endl;
+		return false;
+	}
+
+	std::vector<sThreadBuffer*> threads;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		threads = buffers;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	int num_events = 0;
+	std::vector<sEvent> events(TRACE_BUFFER_EVENTS);
+	for (sThreadBuffer* buffer : threads)
+	{
+		unsigned int base = buffer->base.load(std::memory_order_acquire);
+		unsigned int end = buffer->count.load(std::memory_order_acquire);
+		unsigned int begin = std::max(base, end > TRACE_BUFFER_EVENTS ? end - TRACE_BUFFER_EVENTS : 0);
+		for (unsigned int i = begin; i < end; ++i)
+			events[i - begin] = buffer->events[i % TRACE_BUFFER_EVENTS];
+		//the writer can be in the middle of event written, which uses the slot of event written - TRACE_BUFFER_EVENTS
+		unsigned int written = buffer->count.load(std::memory_order_acquire);
+		unsigned int valid = written >= TRACE_BUFFER_EVENTS ? std::max(begin, written - TRACE_BUFFER_EVENTS + 1) : begin;
+
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Thread %d\"}}", first ? "" : ",\n", buffer->thread_id, buffer->thread_id);
+		first = false;
+		for (unsigned int i = valid; i < end; ++i)
+		{
+			sEvent& event = events[i - begin];
+			fprintf(file, ",\n{\"name\":");
+			writeJSONString(file, event.name);
+			fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", buffer->thread_id, event.start, event.duration);
+			if (event.detail[0])
+			{
+				fprintf(file, ",\"args\":{\"detail\":");
+				writeJSONString(file, event.detail);
+				fprintf(file, "}");
+			}
+			fprintf(file, "}");
+			num_events++;
+		}
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	std::cout << " + Trace saved: " << filename << " (" << num_events << " events, " << threads.size() << " threads)" << std::endl;
+	return true;
+}
+
+//the events are dropped, the buffers stay (their threads keep a pointer to them). The count is not reset because
+//the threads may be recording, the export starts from the base instead
+void Tracer::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (sThreadBuffer* buffer : buffers)
+		buffer->base.store(buffer->count.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+void Tracer::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	bool trace = enabled;
+	if (ImGui::Checkbox("Trace CPU (chrome://tracing)", &trace))
+		enabled = trace;
+	ImGui::SameLine();
+	if (ImGui::Button("Save trace (trace.json)"))
+		exportJSON("trace.json");
+	ImGui::SameLine();
+	if (ImGui::Button("Clear trace"))
+		clear();
+#endif
+}
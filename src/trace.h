@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace GTR {
+
+	//events kept per thread, the oldest ones are overwritten
+	const int TRACE_BUFFER_EVENTS = 16384;
+	const int TRACE_DETAIL_LENGTH = 48;
+
+	// CPU timeline of the loading and the frames, exported to the Chrome trace format (chrome://tracing, Perfetto).
+	// Every thread writes to its own ring buffer without locks, the only lock is taken the first time a thread
+	// records something. Use TRACE_SCOPE("name") at the start of a block, or TRACE_SCOPE_DETAIL("name", text) to add
+	// a text (a filename...). When it is disabled a scope only reads a flag; define DISABLE_TRACE to remove them
+	class Tracer
+	{
+	public:
+		struct sEvent {
+			const char* name;		//must be a literal, only the pointer is stored
+			double start;			//microseconds since the tracer was created
+			double duration;
+			char detail[TRACE_DETAIL_LENGTH];
+		};
+
+		struct sThreadBuffer {
+			int thread_id;
+			std::atomic<unsigned int> count;	//events written, the last TRACE_BUFFER_EVENTS are in the buffer
+			std::atomic<unsigned int> base;		//first event after the last clear, only the writer changes count
+			std::vector<sEvent> events;
+		};
+
+		static std::atomic<bool> enabled;
+
+		static double getTime();
+		static void record(const char* name, double start, const char* detail = NULL);
+		//copy of a name that is not a literal (std::string of a render pass...) that lives until the end, it takes a lock
+		static const char* internName(const char* name);
+
+		//writes the events in the buffers, returns false if the file could not be created
+		static bool exportJSON(const char* filename);
+		static void clear();
+		static void renderInMenu();
+
+	private:
+		static std::mutex mutex;						//only to add buffers and names
+		static std::vector<sThreadBuffer*> buffers;		//never freed, threads can finish before the export
+		static std::set<std::string> names;				//interned names, the nodes of a set do not move
+		static sThreadBuffer* getThreadBuffer();
+	};
+
+	//records the block where it is declared
+	struct TraceScope {
+		const char* name;
+		const char* detail;
+		double start;
+		TraceScope(const char* name, const char* detail = NULL) : name(name), detail(detail), start(-1.0) { if (Tracer::enabled.load(std::memory_order_relaxed)) start = Tracer::getTime(); }
+		~TraceScope() { if (start >= 0.0) Tracer::record(name, start, detail); }
+	};
+
+};
+
+#ifdef DISABLE_TRACE
+	#define TRACE_SCOPE(name)
+	#define TRACE_SCOPE_DETAIL(name, detail)
+#else
+	#define TRACE_SCOPE_CONCAT2(a, b) a##b
+	#define TRACE_SCOPE_CONCAT(a, b) TRACE_SCOPE_CONCAT2(a, b)
+	#define TRACE_SCOPE(name) GTR::TraceScope TRACE_SCOPE_CONCAT(_trace_scope_, __LINE__)(name)
+	#define TRACE_SCOPE_DETAIL(name, detail) GTR::TraceScope TRACE_SCOPE_CONCAT(_trace_scope_, __LINE__)(name, detail)
+#endif
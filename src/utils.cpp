@@ -7,6 +7,7 @@
 #endif
 
 #include <math.h>
+#include <algorithm>
 
 #include "includes.h"
 
@@ -14,6 +15,7 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
+#include "profiler.h"
 
 #include "extra/stb_easy_font.h"
 
@@ -65,6 +67,8 @@ void* getGLProcAddress(const char* name)
 	#define GetCurrentDir _getcwd
 #else
 	#include <unistd.h>
+	#include <dirent.h>
+	#include <sys/stat.h>
 	#define GetCurrentDir getcwd
 #endif
 
@@ -96,6 +100,62 @@ std::string getPath()
     return fullpath;
 }
 
+std::vector<std::string> listFolder(const std::string& folder, bool folders)
+{
+	std::vector<std::string> names;
+#ifdef WIN32
+	WIN32_FIND_DATAA data;
+	HANDLE handle = FindFirstFileA((folder + "/*").c_str(), &data);
+	if (handle == INVALID_HANDLE_VALUE)
+		return names;
+	do {
+		std::string name = data.cFileName;
+		bool is_folder = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		if (name != "." && name != ".." && is_folder == folders)
+			names.push_back(name);
+	} while (FindNextFileA(handle, &data));
+	FindClose(handle);
+#else
+	DIR* dir = opendir(folder.c_str());
+	if (!dir)
+		return names;
+	while (dirent* entry = readdir(dir))
+	{
+		std::string name = entry->d_name;
+		struct stat info;
+		if (name == "." || name == ".." || stat((folder + "/" + name).c_str(), &info) != 0)
+			continue;
+		if (S_ISDIR(info.st_mode) == folders)
+			names.push_back(name);
+	}
+	closedir(dir);
+#endif
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+bool createFolder(const std::string& folder)
+{
+	for (size_t i = 1; i <= folder.size(); ++i)
+	{
+		if (i < folder.size() && folder[i] != '/' && folder[i] != '\\')
+			continue;
+		std::string path = folder.substr(0, i);
+#ifdef WIN32
+		_mkdir(path.c_str());
+#else
+		mkdir(path.c_str(), 0755);
+#endif
+	}
+#ifdef WIN32
+	DWORD attributes = GetFileAttributesA(folder.c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat info;
+	return stat(folder.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
 bool readFile(const std::string& filename, std::string& content)
 {
 	content.clear();
@@ -286,9 +346,18 @@ std::string getGPUStats()
 		nCurAvailMemoryInKB = 0;
 	}
 
-	std::string str = "FPS: " + std::to_string(Application::instance->fps) + " DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB-nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
-	Mesh::num_meshes_rendered = 0;
-	Mesh::num_triangles_rendered = 0;
+	std::string str = "FPS: " + std::to_string(Application::instance->fps) + " VRAM: " + std::to_string(int((nTotalMemoryInKB-nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
+
+	//counters of the last frame recorded by the profiler
+	GTR::sRenderStats stats;
+	if (GTR::Profiler::instance && GTR::Profiler::instance->getStats("Frame", stats))
+	{
+		int64_t* c = stats.counters;
+		str += "\nDCS: " + std::to_string(c[GTR::STAT_DRAW_CALLS]) + " Culled: " + std::to_string(c[GTR::STAT_CULLED]) + " Tris: " + std::to_string(c[GTR::STAT_TRIANGLES] / 1000) + "Ks";
+		str += "\nShaders: " + std::to_string(c[GTR::STAT_SHADER_BINDS]) + " Textures: " + std::to_string(c[GTR::STAT_TEXTURE_BINDS]) + " Uniforms: " + std::to_string(c[GTR::STAT_UNIFORMS]) + " FBOs: " + std::to_string(c[GTR::STAT_FBO_BINDS]) + " Blits: " + std::to_string(c[GTR::STAT_BLITS]);
+	}
+	else
+		str += "\nDCS: - (profiler disabled)";
 	return str;
 }
 
@@ -492,7 +561,7 @@ std::vector<Vector3> GTR::generateSpherePoints(int num, float radius, bool hemi)
 {
 	std::vector<Vector3> points;
 	points.resize(num);
-	for (int i = 0; i < num; i += 3)
+	for (int i = 0; i < num; ++i)
 	{
 		Vector3& p = points[i];
 		float u = random();
@@ -511,4 +580,17 @@ std::vector<Vector3> GTR::generateSpherePoints(int num, float radius, bool hemi)
 			p.z *= -1.0;
 	}
 	return points;
+}
+
+float GTR::halton(int index, int base)
+{
+	float result = 0.0f;
+	float fraction = 1.0f;
+	while (index > 0)
+	{
+		fraction /= base;
+		result += fraction * (index % base);
+		index /= base;
+	}
+	return result;
 }
\ No newline at end of file
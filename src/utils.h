@@ -24,6 +24,10 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale = 1);
 bool checkGLErrors();
 
 std::string getPath();
+//names of the files (or the folders) inside a folder, sorted
+std::vector<std::string> listFolder(const std::string& folder, bool folders = false);
+//creates the folder and the ones that contain it, true if it exists after the call
+bool createFolder(const std::string& folder);
 
 Vector3 gamma(Vector3 color);
 Vector3 degamma(Vector3 color);
@@ -56,6 +60,9 @@ Vector3 pow(Vector3 base, Vector3 exponent);
 
 namespace GTR {
 	std::vector<Vector3> generateSpherePoints(int num, float radius, bool hemi);
+
+	//low discrepancy sequence in 0..1, index starts at 1 (base 2 and 3 are used for the TAA jitter)
+	float halton(int index, int base);
 }
 
 #endif